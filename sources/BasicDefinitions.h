@@ -20,16 +20,22 @@
 #ifndef BASICDEFINITIONS_INCLUDED
 #define BASICDEFINITIONS_INCLUDED
 
-// Log of the maximum number of points in the database
+// Number of bits of a point index stored directly in an entry of a
+// HT_HYBRID_CHAINS table.
 #define N_BITS_PER_POINT_INDEX 22
-// Maximum number of points = (2^N_BITS_PER_POINT_INDEX-2)
-#define MAX_N_POINTS ((1U << N_BITS_PER_POINT_INDEX) - 1)
+// The largest point index that fits in an entry of a HT_HYBRID_CHAINS
+// table (= 2^N_BITS_PER_POINT_INDEX-1). Tables holding larger indeces
+// keep the high bits of the indeces in a side array.
+#define MAX_N_POINTS_NARROW_ENTRIES ((1U << N_BITS_PER_POINT_INDEX) - 1)
+// Maximum number of points (points are indexed by Int32T's).
+#define MAX_N_POINTS 2147483647U
 // Maxumum number of points to be reported (i.e., the "k" if interested in "k-NN")
 #define MAX_REPORTED_POINTS 10
 
 #define IntT int
 #define LongUns64T long long unsigned
 #define Uns32T unsigned
+#define Uns16T unsigned short
 #define Int32T int
 #define BooleanT int
 #define TRUE 1
@@ -199,13 +205,35 @@
 #define TIMEV_END(timeVar)
 #endif
 
-#define MALLOC(amount) ((amount > 0) ? totalAllocatedMemory += amount, malloc(amount) : NULL)
+// <totalAllocatedMemory> is updated atomically, since the shard
+// builds (RinitLSH_WithDataSetSharded) allocate from several threads.
+#define MALLOC(amount) ((amount > 0) ? __sync_fetch_and_add(&totalAllocatedMemory, (MemVarT)(amount)), malloc(amount) : NULL)
+
+// Allocates <amount> bytes aligned to <alignment> (a power of 2); the
+// memory is released with free()/FREE.
+#define MALLOC_ALIGNED(alignment, amount) ((amount > 0) ? __sync_fetch_and_add(&totalAllocatedMemory, (MemVarT)(amount)), aligned_alloc(alignment, ((amount) + (alignment) - 1) / (alignment) * (alignment)) : NULL)
 
 #define REALLOC(oldPointer, amount) ((oldPointer != NULL) ? \
- totalAllocatedMemory += amount / 3, \
+ __sync_fetch_and_add(&totalAllocatedMemory, (MemVarT)(amount) / 3), \
  realloc(oldPointer, amount) : \
  MALLOC(amount))
 
 #define FREE(pointer) {if (pointer != NULL) {free(pointer);} pointer = NULL; }
 
+// The placement of the large regions (the storage and the directories
+// of the packed hash tables, and the point arena). The flags can be
+// combined; see allocateLargeRegion in Util.cpp.
+#define LARGE_REGION_HEAP 0 // plain malloc.
+#define LARGE_REGION_HUGE_PAGES 1 // MAP_HUGETLB; falls back to LARGE_REGION_THP.
+#define LARGE_REGION_THP 2 // transparent huge pages (madvise(MADV_HUGEPAGE)).
+#define LARGE_REGION_NUMA_INTERLEAVE 4 // pages interleaved over the online NUMA nodes.
+#define LARGE_REGION_DEFAULT LARGE_REGION_THP
+
+// Allocates a large region with the placement <placement> (a
+// combination of the LARGE_REGION_* flags); the region is aligned to
+// 64 bytes and is released with FREE_LARGE (never with free()/FREE).
+#define MALLOC_LARGE(amount, placement) (allocateLargeRegion((MemVarT)(amount), (placement)))
+
+#define FREE_LARGE(pointer) {if (pointer != NULL) {freeLargeRegion(pointer);} pointer = NULL; }
+
 #endif
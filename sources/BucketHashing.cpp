@@ -30,7 +30,7 @@ inline PGBucketT newGBucket(PUHashStructureT uhash, Uns32T control1, /*PPointT p
     uhash->unusedPGBuckets = uhash->unusedPGBuckets->nextGBucketInChain;
   } else {
     FAILIF(NULL == (bucket = (PGBucketT)MALLOC(sizeof(GBucketT))));
-    nAllocatedGBuckets++;
+    __sync_fetch_and_add(&nAllocatedGBuckets, 1);
   }
   ASSERT(bucket != NULL);
   bucket->controlValue1 = control1;
@@ -38,7 +38,7 @@ inline PGBucketT newGBucket(PUHashStructureT uhash, Uns32T control1, /*PPointT p
   bucket->firstEntry.nextEntry = NULL;
   bucket->nextGBucketInChain = nextGBucket;
 
-  nGBuckets++;
+  __sync_fetch_and_add(&nGBuckets, 1); // the shard builds add buckets concurrently
   return bucket;
 }
 
@@ -56,7 +56,7 @@ inline void addPointToGBucket(PUHashStructureT uhash, PGBucketT bucket/*, PPoint
     uhash->unusedPBucketEntrys = uhash->unusedPBucketEntrys->nextEntry;
   }else{
     FAILIF(NULL == (bucketEntry = (PBucketEntryT)MALLOC(sizeof(BucketEntryT))));
-    nAllocatedBEntries++;
+    __sync_fetch_and_add(&nAllocatedBEntries, 1);
   }
   ASSERT(bucketEntry != NULL);
   bucketEntry->pointIndex = pointIndex;
@@ -66,15 +66,305 @@ inline void addPointToGBucket(PUHashStructureT uhash, PGBucketT bucket/*, PPoint
   bucket->firstEntry.nextEntry = bucketEntry;
 }
 
+// Returns the number of entries of a hybrid bucket (whose first point
+// is <firstPoint>) that are stored inline in the chain. Buckets with
+// "overflow" points (bucketLength == 0) keep exactly
+// MAX_NONOVERFLOW_POINTS_PER_BUCKET points inline.
+inline Uns32T hybridBucketInlineLength(PHybridChainEntryT firstPoint){
+  return firstPoint->point.bucketLength != 0 ? firstPoint->point.bucketLength : MAX_NONOVERFLOW_POINTS_PER_BUCKET;
+}
+
+// Returns the first entry of the chain of the slot <hIndex> of the
+// HT_HYBRID_CHAINS table <uhash>, or NULL if the slot is empty.
+inline PHybridChainEntryT hybridSlotChain(PUHashStructureT uhash, Uns32T hIndex){
+  Uns32T chainStart = uhash->hashTable.hybridHashTable[hIndex];
+  return chainStart != HYBRID_SLOT_EMPTY ? uhash->hybridChainsStorage + chainStart : NULL;
+}
+
+// Stores <pointIndex> in the entry <entryIndex> of the storage of the
+// HT_HYBRID_CHAINS table <uhash> (the storage has <nEntries>
+// entries). The first index that does not fit in an entry makes the
+// table keep the high bits of all its indeces (<hybridPointHighBits>),
+// so only the tables of large data sets pay for them.
+inline void setHybridEntryPointIndex(PUHashStructureT uhash, Uns32T entryIndex, Int32T pointIndex, MemVarT nEntries){
+  ASSERT(pointIndex >= 0);
+  uhash->hybridChainsStorage[entryIndex].point.pointIndex = (Uns32T)pointIndex & MAX_N_POINTS_NARROW_ENTRIES;
+  if ((Uns32T)pointIndex > MAX_N_POINTS_NARROW_ENTRIES && uhash->hybridPointHighBits == NULL){
+    FAILIF(NULL == (uhash->hybridPointHighBits = (Uns16T*)MALLOC_LARGE(nEntries * sizeof(Uns16T), uhash->memoryPlacement)));
+    memset(uhash->hybridPointHighBits, 0, nEntries * sizeof(Uns16T));
+  }
+  if (uhash->hybridPointHighBits != NULL){
+    uhash->hybridPointHighBits[entryIndex] = (Uns16T)((Uns32T)pointIndex >> N_BITS_PER_POINT_INDEX);
+  }
+}
+
+// Returns the slot of the table <uhash> for the main hash value <h>.
+inline Uns32T uhashSlotIndex(PUHashStructureT uhash, Uns32T h){
+  return uhash->hashTableMask != 0 ? (h & uhash->hashTableMask) : h % uhash->hashTableSize;
+}
+
+// Generates a new main hash function and a new control hash function
+// for hashing vectors of <bucketVectorLength> Uns32T's. They can be
+// shared by several tables (passed to newUHashStructure as external
+// UHFs); the table freed with freeHashFunctions=TRUE releases them.
+void newUHashFunctions(IntT bucketVectorLength, Uns32T *(&mainHashA), Uns32T *(&controlHash1)){
+  FAILIF(NULL == (mainHashA = (Uns32T*)MALLOC(bucketVectorLength * sizeof(Uns32T))));
+  for(IntT i = 0; i < bucketVectorLength; i++){
+    mainHashA[i] = genRandomUns32(1, MAX_HASH_RND);
+  }
+  FAILIF(NULL == (controlHash1 = (Uns32T*)MALLOC(bucketVectorLength * sizeof(Uns32T))));
+  for(IntT i = 0; i < bucketVectorLength; i++){
+    controlHash1[i] = genRandomUns32(1, MAX_HASH_RND);
+  }
+}
+
+// Returns the number of bits of the largest difference between
+// consecutive elements of the sorted array <points> of <length> point
+// indeces (at most 31, since point indeces are below 2^31).
+inline Uns32T postingDifferenceWidth(Int32T *points, Uns32T length){
+  Uns32T width = 0;
+  for(Uns32T j = 1; j < length; j++){
+    while (((Uns32T)(points[j] - points[j - 1]) >> width) != 0){
+      width++;
+    }
+  }
+  return width;
+}
+
+// Replaces the points of the buckets of the directory table <uhash>
+// (in <bucketDirectoryPoints>) by compressed posting lists (see
+// COMPRESSED_POSTING_MIN_LENGTH) in <compressedPostings>.
+void compressDirectoryPostings(PUHashStructureT uhash){
+  // Sort the points of each bucket and compute the size of its posting list.
+  MemVarT nWords = 0;
+  for(Uns32T position = 0; position <= uhash->bucketDirectoryMask; position++){
+    PBucketDirectoryEntryT entry = uhash->hashTable.bucketDirectory + position;
+    if (entry->length == 0){
+      continue;
+    }
+    Int32T *points = uhash->bucketDirectoryPoints + entry->offset;
+    std::sort(points, points + entry->length);
+    nWords += COMPRESSED_POSTING_WORDS(entry->length, postingDifferenceWidth(points, entry->length));
+  }
+
+  FAILIFWR(nWords >= TWO_TO_32_MINUS_1, "Too many posting words for a HT_COMPRESSED_DIRECTORY table.");
+  FAILIF(NULL == (uhash->compressedPostings = (Uns32T*)MALLOC_LARGE(MAX(nWords, 1) * sizeof(Uns32T), uhash->memoryPlacement)));
+  memset(uhash->compressedPostings, 0, MAX(nWords, 1) * sizeof(Uns32T));
+  uhash->nCompressedPostingWords = nWords;
+
+  Uns32T nextWord = 0;
+  for(Uns32T position = 0; position <= uhash->bucketDirectoryMask; position++){
+    PBucketDirectoryEntryT entry = uhash->hashTable.bucketDirectory + position;
+    if (entry->length == 0){
+      continue;
+    }
+    Int32T *points = uhash->bucketDirectoryPoints + entry->offset;
+    Uns32T *posting = uhash->compressedPostings + nextWord;
+    entry->offset = nextWord;
+    if (entry->length < COMPRESSED_POSTING_MIN_LENGTH){
+      memcpy(posting, points, entry->length * sizeof(Uns32T));
+      nextWord += entry->length;
+      continue;
+    }
+
+    Uns32T width = postingDifferenceWidth(points, entry->length);
+    posting[0] = points[0];
+    posting[1] = width;
+    Uns32T *packed = posting + COMPRESSED_POSTING_HEADER_WORDS;
+    for(Uns32T j = 1; j < entry->length; j++){
+      Uns32T difference = points[j] - points[j - 1];
+      Uns32T bit = j / COMPRESSED_POSTING_LANES * width;
+      Uns32T shift = bit & 31;
+      Uns32T *word = packed + COMPRESSED_POSTING_LANES * (bit >> 5) + j % COMPRESSED_POSTING_LANES;
+      *word |= difference << shift;
+      if (shift + width > 32){
+	*(word + COMPRESSED_POSTING_LANES) |= difference >> (32 - shift);
+      }
+    }
+    nextWord += COMPRESSED_POSTING_WORDS(entry->length, width);
+  }
+  ASSERT(nextWord == nWords);
+
+  FREE_LARGE(uhash->bucketDirectoryPoints);
+}
+
+// Builds the directory of the HT_PERFECT_HASH table <uhash> from the
+// buckets of the model table <modelHT>: finds a seed for every group
+// of keys (the largest groups first, while most entries are free) so
+// that the keys of the group go to distinct free entries, places the
+// groups of a single key directly, and then stores the points of the
+// buckets in the order of the directory.
+void buildPerfectHashDirectory(PUHashStructureT uhash, PUHashStructureT modelHT){
+  ASSERT(modelHT != NULL && modelHT->typeHT == HT_LINKED_LIST);
+  Uns32T nBuckets = modelHT->nHashedBuckets;
+  Uns32T nEntries = MAX(nBuckets, 1);
+  Uns32T nGroups = MAX((nBuckets + PERFECT_HASH_BUCKETS_PER_GROUP - 1) / PERFECT_HASH_BUCKETS_PER_GROUP, 1);
+  uhash->bucketDirectoryMask = nEntries - 1;
+  uhash->nPerfectHashGroups = nGroups;
+  FAILIF(NULL == (uhash->hashTable.bucketDirectory = (PBucketDirectoryEntryT)MALLOC_LARGE((MemVarT)nEntries * sizeof(BucketDirectoryEntryT), uhash->memoryPlacement)));
+  memset(uhash->hashTable.bucketDirectory, 0, (MemVarT)nEntries * sizeof(BucketDirectoryEntryT));
+  FAILIF(NULL == (uhash->perfectHashSeeds = (Uns32T*)MALLOC(nGroups * sizeof(Uns32T))));
+  FAILIF(NULL == (uhash->bucketDirectoryPoints = (Int32T*)MALLOC_LARGE(MAX(modelHT->nHashedPoints, 1) * sizeof(Int32T), uhash->memoryPlacement)));
+
+  // The buckets (and their slots and key hashes), sorted by group.
+  Uns32T *groupStart;
+  PGBucketT *groupBuckets;
+  Uns32T *groupSlots;
+  LongUns64T *groupKeyHashes;
+  FAILIF(NULL == (groupStart = (Uns32T*)MALLOC((nGroups + 1) * sizeof(Uns32T))));
+  FAILIF(NULL == (groupBuckets = (PGBucketT*)MALLOC(nEntries * sizeof(PGBucketT))));
+  FAILIF(NULL == (groupSlots = (Uns32T*)MALLOC(nEntries * sizeof(Uns32T))));
+  FAILIF(NULL == (groupKeyHashes = (LongUns64T*)MALLOC(nEntries * sizeof(LongUns64T))));
+  memset(groupStart, 0, (nGroups + 1) * sizeof(Uns32T));
+  for(Int32T i = 0; i < modelHT->hashTableSize; i++){
+    for(PGBucketT bucket = modelHT->hashTable.llHashTable[i]; bucket != NULL; bucket = bucket->nextGBucketInChain){
+      groupStart[perfectHashGroup(i, bucket->controlValue1, nGroups) + 1]++;
+    }
+  }
+  Uns32T maxGroupSize = 0;
+  for(Uns32T g = 0; g < nGroups; g++){
+    maxGroupSize = MAX(maxGroupSize, groupStart[g + 1]);
+    groupStart[g + 1] += groupStart[g];
+  }
+  ASSERT(groupStart[nGroups] == nBuckets);
+  for(Int32T i = 0; i < modelHT->hashTableSize; i++){
+    for(PGBucketT bucket = modelHT->hashTable.llHashTable[i]; bucket != NULL; bucket = bucket->nextGBucketInChain){
+      // <groupStart[g]> is the next free position of the group <g>
+      // (and becomes the end of the group).
+      Uns32T g = perfectHashGroup(i, bucket->controlValue1, nGroups);
+      groupBuckets[groupStart[g]] = bucket;
+      groupSlots[groupStart[g]] = i;
+      groupKeyHashes[groupStart[g]] = perfectHashMix(i, bucket->controlValue1, 1);
+      groupStart[g]++;
+    }
+  }
+  for(Uns32T g = nGroups; g > 0; g--){
+    groupStart[g] = groupStart[g - 1];
+  }
+  groupStart[0] = 0;
+
+  Uns32T *groupOrder;
+  FAILIF(NULL == (groupOrder = (Uns32T*)MALLOC(nGroups * sizeof(Uns32T))));
+  for(Uns32T g = 0; g < nGroups; g++){
+    groupOrder[g] = g;
+  }
+  std::sort(groupOrder, groupOrder + nGroups, [groupStart](Uns32T a, Uns32T b){
+    return groupStart[a + 1] - groupStart[a] > groupStart[b + 1] - groupStart[b];
+  });
+
+  // Find the seeds. <entryBuckets[p]> is the bucket placed in the
+  // entry <p> (NULL if the entry is free); the bit <p> of
+  // <usedEntries> is set if the entry is taken (the seed search tests
+  // this bitmap, which stays in cache).
+  PGBucketT *entryBuckets;
+  Uns32T *usedEntries;
+  Uns32T *positions;
+  FAILIF(NULL == (entryBuckets = (PGBucketT*)MALLOC(nEntries * sizeof(PGBucketT))));
+  FAILIF(NULL == (usedEntries = (Uns32T*)MALLOC((nEntries / 32 + 1) * sizeof(Uns32T))));
+  memset(usedEntries, 0, (nEntries / 32 + 1) * sizeof(Uns32T));
+  FAILIF(NULL == (positions = (Uns32T*)MALLOC(MAX(maxGroupSize, 1) * sizeof(Uns32T))));
+  memset(entryBuckets, 0, nEntries * sizeof(PGBucketT));
+  Uns32T nextFreeEntry = 0;
+  for(Uns32T o = 0; o < nGroups; o++){
+    Uns32T g = groupOrder[o];
+    Uns32T groupSize = groupStart[g + 1] - groupStart[g];
+    Uns32T seed = 0;
+    if (groupSize == 1){
+      while ((usedEntries[nextFreeEntry >> 5] & (1U << (nextFreeEntry & 31))) != 0){
+	nextFreeEntry++;
+      }
+      positions[0] = nextFreeEntry;
+      seed = PERFECT_HASH_DIRECT_SEED + nextFreeEntry;
+    }
+    for(BooleanT placed = groupSize == 1; !placed && groupSize > 0; ){
+      FAILIFWR(seed > PERFECT_HASH_MAX_SEED, "Could not build the perfect hash function of a HT_PERFECT_HASH table.");
+      placed = TRUE;
+      for(Uns32T k = 0; k < groupSize && placed; k++){
+	Uns32T j = groupStart[g] + k;
+	positions[k] = perfectHashPosition(groupKeyHashes[j], seed, nEntries);
+	placed = (usedEntries[positions[k] >> 5] & (1U << (positions[k] & 31))) == 0 ? TRUE : FALSE;
+	for(Uns32T l = 0; l < k && placed; l++){
+	  placed = positions[l] != positions[k] ? TRUE : FALSE;
+	}
+      }
+      if (!placed){
+	seed++;
+      }
+    }
+    uhash->perfectHashSeeds[g] = seed;
+    for(Uns32T k = 0; k < groupSize; k++){
+      Uns32T j = groupStart[g] + k;
+      PBucketDirectoryEntryT entry = uhash->hashTable.bucketDirectory + positions[k];
+      entry->slot = groupSlots[j];
+      entry->controlValue1 = groupBuckets[j]->controlValue1;
+      entryBuckets[positions[k]] = groupBuckets[j];
+      usedEntries[positions[k] >> 5] |= 1U << (positions[k] & 31);
+    }
+  }
+
+  Uns32T nextPoint = 0;
+  for(Uns32T position = 0; position < nEntries; position++){
+    PBucketDirectoryEntryT entry = uhash->hashTable.bucketDirectory + position;
+    entry->offset = nextPoint;
+    for(PBucketEntryT bucketEntry = entryBuckets[position] != NULL ? &(entryBuckets[position]->firstEntry) : NULL; bucketEntry != NULL; bucketEntry = bucketEntry->nextEntry){
+      uhash->bucketDirectoryPoints[nextPoint] = bucketEntry->pointIndex;
+      nextPoint++;
+    }
+    entry->length = nextPoint - entry->offset;
+  }
+  ASSERT(nextPoint == (Uns32T)modelHT->nHashedPoints);
+
+  free(groupStart);
+  free(groupBuckets);
+  free(groupSlots);
+  free(groupKeyHashes);
+  free(groupOrder);
+  free(entryBuckets);
+  free(usedEntries);
+  free(positions);
+}
+
+// Builds the fast-reject filter of the packed table <uhash> from the
+// buckets of its model table <modelHT> (a bucket keeps its slot in
+// the packed table). See BUCKET_FILTER_BITS_PER_BUCKET.
+void buildBucketFilter(PUHashStructureT uhash, PUHashStructureT modelHT){
+  ASSERT(modelHT != NULL && modelHT->typeHT == HT_LINKED_LIST);
+  ASSERT(uhash->hashTableSize == modelHT->hashTableSize);
+  MemVarT nBits = (MemVarT)modelHT->nHashedBuckets * BUCKET_FILTER_BITS_PER_BUCKET;
+  MemVarT nBlocks = 1;
+  while (nBlocks * 64 < nBits && nBlocks * sizeof(LongUns64T) < BUCKET_FILTER_MAX_BYTES){
+    nBlocks *= 2;
+  }
+  if (nBlocks * 64 < (MemVarT)modelHT->nHashedBuckets * BUCKET_FILTER_MIN_BITS_PER_BUCKET){
+    // The filter would reject too few of the probes.
+    return;
+  }
+
+  FAILIF(NULL == (uhash->bucketFilter = (LongUns64T*)MALLOC_ALIGNED(BUCKET_DIRECTORY_ALIGNMENT, nBlocks * sizeof(LongUns64T))));
+  memset(uhash->bucketFilter, 0, nBlocks * sizeof(LongUns64T));
+  uhash->bucketFilterMask = (Uns32T)(nBlocks - 1);
+  for(Int32T i = 0; i < modelHT->hashTableSize; i++){
+    for(PGBucketT bucket = modelHT->hashTable.llHashTable[i]; bucket != NULL; bucket = bucket->nextGBucketInChain){
+      LongUns64T bits;
+      Uns32T block = bucketFilterBlock(uhash, i, bucket->controlValue1, bits);
+      uhash->bucketFilter[block] |= bits;
+    }
+  }
+}
+
 // Creates a new UH structure (initializes the hash table and the hash
 // functions used). If <typeHT>==HT_PACKED or HT_HYBRID_CHAINS, then
 // <modelHT> gives the sizes of all the static arrays that are
-// used. Otherwise parameter <modelHT> is not used.
-PUHashStructureT newUHashStructure(IntT typeHT, Int32T hashTableSize, IntT bucketVectorLength, BooleanT useExternalUHFs, Uns32T *(&mainHashA), Uns32T *(&controlHash1), PUHashStructureT modelHT){
+// used. Otherwise parameter <modelHT> is not used. The large regions
+// of the table are allocated with <memoryPlacement> (a combination of
+// the LARGE_REGION_* flags, see allocateLargeRegion).
+PUHashStructureT newUHashStructure(IntT typeHT, Int32T hashTableSize, IntT bucketVectorLength, BooleanT useExternalUHFs, Uns32T *(&mainHashA), Uns32T *(&controlHash1), PUHashStructureT modelHT, IntT memoryPlacement){
   PUHashStructureT uhash;
   FAILIF(NULL == (uhash = (PUHashStructureT)MALLOC(sizeof(UHashStructureT))));
   uhash->typeHT = typeHT;
+  uhash->memoryPlacement = memoryPlacement;
   uhash->hashTableSize = hashTableSize;
+  uhash->hashTableMask = (hashTableSize & (hashTableSize - 1)) == 0 ? hashTableSize - 1 : 0;
   uhash->nHashedBuckets = 0;
   uhash->nHashedPoints = 0;
   uhash->unusedPGBuckets = NULL;
@@ -86,10 +376,19 @@ PUHashStructureT newUHashStructure(IntT typeHT, Int32T hashTableSize, IntT bucke
   uhash->chainSizes = NULL;
   uhash->bucketPoints.pointsArray = NULL;
   uhash->hybridChainsStorage = NULL;
+  uhash->hybridPointHighBits = NULL;
+  uhash->bucketDirectoryPoints = NULL;
+  uhash->bucketDirectoryMask = 0;
+  uhash->perfectHashSeeds = NULL;
+  uhash->nPerfectHashGroups = 0;
+  uhash->compressedPostings = NULL;
+  uhash->nCompressedPostingWords = 0;
+  uhash->bucketFilter = NULL;
+  uhash->bucketFilterMask = 0;
 
   Int32T totalN = 0;
-  Int32T indexInStorage = 0;
-  Int32T lastIndexInSt = 0;
+  Uns32T indexInStorage = 0;
+  Uns32T lastIndexInSt = 0;
   switch (typeHT) {
   case HT_LINKED_LIST:
     FAILIF(NULL == (uhash->hashTable.llHashTable = (PGBucketT*)MALLOC(hashTableSize * sizeof(PGBucketT))));
@@ -162,8 +461,9 @@ PUHashStructureT newUHashStructure(IntT typeHT, Int32T hashTableSize, IntT bucke
   case HT_HYBRID_CHAINS:
     ASSERT(modelHT != NULL);
     ASSERT(modelHT->typeHT == HT_LINKED_LIST);
-    FAILIF(NULL == (uhash->hashTable.hybridHashTable = (PHybridChainEntryT*)MALLOC(hashTableSize * sizeof(PHybridChainEntryT))));
-    FAILIF(NULL == (uhash->hybridChainsStorage = (HybridChainEntryT*)MALLOC((modelHT->nHashedPoints + modelHT->nHashedBuckets) * sizeof(HybridChainEntryT))));
+    FAILIFWR((MemVarT)modelHT->nHashedPoints + modelHT->nHashedBuckets >= HYBRID_SLOT_EMPTY, "Too many entries for a HT_HYBRID_CHAINS table.");
+    FAILIF(NULL == (uhash->hashTable.hybridHashTable = (Uns32T*)MALLOC_LARGE(hashTableSize * sizeof(Uns32T), uhash->memoryPlacement)));
+    FAILIF(NULL == (uhash->hybridChainsStorage = (HybridChainEntryT*)MALLOC_LARGE(((MemVarT)modelHT->nHashedPoints + modelHT->nHashedBuckets) * sizeof(HybridChainEntryT), uhash->memoryPlacement)));
     
     // the index of the first unoccupied entry in <uhash->hybridChainsStorage>.
     indexInStorage = 0; 
@@ -173,14 +473,14 @@ PUHashStructureT newUHashStructure(IntT typeHT, Int32T hashTableSize, IntT bucke
     // at the beginning we fill the normal buckets with their points;
     // at the end we fill the "overflow" points of buckets (additional points of buckets that have
     // more than MAX_NONOVERFLOW_POINTS_PER_BUCKET points).
-    lastIndexInSt = modelHT->nHashedPoints + modelHT->nHashedBuckets - 1; 
+    lastIndexInSt = (Uns32T)modelHT->nHashedPoints + modelHT->nHashedBuckets - 1; 
 
     for(Int32T i = 0; i < hashTableSize; i++){
       PGBucketT bucket = modelHT->hashTable.llHashTable[i];
       if (bucket != NULL){
-	      uhash->hashTable.hybridHashTable[i] = uhash->hybridChainsStorage + indexInStorage; // the position where the bucket starts
+	      uhash->hashTable.hybridHashTable[i] = indexInStorage; // the position where the bucket starts
       }else{
-	      uhash->hashTable.hybridHashTable[i] = NULL;
+	      uhash->hashTable.hybridHashTable[i] = HYBRID_SLOT_EMPTY;
       }
       while(bucket != NULL){
 	      // Compute number of points in the current bucket.
@@ -202,7 +502,7 @@ PUHashStructureT newUHashStructure(IntT typeHT, Int32T hashTableSize, IntT bucke
 									 nPointsInBucket : 
 									 0); // 0 means there are "overflow" points
 	      uhash->hybridChainsStorage[indexInStorage].point.isLastPoint = (nPointsInBucket == 1 ? 1 : 0);
-	      uhash->hybridChainsStorage[indexInStorage].point.pointIndex = bucket->firstEntry.pointIndex;
+	      setHybridEntryPointIndex(uhash, indexInStorage, bucket->firstEntry.pointIndex, (MemVarT)modelHT->nHashedPoints + modelHT->nHashedBuckets);
 	      indexInStorage++;
 
 	      // Store all other points in the storage
@@ -236,7 +536,7 @@ PUHashStructureT newUHashStructure(IntT typeHT, Int32T hashTableSize, IntT bucke
 
 	      bucketEntry = bucket->firstEntry.nextEntry;
 	      while(bucketEntry != NULL){
-	        uhash->hybridChainsStorage[currentIndex].point.pointIndex = bucketEntry->pointIndex;
+	        setHybridEntryPointIndex(uhash, currentIndex, bucketEntry->pointIndex, (MemVarT)modelHT->nHashedPoints + modelHT->nHashedBuckets);
 	        uhash->hybridChainsStorage[currentIndex].point.isLastPoint = 0;
 	        bucketEntry = bucketEntry->nextEntry;
 
@@ -258,35 +558,96 @@ PUHashStructureT newUHashStructure(IntT typeHT, Int32T hashTableSize, IntT bucke
     uhash->nHashedPoints = modelHT->nHashedPoints;
     uhash->nHashedBuckets = modelHT->nHashedBuckets;
     break;
+  case HT_BUCKET_DIRECTORY:
+  case HT_COMPRESSED_DIRECTORY:
+    ASSERT(modelHT != NULL);
+    ASSERT(modelHT->typeHT == HT_LINKED_LIST);
+    {
+      // The directory has a power of 2 number of entries, at most
+      // BUCKET_DIRECTORY_MAX_LOAD of them occupied.
+      Uns32T directorySize = BUCKET_DIRECTORY_LINE_ENTRIES;
+      while (directorySize * BUCKET_DIRECTORY_MAX_LOAD < modelHT->nHashedBuckets){
+	directorySize *= 2;
+      }
+      uhash->bucketDirectoryMask = directorySize - 1;
+      FAILIF(NULL == (uhash->hashTable.bucketDirectory = (PBucketDirectoryEntryT)MALLOC_LARGE((MemVarT)directorySize * sizeof(BucketDirectoryEntryT), uhash->memoryPlacement)));
+      memset(uhash->hashTable.bucketDirectory, 0, (MemVarT)directorySize * sizeof(BucketDirectoryEntryT));
+      FAILIF(NULL == (uhash->bucketDirectoryPoints = (Int32T*)MALLOC_LARGE(MAX(modelHT->nHashedPoints, 1) * sizeof(Int32T), uhash->memoryPlacement)));
+
+      Uns32T nextPoint = 0;
+      for(Int32T i = 0; i < hashTableSize; i++){
+	for(PGBucketT bucket = modelHT->hashTable.llHashTable[i]; bucket != NULL; bucket = bucket->nextGBucketInChain){
+	  // Find a free entry by linear probing.
+	  Uns32T position = ((Uns32T)i ^ bucket->controlValue1) & uhash->bucketDirectoryMask;
+	  while (uhash->hashTable.bucketDirectory[position].length != 0){
+	    position = (position + 1) & uhash->bucketDirectoryMask;
+	  }
+	  PBucketDirectoryEntryT entry = uhash->hashTable.bucketDirectory + position;
+	  entry->slot = i;
+	  entry->controlValue1 = bucket->controlValue1;
+	  entry->offset = nextPoint;
+	  for(PBucketEntryT bucketEntry = &(bucket->firstEntry); bucketEntry != NULL; bucketEntry = bucketEntry->nextEntry){
+	    uhash->bucketDirectoryPoints[nextPoint] = bucketEntry->pointIndex;
+	    nextPoint++;
+	  }
+	  entry->length = nextPoint - entry->offset;
+	}
+      }
+      ASSERT(nextPoint == (Uns32T)modelHT->nHashedPoints);
+
+      if (typeHT == HT_COMPRESSED_DIRECTORY){
+	compressDirectoryPostings(uhash);
+      }
+    }
+    uhash->nHashedPoints = modelHT->nHashedPoints;
+    uhash->nHashedBuckets = modelHT->nHashedBuckets;
+    break;
+  case HT_PERFECT_HASH:
+    ASSERT(modelHT != NULL);
+    ASSERT(modelHT->typeHT == HT_LINKED_LIST);
+    buildPerfectHashDirectory(uhash, modelHT);
+    uhash->nHashedPoints = modelHT->nHashedPoints;
+    uhash->nHashedBuckets = modelHT->nHashedBuckets;
+    break;
     default:
     ASSERT(FALSE);
   }
 
-  // Initializing the main hash function.
-  if (!useExternalUHFs){
-    FAILIF(NULL == (uhash->mainHashA = (Uns32T*)MALLOC(uhash->hashedDataLength * sizeof(Uns32T))));
-    for(IntT i = 0; i < uhash->hashedDataLength; i++){
-      uhash->mainHashA[i] = genRandomUns32(1, MAX_HASH_RND);
-    }
-    mainHashA = uhash->mainHashA;
-  } else {
-    uhash->mainHashA = mainHashA;
+  if (IS_PACKED_TYPE_HT(typeHT)){
+    buildBucketFilter(uhash, modelHT);
   }
 
-  // Initializing the control hash functions.
+  // Initializing the main and the control hash functions.
   if (!useExternalUHFs){
-    FAILIF(NULL == (uhash->controlHash1 = (Uns32T*)MALLOC(uhash->hashedDataLength * sizeof(Uns32T))));
-    for(IntT i = 0; i < uhash->hashedDataLength; i++){
-      uhash->controlHash1[i] = genRandomUns32(1, MAX_HASH_RND);
-    }
-    controlHash1 = uhash->controlHash1;
-  } else {
-    uhash->controlHash1 = controlHash1;
+    newUHashFunctions(uhash->hashedDataLength, mainHashA, controlHash1);
   }
+  uhash->mainHashA = mainHashA;
+  uhash->controlHash1 = controlHash1;
 
   return uhash;
 }
 
+// Puts the bucket <bucket> (already unlinked from its chain) of the
+// HT_LINKED_LIST table <uhash>, with all its entries, into the lists
+// of unused buckets/entries of <uhash>. The counters of <uhash> are
+// not updated.
+void recycleGBucket(PUHashStructureT uhash, PGBucketT bucket){
+  bucket->nextGBucketInChain = uhash->unusedPGBuckets;
+  uhash->unusedPGBuckets = bucket;
+  recycleBucketEntries(uhash, bucket->firstEntry.nextEntry);
+}
+
+// Puts the list of bucket entries starting with <bucketEntry> into the
+// list of unused entries of the HT_LINKED_LIST table <uhash>.
+void recycleBucketEntries(PUHashStructureT uhash, PBucketEntryT bucketEntry){
+  while(bucketEntry != NULL){
+    PBucketEntryT tempEntry = bucketEntry;
+    bucketEntry = bucketEntry->nextEntry;
+    tempEntry->nextEntry = uhash->unusedPBucketEntrys;
+    uhash->unusedPBucketEntrys = tempEntry;
+  }
+}
+
 // Removes all the buckets/points from the hash table. Used only for
 // HT_LINKED_LIST.
 void clearUHashStructure(PUHashStructureT uhash){
@@ -298,16 +659,7 @@ void clearUHashStructure(PUHashStructureT uhash){
       while(bucket != NULL){
 	PGBucketT tempBucket = bucket;
 	bucket = bucket->nextGBucketInChain;
-	tempBucket->nextGBucketInChain = uhash->unusedPGBuckets;
-	uhash->unusedPGBuckets = tempBucket;
-	
-	PBucketEntryT bucketEntry = tempBucket->firstEntry.nextEntry;
-	while(bucketEntry != NULL){
-	  PBucketEntryT tempEntry = bucketEntry;
-	  bucketEntry = bucketEntry->nextEntry;
-	  tempEntry->nextEntry = uhash->unusedPBucketEntrys;
-	  uhash->unusedPBucketEntrys = tempEntry;
-	}
+	recycleGBucket(uhash, tempBucket);
       }
       
       uhash->hashTable.llHashTable[i] = NULL;
@@ -400,14 +752,30 @@ void freeUHashStructure(PUHashStructureT uhash, BooleanT freeHashFunctions){
     ASSERT(uhash->chainSizes == NULL);
     break;
   case HT_HYBRID_CHAINS:
-    free(uhash->hashTable.hybridHashTable);
-    free(uhash->hybridChainsStorage);
+    FREE_LARGE(uhash->hashTable.hybridHashTable);
+    FREE_LARGE(uhash->hybridChainsStorage);
+    FREE_LARGE(uhash->hybridPointHighBits);
     ASSERT(uhash->chainSizes == NULL);
     break;
+  case HT_BUCKET_DIRECTORY:
+    FREE_LARGE(uhash->hashTable.bucketDirectory);
+    FREE_LARGE(uhash->bucketDirectoryPoints);
+    break;
+  case HT_COMPRESSED_DIRECTORY:
+    FREE_LARGE(uhash->hashTable.bucketDirectory);
+    FREE_LARGE(uhash->compressedPostings);
+    break;
+  case HT_PERFECT_HASH:
+    FREE_LARGE(uhash->hashTable.bucketDirectory);
+    FREE_LARGE(uhash->bucketDirectoryPoints);
+    FREE(uhash->perfectHashSeeds);
+    break;
   default:
     ASSERT(FALSE);
   }
 
+  FREE(uhash->bucketFilter);
+
   if (freeHashFunctions){
     free(uhash->mainHashA);
     free(uhash->controlHash1);
@@ -415,6 +783,199 @@ void freeUHashStructure(PUHashStructureT uhash, BooleanT freeHashFunctions){
   free(uhash);
 }
 
+// Returns the bin of the histograms of UHashStatisticsT of the value
+// <value> (at least 1).
+inline IntT uhashStatisticsBin(MemVarT value){
+  IntT bin = 0;
+  while (value > 1 && bin < UHASH_STATISTICS_N_BINS - 1){
+    value >>= 1;
+    bin++;
+  }
+  return bin;
+}
+
+// Adds a bucket of <size> points to <stats>.
+inline void addBucketToStatistics(UHashStatisticsT &stats, MemVarT size){
+  stats.nBuckets++;
+  stats.nPoints += size;
+  stats.largestBucket = MAX(stats.largestBucket, size);
+  if (size > MAX_NONOVERFLOW_POINTS_PER_BUCKET){
+    stats.nOverflowBuckets++;
+  }
+  stats.bucketSizeHistogram[uhashStatisticsBin(size)]++;
+}
+
+// Adds a chain of length <length> to <stats>.
+inline void addChainToStatistics(UHashStatisticsT &stats, MemVarT length){
+  stats.longestChain = MAX(stats.longestChain, length);
+  stats.chainLengthHistogram[uhashStatisticsBin(length)]++;
+}
+
+// Computes the statistics <stats> of the table <uhash> by walking all
+// its buckets (see UHashStatisticsT).
+void getUHashStatistics(PUHashStructureT uhash, UHashStatisticsT &stats){
+  ASSERT(uhash != NULL);
+  memset(&stats, 0, sizeof(UHashStatisticsT));
+  stats.typeHT = uhash->typeHT;
+  stats.nSlots = uhash->hashTableSize;
+  stats.otherBytes = sizeof(UHashStructureT);
+
+  switch (uhash->typeHT) {
+  case HT_LINKED_LIST:
+    for(Int32T i = 0; i < uhash->hashTableSize; i++){
+      MemVarT chainLength = 0;
+      for(PGBucketT bucket = uhash->hashTable.llHashTable[i]; bucket != NULL; bucket = bucket->nextGBucketInChain){
+	MemVarT size = 0;
+	for(PBucketEntryT bucketEntry = &(bucket->firstEntry); bucketEntry != NULL; bucketEntry = bucketEntry->nextEntry){
+	  size++;
+	}
+	addBucketToStatistics(stats, size);
+	chainLength++;
+      }
+      if (chainLength > 0){
+	stats.nNonEmptySlots++;
+	addChainToStatistics(stats, chainLength);
+      }
+    }
+    stats.directoryBytes = (MemVarT)uhash->hashTableSize * sizeof(PGBucketT);
+    stats.pointsBytes = stats.nBuckets * sizeof(GBucketT) + (stats.nPoints - stats.nBuckets) * sizeof(BucketEntryT);
+    break;
+  case HT_HYBRID_CHAINS:
+    for(Int32T i = 0; i < uhash->hashTableSize; i++){
+      MemVarT chainLength = 0;
+      PHybridChainEntryT controlEntry = hybridSlotChain(uhash, i);
+      while (controlEntry != NULL){
+	PHybridChainEntryT firstPoint = controlEntry + 1;
+	Uns32T offset = 0;
+	if (firstPoint->point.bucketLength == 0){
+	  for(IntT j = 0; j < N_FIELDS_PER_INDEX_OF_OVERFLOW; j++){
+	    offset += ((Uns32T)((firstPoint + 1 + j)->point.bucketLength) << (j * N_BITS_FOR_BUCKET_LENGTH));
+	  }
+	}
+	MemVarT size = 0;
+	for(Uns32T index = 0; ; index++){
+	  if (index == MAX_NONOVERFLOW_POINTS_PER_BUCKET){
+	    index = index + offset;
+	  }
+	  size++;
+	  if ((firstPoint + index)->point.isLastPoint == 1){
+	    break;
+	  }
+	}
+	addBucketToStatistics(stats, size);
+	chainLength++;
+	controlEntry = firstPoint->point.isLastBucket != 0 ? NULL : firstPoint + hybridBucketInlineLength(firstPoint);
+      }
+      if (chainLength > 0){
+	stats.nNonEmptySlots++;
+	addChainToStatistics(stats, chainLength);
+      }
+    }
+    stats.directoryBytes = (MemVarT)uhash->hashTableSize * sizeof(Uns32T);
+    stats.pointsBytes = (stats.nPoints + stats.nBuckets) * sizeof(HybridChainEntryT);
+    if (uhash->hybridPointHighBits != NULL){
+      stats.otherBytes += (stats.nPoints + stats.nBuckets) * sizeof(Uns16T);
+    }
+    break;
+  case HT_BUCKET_DIRECTORY:
+  case HT_COMPRESSED_DIRECTORY:
+  case HT_PERFECT_HASH:
+    stats.nSlots = (MemVarT)uhash->bucketDirectoryMask + 1;
+    for(Uns32T position = 0; position <= uhash->bucketDirectoryMask; position++){
+      PBucketDirectoryEntryT entry = uhash->hashTable.bucketDirectory + position;
+      if (entry->length == 0){
+	continue;
+      }
+      stats.nNonEmptySlots++;
+      addBucketToStatistics(stats, entry->length);
+      if (uhash->typeHT == HT_PERFECT_HASH){
+	addChainToStatistics(stats, 1);
+      }else{
+	Uns32T home = (entry->slot ^ entry->controlValue1) & uhash->bucketDirectoryMask;
+	addChainToStatistics(stats, ((position - home) & uhash->bucketDirectoryMask) + 1);
+      }
+    }
+    stats.directoryBytes = stats.nSlots * sizeof(BucketDirectoryEntryT);
+    if (uhash->typeHT == HT_COMPRESSED_DIRECTORY){
+      stats.pointsBytes = uhash->nCompressedPostingWords * sizeof(Uns32T);
+    }else{
+      stats.pointsBytes = stats.nPoints * sizeof(Int32T);
+    }
+    if (uhash->typeHT == HT_PERFECT_HASH){
+      stats.otherBytes += (MemVarT)uhash->nPerfectHashGroups * sizeof(Uns32T);
+    }
+    break;
+  default:
+    ASSERT(FALSE); // HT_PACKED and HT_STATISTICS are not supported anymore.
+  }
+
+  if (uhash->bucketFilter != NULL){
+    stats.filterBytes = ((MemVarT)uhash->bucketFilterMask + 1) * sizeof(LongUns64T);
+  }
+}
+
+// Copies all the buckets of the table <uhash> (of type
+// a packed type, see IS_PACKED_TYPE_HT) into the HT_LINKED_LIST
+// table <modelHT> (which must have the same <hashTableSize>, so that a
+// bucket keeps its slot). <pointIndexShift> is added to every point
+// index. If <deadPoints> is not NULL, the points <p> with bit <p> set
+// in the bitmap <deadPoints> (the bit p%32 of the word p/32) are
+// skipped; a bucket left with no points disappears.
+void unpackUHashStructure(PUHashStructureT uhash, PUHashStructureT modelHT, Int32T pointIndexShift, Uns32T *deadPoints){
+  ASSERT(uhash != NULL && IS_PACKED_TYPE_HT(uhash->typeHT));
+  ASSERT(modelHT != NULL && modelHT->typeHT == HT_LINKED_LIST);
+  ASSERT(uhash->hashTableSize == modelHT->hashTableSize);
+
+  if (IS_DIRECTORY_TYPE_HT(uhash->typeHT)){
+    for(Uns32T position = 0; position <= uhash->bucketDirectoryMask; position++){
+      PBucketDirectoryEntryT entry = uhash->hashTable.bucketDirectory + position;
+      DirectoryBucketReaderT reader;
+      initDirectoryBucketReader(uhash, entry, reader);
+      for(Uns32T j = 0; j < entry->length; j++){
+	Int32T pointIndex = nextDirectoryBucketPoint(reader);
+	if (deadPoints == NULL || (deadPoints[pointIndex >> 5] & (1U << (pointIndex & 31))) == 0){
+	  addBucketEntryToSlot(modelHT, entry->slot, entry->controlValue1, pointIndex + pointIndexShift);
+	}
+      }
+    }
+    return;
+  }
+
+  for(Int32T i = 0; i < uhash->hashTableSize; i++){
+    PHybridChainEntryT controlEntry = hybridSlotChain(uhash, i);
+    while (controlEntry != NULL){
+      Uns32T control1 = controlEntry->controlValue1;
+      PHybridChainEntryT firstPoint = controlEntry + 1;
+      Uns32T offset = 0;
+      if (firstPoint->point.bucketLength == 0){
+	// there are overflow points in this bucket.
+	for(IntT j = 0; j < N_FIELDS_PER_INDEX_OF_OVERFLOW; j++){
+	  offset += ((Uns32T)((firstPoint + 1 + j)->point.bucketLength) << (j * N_BITS_FOR_BUCKET_LENGTH));
+	}
+      }
+      Uns32T index = 0;
+      BooleanT done = FALSE;
+      while(!done){
+	if (index == MAX_NONOVERFLOW_POINTS_PER_BUCKET){
+	  index = index + offset;
+	}
+	Int32T pointIndex = hybridEntryPointIndex(uhash, firstPoint + index);
+	done = (firstPoint + index)->point.isLastPoint == 1 ? TRUE : FALSE;
+	index++;
+	if (deadPoints == NULL || (deadPoints[pointIndex >> 5] & (1U << (pointIndex & 31))) == 0){
+	  addBucketEntryToSlot(modelHT, i, control1, pointIndex + pointIndexShift);
+	}
+      }
+
+      if (firstPoint->point.isLastBucket != 0){
+	controlEntry = NULL;
+      }else{
+	controlEntry = firstPoint + hybridBucketInlineLength(firstPoint);
+      }
+    }
+  }
+}
+
 // Computes (a.b)mod UH_PRIME_DEFAULT. b is coded as <nBPieces> blocks
 // of size totaling <size>. <a> is of length <size>.
 inline Uns32T computeBlockProductModDefaultPrime(Uns32T *a, Uns32T *(b[]), IntT nBPieces, IntT size){
@@ -504,6 +1065,33 @@ inline Uns32T combinePrecomputedHashes(Uns32T *firstBucketVector, Uns32T *second
   }
 }
 
+// Adds the point <pointIndex> to the bucket with control value
+// <control1> in the slot <hIndex> of the HT_LINKED_LIST table <uhash>
+// (the hashes are already computed). If no such bucket exists, then
+// it is first created.
+void addBucketEntryToSlot(PUHashStructureT uhash, Uns32T hIndex, Uns32T control1, Int32T pointIndex){
+  CR_ASSERT(uhash != NULL && uhash->typeHT == HT_LINKED_LIST);
+  CR_ASSERT(hIndex < uhash->hashTableSize);
+
+  PGBucketT p = uhash->hashTable.llHashTable[hIndex];
+  while(p != NULL &&
+	(p->controlValue1 != control1)) {
+    p = p->nextGBucketInChain;
+  }
+  if (p == NULL) {
+    // new bucket to add to the hash table
+    uhash->nHashedBuckets++;
+    uhash->hashTable.llHashTable[hIndex] = newGBucket(uhash,
+						      control1,
+						      pointIndex,
+						      uhash->hashTable.llHashTable[hIndex]);
+  } else {
+    // add this bucket entry to the existing bucket
+    addPointToGBucket(uhash, p, pointIndex);
+  }
+  uhash->nHashedPoints++;
+}
+
 // Adds the bucket entry (a point <point>) to the bucket defined by
 // bucketVector in the uh structure with number uhsNumber. If no such
 // bucket exists, then it is first created.
@@ -527,35 +1115,19 @@ void addBucketEntry(PUHashStructureT uhash, IntT nBucketVectorPieces, Uns32T fir
     // UHashStructureT, then we can use the (possibly partially)
     // precomputed hash values.
     CR_ASSERT(uhash->prime == UH_PRIME_DEFAULT);
-    hIndex = combinePrecomputedHashes(firstBucketVector, secondBucketVector, nBucketVectorPieces, UHF_MAIN_INDEX) % uhash->hashTableSize;
+    hIndex = uhashSlotIndex(uhash, combinePrecomputedHashes(firstBucketVector, secondBucketVector, nBucketVectorPieces, UHF_MAIN_INDEX));
     control1 = combinePrecomputedHashes(firstBucketVector, secondBucketVector, nBucketVectorPieces, UHF_CONTROL1_INDEX);
     //std::cout<<hIndex<<' '<<control1<<' ';
   }
 
-  PGBucketT p;
   BooleanT found;
   Int32T j;
   Int32T temp;
   switch (uhash->typeHT) {
   case HT_LINKED_LIST:
   //printf("list ");
-    p = uhash->hashTable.llHashTable[hIndex];
-    while(p != NULL && 
-	  (p->controlValue1 != control1)) {
-      p = p->nextGBucketInChain;
-    }
-    if (p == NULL) {
-      // new bucket to add to the hash table
-      uhash->nHashedBuckets++;
-      uhash->hashTable.llHashTable[hIndex] = newGBucket(uhash,
-							control1, 
-							pointIndex, 
-							uhash->hashTable.llHashTable[hIndex]);
-    } else {
-      // add this bucket entry to the existing bucket
-      addPointToGBucket(uhash, p, pointIndex);
-    }
-    break;
+    addBucketEntryToSlot(uhash, hIndex, control1, pointIndex);
+    return;
   case HT_PACKED:
 //     // The bucket should already exist.
 //     IntT i;
@@ -607,12 +1179,10 @@ void addBucketEntry(PUHashStructureT uhash, IntT nBucketVectorPieces, Uns32T fir
   uhash->nHashedPoints++;
 }
 
-// Returns the bucket defined by the vector <bucketVector> in the UH
-// structure number <uhsNumber>.
-GeneralizedPGBucket getGBucket(PUHashStructureT uhash, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[]){
-  Uns32T hIndex;
-  Uns32T control1;
-
+// Computes the slot <hIndex> and the control value <control1> of the
+// bucket defined by the vector <bucketVector> in the UH structure
+// <uhash>.
+void computeGBucketKey(PUHashStructureT uhash, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[], Uns32T &hIndex, Uns32T &control1){
   //TIMEV_START(timeGBHash);
   if (!USE_PRECOMPUTED_HASHES){
     // if not using the same hash functions across multiple
@@ -628,16 +1198,38 @@ GeneralizedPGBucket getGBucket(PUHashStructureT uhash, IntT nBucketVectorPieces,
     // precomputed hash values.
     // printf("0001");
     CR_ASSERT(uhash->prime == UH_PRIME_DEFAULT);
-    hIndex = combinePrecomputedHashes(firstBucketVector, secondBucketVector, nBucketVectorPieces, UHF_MAIN_INDEX) % uhash->hashTableSize;
+    hIndex = uhashSlotIndex(uhash, combinePrecomputedHashes(firstBucketVector, secondBucketVector, nBucketVectorPieces, UHF_MAIN_INDEX));
     //printf("hIndex is %d\n",hIndex);
     control1 = combinePrecomputedHashes(firstBucketVector, secondBucketVector, nBucketVectorPieces, UHF_CONTROL1_INDEX);
     //printf("control1 is %d\n",control1);
   }
   //TIMEV_END(timeGBHash);
+}
+
+// Returns the bucket defined by the vector <bucketVector> in the UH
+// structure number <uhsNumber> (<nBucketsInChain> as for
+// getGBucketInSlot).
+GeneralizedPGBucket getGBucket(PUHashStructureT uhash, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[], IntT &nBucketsInChain){
+  Uns32T hIndex;
+  Uns32T control1;
+  computeGBucketKey(uhash, nBucketVectorPieces, firstBucketVector, secondBucketVector, hIndex, control1);
+  return getGBucketInSlot(uhash, hIndex, control1, nBucketsInChain);
+}
 
+// Returns the bucket with the control value <control1> in the slot
+// <hIndex> of the UH structure <uhash> (the hashes are already
+// computed). The buckets passed over in the chain of a HT_LINKED_LIST
+// table are added to <nBucketsInChain> (the caller's counter: the
+// global nBucketsInChains, or the one of a QueryContextT).
+GeneralizedPGBucket getGBucketInSlot(PUHashStructureT uhash, Uns32T hIndex, Uns32T control1, IntT &nBucketsInChain){
   GeneralizedPGBucket result;
   PGBucketT p;
   PHybridChainEntryT indexHybrid = NULL;
+  if (!bucketFilterMayContain(uhash, hIndex, control1)){
+    // no bucket has this key (all the members of <result> are NULL).
+    result.hybridGBucket = NULL;
+    return result;
+  }
   //TIMEV_START(timeChainTraversal);
   switch(uhash->typeHT) {
   case HT_LINKED_LIST:
@@ -645,7 +1237,7 @@ GeneralizedPGBucket getGBucket(PUHashStructureT uhash, IntT nBucketVectorPieces,
     while(p != NULL && 
 	  (p->controlValue1 != control1)) {
       p = p->nextGBucketInChain;
-      nBucketsInChains++;
+      nBucketsInChain++;
     }
     result.llGBucket = p;
     return result;
@@ -669,8 +1261,33 @@ GeneralizedPGBucket getGBucket(PUHashStructureT uhash, IntT nBucketVectorPieces,
     }
     result.packedGBucket = NULL;
     return result;
+  case HT_BUCKET_DIRECTORY:
+  case HT_COMPRESSED_DIRECTORY:
+    {
+      Uns32T position = (hIndex ^ control1) & uhash->bucketDirectoryMask;
+      PBucketDirectoryEntryT entry = uhash->hashTable.bucketDirectory + position;
+      while (entry->length != 0){
+	if (entry->controlValue1 == control1 && entry->slot == hIndex){
+	  result.directoryGBucket = entry;
+	  return result;
+	}
+	position = (position + 1) & uhash->bucketDirectoryMask;
+	entry = uhash->hashTable.bucketDirectory + position;
+      }
+    }
+    result.directoryGBucket = NULL;
+    return result;
+  case HT_PERFECT_HASH:
+    {
+      Uns32T seed = uhash->perfectHashSeeds[perfectHashGroup(hIndex, control1, uhash->nPerfectHashGroups)];
+      PBucketDirectoryEntryT entry = uhash->hashTable.bucketDirectory + (seed >= PERFECT_HASH_DIRECT_SEED ?
+									 seed - PERFECT_HASH_DIRECT_SEED :
+									 perfectHashPosition(perfectHashMix(hIndex, control1, 1), seed, uhash->bucketDirectoryMask + 1));
+      result.directoryGBucket = (entry->length != 0 && entry->controlValue1 == control1 && entry->slot == hIndex) ? entry : NULL;
+    }
+    return result;
   case HT_HYBRID_CHAINS:
-    indexHybrid = uhash->hashTable.hybridHashTable[hIndex];
+    indexHybrid = hybridSlotChain(uhash, hIndex);
     while (indexHybrid != NULL){ 
       if (indexHybrid->controlValue1 == control1){
 	result.hybridGBucket = indexHybrid + 1;
@@ -681,7 +1298,7 @@ GeneralizedPGBucket getGBucket(PUHashStructureT uhash, IntT nBucketVectorPieces,
 	  result.hybridGBucket = NULL;
 	  return result;
 	}
-	indexHybrid = indexHybrid + indexHybrid->point.bucketLength;
+	indexHybrid = indexHybrid + hybridBucketInlineLength(indexHybrid);
       }
     }
     result.hybridGBucket = NULL;
@@ -20,6 +20,10 @@
 #ifndef BUCKETHASHING_INCLUDED
 #define BUCKETHASHING_INCLUDED
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // An entry (point) in a bucket of points (a bucket is specified by a
 // vector in integers of length k). There is link to the actual point
 // stored in the entry, as well as link to the next entry in the
@@ -75,11 +79,35 @@ typedef union _HybridChainEntryT {
   } point;
 } HybridChainEntryT, *PHybridChainEntryT;
 
+// An entry of the directory of a HT_BUCKET_DIRECTORY table: the
+// bucket with the control value <controlValue1> in the slot <slot>
+// holds the points bucketDirectoryPoints[offset..offset+length-1]. In
+// a HT_COMPRESSED_DIRECTORY table, <offset> is the index in
+// <compressedPostings> of the posting list of the bucket (see
+// COMPRESSED_POSTING_MIN_LENGTH). Entries are 16 bytes, so that a
+// cache line holds BUCKET_DIRECTORY_LINE_ENTRIES of them. Empty
+// entries have <length> 0.
+typedef struct _BucketDirectoryEntryT {
+  Uns32T slot;
+  Uns32T controlValue1;
+  Uns32T offset;
+  Uns32T length;
+} BucketDirectoryEntryT, *PBucketDirectoryEntryT;
+
+// The number of bits kept in <hybridPointHighBits> (point indeces
+// can have up to N_BITS_PER_POINT_INDEX + N_BITS_PER_POINT_INDEX_HIGH
+// bits).
+#define N_BITS_PER_POINT_INDEX_HIGH 16
+
+// The value of an empty slot of a HT_HYBRID_CHAINS table.
+#define HYBRID_SLOT_EMPTY 0xFFFFFFFFU
+
 typedef union _GeneralizedPGBucket {
   PGBucketT llGBucket;
   PLinkPackedGBucketT linkGBucket;
   PPackedGBucketT packedGBucket;
   PHybridChainEntryT hybridGBucket;
+  PBucketDirectoryEntryT directoryGBucket;
 } GeneralizedPGBucket;
 
 typedef struct _PointsListEntryT {
@@ -90,6 +118,62 @@ typedef struct _PointsListEntryT {
 // A big number (>> max #  of points)
 #define INDEX_START_EMPTY 1000000000U
 
+// The alignment of the directory of a HT_BUCKET_DIRECTORY table (a
+// cache line; the MALLOC_LARGE regions are aligned to it) and the
+// number of directory entries in it.
+#define BUCKET_DIRECTORY_ALIGNMENT 64
+#define BUCKET_DIRECTORY_LINE_ENTRIES (BUCKET_DIRECTORY_ALIGNMENT / sizeof(BucketDirectoryEntryT))
+
+// The maximal fraction of occupied entries in the directory of a
+// HT_BUCKET_DIRECTORY table.
+#define BUCKET_DIRECTORY_MAX_LOAD 0.5
+
+// The directory of a HT_PERFECT_HASH table is indexed by a minimal
+// perfect hash function (hash and displace, as in CHD): the keys
+// (slot, control value) are hashed into groups of
+// PERFECT_HASH_BUCKETS_PER_GROUP keys on average, and each group has a
+// seed that sends its keys to distinct free entries. A lookup computes
+// the group, then the entry with the seed of the group, and checks the
+// key of the entry. The groups of a single key are placed last, each
+// in a free entry given directly by its seed (the seed is then the
+// entry plus PERFECT_HASH_DIRECT_SEED), which avoids the long searches
+// for the last free entries.
+#define PERFECT_HASH_BUCKETS_PER_GROUP 4
+#define PERFECT_HASH_DIRECT_SEED 0x80000000U
+
+// The number of seeds tried for a group before giving up.
+#define PERFECT_HASH_MAX_SEED (PERFECT_HASH_DIRECT_SEED - 1)
+
+// The fast-reject filter of the packed tables: a blocked Bloom filter
+// over the keys (slot, control value) of the buckets, with
+// BUCKET_FILTER_N_HASHES bits of a single 64-bit block per key. The
+// filter has about BUCKET_FILTER_BITS_PER_BUCKET bits per bucket, but
+// at most BUCKET_FILTER_MAX_BYTES bytes (so that it stays in L2); a
+// table with too many buckets for BUCKET_FILTER_MIN_BITS_PER_BUCKET
+// bits per bucket has no filter.
+#define BUCKET_FILTER_BITS_PER_BUCKET 16
+#define BUCKET_FILTER_MIN_BITS_PER_BUCKET 6
+#define BUCKET_FILTER_MAX_BYTES (256 * 1024)
+#define BUCKET_FILTER_N_HASHES 3
+
+// The posting lists of a HT_COMPRESSED_DIRECTORY table. The point
+// indeces of a bucket are sorted. A bucket with fewer than
+// COMPRESSED_POSTING_MIN_LENGTH points stores them as they are. A
+// longer bucket stores its first point index, the bit width <w> of the
+// largest difference between consecutive indeces, and then the
+// differences (the first one is 0) bit-packed with <w> bits each. The
+// differences are split in groups of COMPRESSED_POSTING_LANES; the
+// difference <j> of every group goes to the lane <j>, and the lanes
+// are interleaved word by word, so that a group is decoded with the
+// same shifts in all lanes (one SSE2 vector).
+#define COMPRESSED_POSTING_MIN_LENGTH 8
+#define COMPRESSED_POSTING_LANES 4
+#define COMPRESSED_POSTING_HEADER_WORDS 2
+
+// The number of Uns32T words of the posting list of a bucket of
+// <nPoints> points whose differences have <width> bits.
+#define COMPRESSED_POSTING_WORDS(nPoints, width) ((nPoints) < COMPRESSED_POSTING_MIN_LENGTH ? (MemVarT)(nPoints) : COMPRESSED_POSTING_HEADER_WORDS + COMPRESSED_POSTING_LANES * (((MemVarT)((nPoints) + COMPRESSED_POSTING_LANES - 1) / COMPRESSED_POSTING_LANES * (width) + 31) / 32))
+
 // 4294967291 = 2^32-5
 #define UH_PRIME_DEFAULT 4294967291U
 
@@ -133,7 +217,13 @@ typedef struct _UHashStructureT {
   // a "hybrid" array that contains both the buckets and the points
   // (the an element of the chain array is of type
   // <HybridChainEntryT>). all chains are conglamerated in the same
-  // array <hybridChainsStorage>.
+  // array <hybridChainsStorage>. when <typeHT>=HT_BUCKET_DIRECTORY,
+  // the buckets are found through an open-addressing directory keyed
+  // by (slot, control value) <bucketDirectory>, and their points are
+  // stored contiguously in <bucketDirectoryPoints>. when
+  // <typeHT>=HT_PERFECT_HASH, the directory has exactly one entry per
+  // bucket, found with a minimal perfect hash function of the key
+  // (slot, control value) (see PERFECT_HASH_BUCKETS_PER_GROUP).
   IntT typeHT;
 
   // The array containing the hash slots of the universal hashing.
@@ -141,7 +231,12 @@ typedef struct _UHashStructureT {
     PGBucketT *llHashTable;
     PackedGBucketT **packedHashTable;
     LinkPackedGBucketT **linkHashTable;
-    PHybridChainEntryT *hybridHashTable;
+    // For HT_HYBRID_CHAINS: the index in <hybridChainsStorage> of the
+    // first entry of the chain of each slot (HYBRID_SLOT_EMPTY for
+    // empty slots). 32-bit offsets halve the memory of the slots
+    // compared to pointers.
+    Uns32T *hybridHashTable;
+    PBucketDirectoryEntryT bucketDirectory;
   } hashTable;
 
   // The sizes of each of the chains of the hashtable (used only when
@@ -155,8 +250,45 @@ typedef struct _UHashStructureT {
 
   HybridChainEntryT *hybridChainsStorage;
 
+  // The bits of the point indeces above the N_BITS_PER_POINT_INDEX
+  // bits stored in the entries of <hybridChainsStorage>
+  // (hybridPointHighBits[j] is for hybridChainsStorage[j]). It is
+  // allocated only if the table holds indeces larger than
+  // MAX_N_POINTS_NARROW_ENTRIES, and is NULL otherwise.
+  Uns16T *hybridPointHighBits;
+
+  // The point indeces of the buckets of a HT_BUCKET_DIRECTORY table,
+  // and the number of entries of <bucketDirectory> minus 1 (the
+  // number of entries is a power of 2, except for HT_PERFECT_HASH).
+  Int32T *bucketDirectoryPoints;
+  Uns32T bucketDirectoryMask;
+
+  // The seeds of the groups of keys of a HT_PERFECT_HASH table, and
+  // the number of groups.
+  Uns32T *perfectHashSeeds;
+  Uns32T nPerfectHashGroups;
+
+  // The posting lists of a HT_COMPRESSED_DIRECTORY table (see
+  // COMPRESSED_POSTING_MIN_LENGTH), and their total number of words.
+  Uns32T *compressedPostings;
+  MemVarT nCompressedPostingWords;
+
+  // The fast-reject filter of a packed table (see
+  // BUCKET_FILTER_BITS_PER_BUCKET), or NULL, and its number of blocks
+  // minus 1 (the number of blocks is a power of 2).
+  LongUns64T *bucketFilter;
+  Uns32T bucketFilterMask;
+
+  // The placement of the large regions of the table (a combination
+  // of the LARGE_REGION_* flags), given to newUHashStructure.
+  IntT memoryPlacement;
+
   // The size of hashTable.
   Int32T hashTableSize;
+  // hashTableSize-1 if <hashTableSize> is a power of 2 (the slot of a
+  // main hash value is then computed with a mask instead of a
+  // division), and 0 otherwise.
+  Uns32T hashTableMask;
 
   // Number of elements(buckets) stored in the hash table in total (that
   // is the number of non-empty buckets).
@@ -186,6 +318,45 @@ typedef struct _UHashStructureT {
   Uns32T *controlHash1;
 } UHashStructureT, *PUHashStructureT;
 
+// The number of bins of the histograms of UHashStatisticsT. The bin
+// <b> counts the values in [2^b, 2^(b+1)).
+#define UHASH_STATISTICS_N_BINS 32
+
+// The shape and the memory of one table (see getUHashStatistics).
+typedef struct _UHashStatisticsT {
+  IntT typeHT;
+  MemVarT nBuckets;
+  MemVarT nPoints;
+  // The number of slots of the table (of entries of the directory for
+  // the directory types), and how many of them hold a bucket.
+  MemVarT nSlots;
+  MemVarT nNonEmptySlots;
+
+  // The largest bucket, and the number of buckets with more than
+  // MAX_NONOVERFLOW_POINTS_PER_BUCKET points.
+  MemVarT largestBucket;
+  MemVarT nOverflowBuckets;
+
+  // The longest chain. The length of a chain is its number of buckets
+  // (HT_LINKED_LIST, HT_HYBRID_CHAINS), or the number of directory
+  // entries probed to find a bucket (the directory types).
+  MemVarT longestChain;
+
+  // The histograms of the sizes of the buckets and of the lengths of
+  // the chains (of the non-empty slots, or of every bucket for the
+  // directory types).
+  MemVarT bucketSizeHistogram[UHASH_STATISTICS_N_BINS];
+  MemVarT chainLengthHistogram[UHASH_STATISTICS_N_BINS];
+
+  // The bytes of the slots or of the directory, of the storage of the
+  // points, of the fast-reject filter, and of the rest (the structure,
+  // the high bits of the point indeces, the seeds of the perfect hash).
+  MemVarT directoryBytes;
+  MemVarT pointsBytes;
+  MemVarT filterBytes;
+  MemVarT otherBytes;
+} UHashStatisticsT, *PUHashStatisticsT;
+
 #define HT_LINKED_LIST 0
 
 #define HT_PACKED 1
@@ -194,12 +365,46 @@ typedef struct _UHashStructureT {
 
 #define HT_HYBRID_CHAINS 3
 
+#define HT_BUCKET_DIRECTORY 4
+
+#define HT_COMPRESSED_DIRECTORY 5
+
+#define HT_PERFECT_HASH 6
+
+// Whether the buckets of the tables of type <typeHT> are found through
+// a directory of BucketDirectoryEntryT.
+#define IS_DIRECTORY_TYPE_HT(typeHT) ((typeHT) == HT_BUCKET_DIRECTORY || (typeHT) == HT_COMPRESSED_DIRECTORY || (typeHT) == HT_PERFECT_HASH)
+
+// Whether the tables of type <typeHT> are static, i.e., built at once
+// from a HT_LINKED_LIST model table (see newUHashStructure).
+#define IS_PACKED_TYPE_HT(typeHT) ((typeHT) == HT_HYBRID_CHAINS || IS_DIRECTORY_TYPE_HT(typeHT))
+
+// The bytes of one slot of a table of type <typeHT>. The directory
+// types are sized by their number of buckets, not by the hash table
+// size, so their slots take no memory.
+inline MemVarT hashTableSlotBytes(IntT typeHT){
+  switch (typeHT){
+  case HT_LINKED_LIST:
+    return sizeof(PGBucketT);
+  case HT_HYBRID_CHAINS:
+    return sizeof(Uns32T);
+  default:
+    return 0;
+  }
+}
+
 #define CHAIN_INIT_SIZE 0
 #define CHAIN_RESIZE_RATIO 1.5
 
 
 
-PUHashStructureT newUHashStructure(IntT typeHT, Int32T hashTableSize, IntT bucketVectorLength, BooleanT useExternalUHFs, Uns32T *(&mainHashA), Uns32T *(&controlHash1), PUHashStructureT modelHT);
+void newUHashFunctions(IntT bucketVectorLength, Uns32T *(&mainHashA), Uns32T *(&controlHash1));
+
+PUHashStructureT newUHashStructure(IntT typeHT, Int32T hashTableSize, IntT bucketVectorLength, BooleanT useExternalUHFs, Uns32T *(&mainHashA), Uns32T *(&controlHash1), PUHashStructureT modelHT, IntT memoryPlacement);
+
+void recycleGBucket(PUHashStructureT uhash, PGBucketT bucket);
+
+void recycleBucketEntries(PUHashStructureT uhash, PBucketEntryT bucketEntry);
 
 void clearUHashStructure(PUHashStructureT uhash);
 
@@ -207,9 +412,253 @@ void optimizeUHashStructure(PUHashStructureT uhash, PointsListEntryT *(&auxPtsLi
 
 void freeUHashStructure(PUHashStructureT uhash, BooleanT freeHashFunctions);
 
+void getUHashStatistics(PUHashStructureT uhash, UHashStatisticsT &stats);
+
+// Returns the index of the point stored in the entry <entry> of the
+// HT_HYBRID_CHAINS table <uhash>.
+inline Int32T hybridEntryPointIndex(PUHashStructureT uhash, PHybridChainEntryT entry){
+  Int32T pointIndex = entry->point.pointIndex;
+  if (uhash->hybridPointHighBits != NULL){
+    pointIndex |= (Int32T)uhash->hybridPointHighBits[entry - uhash->hybridChainsStorage] << N_BITS_PER_POINT_INDEX;
+  }
+  return pointIndex;
+}
+
+// Reads the point indeces of a bucket of a directory table (see
+// IS_DIRECTORY_TYPE_HT) in order (see
+// initDirectoryBucketReader and nextDirectoryBucketPoint).
+typedef struct _DirectoryBucketReaderT {
+  // The point indeces, if they are stored as they are (NULL otherwise).
+  const Int32T *points;
+  // The packed differences of a compressed posting list, and their
+  // bit width.
+  const Uns32T *packedDifferences;
+  Uns32T width;
+  // The index of the next point of the bucket.
+  Uns32T next;
+  // The last decoded point index, and the decoded group.
+  Int32T previous;
+  Int32T group[COMPRESSED_POSTING_LANES];
+} DirectoryBucketReaderT;
+
+// Prepares <reader> for reading the points of the bucket <entry> of
+// the directory table <uhash>.
+inline void initDirectoryBucketReader(PUHashStructureT uhash, PBucketDirectoryEntryT entry, DirectoryBucketReaderT &reader){
+  reader.points = NULL;
+  reader.packedDifferences = NULL;
+  reader.width = 0;
+  reader.next = 0;
+  reader.previous = 0;
+  for(IntT lane = 0; lane < COMPRESSED_POSTING_LANES; lane++){
+    reader.group[lane] = 0;
+  }
+  if (uhash->typeHT != HT_COMPRESSED_DIRECTORY){
+    reader.points = uhash->bucketDirectoryPoints + entry->offset;
+  }else if (entry->length < COMPRESSED_POSTING_MIN_LENGTH){
+    reader.points = (const Int32T*)(uhash->compressedPostings + entry->offset);
+  }else{
+    const Uns32T *posting = uhash->compressedPostings + entry->offset;
+    reader.previous = (Int32T)posting[0];
+    reader.width = posting[1];
+    reader.packedDifferences = posting + COMPRESSED_POSTING_HEADER_WORDS;
+  }
+}
+
+// Decodes the group <group> of the packed differences of <reader>
+// into <reader.group> (as point indeces).
+inline void decodeCompressedPostingGroup(DirectoryBucketReaderT &reader, Uns32T group){
+  Uns32T bit = group * reader.width;
+  Uns32T shift = bit & 31;
+  const Uns32T *words = reader.packedDifferences + COMPRESSED_POSTING_LANES * (bit >> 5);
+#ifdef __SSE2__
+  __m128i differences = _mm_setzero_si128();
+  if (reader.width != 0){
+    differences = _mm_srl_epi32(_mm_loadu_si128((const __m128i*)words), _mm_cvtsi32_si128(shift));
+    if (shift + reader.width > 32){
+      differences = _mm_or_si128(differences, _mm_sll_epi32(_mm_loadu_si128((const __m128i*)(words + COMPRESSED_POSTING_LANES)), _mm_cvtsi32_si128(32 - shift)));
+    }
+    differences = _mm_and_si128(differences, _mm_set1_epi32((Int32T)((1U << reader.width) - 1)));
+  }
+  // Prefix sums of the 4 lanes, plus the last point of the previous group.
+  differences = _mm_add_epi32(differences, _mm_slli_si128(differences, 4));
+  differences = _mm_add_epi32(differences, _mm_slli_si128(differences, 8));
+  differences = _mm_add_epi32(differences, _mm_set1_epi32(reader.previous));
+  _mm_storeu_si128((__m128i*)reader.group, differences);
+#else
+  Int32T pointIndex = reader.previous;
+  for(IntT j = 0; j < COMPRESSED_POSTING_LANES; j++){
+    if (reader.width != 0){
+      LongUns64T value = words[j];
+      if (shift + reader.width > 32){
+	value |= (LongUns64T)words[COMPRESSED_POSTING_LANES + j] << 32;
+      }
+      pointIndex += (Int32T)((value >> shift) & ((1U << reader.width) - 1));
+    }
+    reader.group[j] = pointIndex;
+  }
+#endif
+  reader.previous = reader.group[COMPRESSED_POSTING_LANES - 1];
+}
+
+// Mixes the key (<hIndex>, <control1>) and <seed> into 64 bits
+// (the finalizer of MurmurHash3).
+inline LongUns64T perfectHashMix(Uns32T hIndex, Uns32T control1, Uns32T seed){
+  LongUns64T x = (((LongUns64T)hIndex << 32) | control1) ^ ((LongUns64T)seed * 0xC2B2AE3D27D4EB4FULL);
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDULL;
+  x ^= x >> 33;
+  x *= 0xC4CEB9FE1A85EC53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Returns the group of the key (<hIndex>, <control1>) among
+// <nGroups> groups of a HT_PERFECT_HASH table.
+inline Uns32T perfectHashGroup(Uns32T hIndex, Uns32T control1, Uns32T nGroups){
+  return (Uns32T)(((perfectHashMix(hIndex, control1, 0) >> 32) * nGroups) >> 32);
+}
+
+// Returns the directory entry (among <nEntries>) of the key whose
+// hash is <keyHash> (perfectHashMix with the seed 1) and whose group
+// has the seed <seed>: the seed displaces the key by <seed> times
+// a second hash of the key, so trying a seed costs one multiplication.
+inline Uns32T perfectHashPosition(LongUns64T keyHash, Uns32T seed, Uns32T nEntries){
+  Uns32T h = (Uns32T)keyHash + seed * ((Uns32T)(keyHash >> 32) | 1);
+  return (Uns32T)(((LongUns64T)h * nEntries) >> 32);
+}
+
+// Returns the block of the fast-reject filter of <uhash> for the
+// bucket key (<hIndex>, <control1>), and sets in <bits> the bits of
+// the key in that block.
+inline Uns32T bucketFilterBlock(PUHashStructureT uhash, Uns32T hIndex, Uns32T control1, LongUns64T &bits){
+  LongUns64T x = (((LongUns64T)hIndex << 32) | control1) * 0x9E3779B97F4A7C15ULL;
+  bits = 0;
+  for(IntT j = 0; j < BUCKET_FILTER_N_HASHES; j++){
+    bits |= 1ULL << ((x >> (14 + 6 * j)) & 63);
+  }
+  return (Uns32T)(x >> 32) & uhash->bucketFilterMask;
+}
+
+// Whether the table <uhash> may have a bucket with the key (<hIndex>,
+// <control1>). FALSE is exact; TRUE may be a false positive.
+inline BooleanT bucketFilterMayContain(PUHashStructureT uhash, Uns32T hIndex, Uns32T control1){
+  if (uhash->bucketFilter == NULL){
+    return TRUE;
+  }
+  LongUns64T bits;
+  Uns32T block = bucketFilterBlock(uhash, hIndex, control1, bits);
+  return (uhash->bucketFilter[block] & bits) == bits ? TRUE : FALSE;
+}
+
+// The prefetches of the lookup of the bucket with the key (<hIndex>,
+// <control1>) in <uhash>, for the queries that interleave their
+// lookups (each reads what the previous one prefetched, and prefetches
+// the next dependent load of getGBucketInSlot). The first one
+// prefetches the block of the fast-reject filter and the slot
+// (HT_LINKED_LIST, HT_HYBRID_CHAINS), the directory entry
+// (HT_BUCKET_DIRECTORY, HT_COMPRESSED_DIRECTORY) or the seed
+// (HT_PERFECT_HASH).
+inline void prefetchGBucketSlot(PUHashStructureT uhash, Uns32T hIndex, Uns32T control1){
+  if (uhash->bucketFilter != NULL){
+    LongUns64T bits;
+    __builtin_prefetch(uhash->bucketFilter + bucketFilterBlock(uhash, hIndex, control1, bits));
+  }
+  switch (uhash->typeHT){
+  case HT_LINKED_LIST:
+    __builtin_prefetch(uhash->hashTable.llHashTable + hIndex);
+    break;
+  case HT_HYBRID_CHAINS:
+    __builtin_prefetch(uhash->hashTable.hybridHashTable + hIndex);
+    break;
+  case HT_BUCKET_DIRECTORY:
+  case HT_COMPRESSED_DIRECTORY:
+    __builtin_prefetch(uhash->hashTable.bucketDirectory + ((hIndex ^ control1) & uhash->bucketDirectoryMask));
+    break;
+  case HT_PERFECT_HASH:
+    __builtin_prefetch(uhash->perfectHashSeeds + perfectHashGroup(hIndex, control1, uhash->nPerfectHashGroups));
+    break;
+  }
+}
+
+// The second prefetch: the first bucket of the chain of the slot
+// (HT_LINKED_LIST, HT_HYBRID_CHAINS) or the directory entry
+// (HT_PERFECT_HASH).
+inline void prefetchGBucketChain(PUHashStructureT uhash, Uns32T hIndex, Uns32T control1){
+  switch (uhash->typeHT){
+  case HT_LINKED_LIST:
+    if (uhash->hashTable.llHashTable[hIndex] != NULL){
+      __builtin_prefetch(uhash->hashTable.llHashTable[hIndex]);
+    }
+    break;
+  case HT_HYBRID_CHAINS:
+    if (uhash->hashTable.hybridHashTable[hIndex] != HYBRID_SLOT_EMPTY){
+      __builtin_prefetch(uhash->hybridChainsStorage + uhash->hashTable.hybridHashTable[hIndex]);
+    }
+    break;
+  case HT_PERFECT_HASH:
+    {
+      Uns32T seed = uhash->perfectHashSeeds[perfectHashGroup(hIndex, control1, uhash->nPerfectHashGroups)];
+      __builtin_prefetch(uhash->hashTable.bucketDirectory + (seed >= PERFECT_HASH_DIRECT_SEED ?
+							      seed - PERFECT_HASH_DIRECT_SEED :
+							      perfectHashPosition(perfectHashMix(hIndex, control1, 1), seed, uhash->bucketDirectoryMask + 1)));
+    }
+    break;
+  }
+}
+
+// The last prefetch: the first point indices of the bucket <gbucket>
+// (found by getGBucketInSlot).
+inline void prefetchGBucketPoints(PUHashStructureT uhash, GeneralizedPGBucket gbucket){
+  switch (uhash->typeHT){
+  case HT_LINKED_LIST:
+    if (gbucket.llGBucket != NULL){
+      __builtin_prefetch(gbucket.llGBucket);
+    }
+    break;
+  case HT_HYBRID_CHAINS:
+    if (gbucket.hybridGBucket != NULL){
+      __builtin_prefetch(gbucket.hybridGBucket);
+      __builtin_prefetch((char*)gbucket.hybridGBucket + 64);
+    }
+    break;
+  case HT_BUCKET_DIRECTORY:
+  case HT_PERFECT_HASH:
+    if (gbucket.directoryGBucket != NULL){
+      __builtin_prefetch(uhash->bucketDirectoryPoints + gbucket.directoryGBucket->offset);
+    }
+    break;
+  case HT_COMPRESSED_DIRECTORY:
+    if (gbucket.directoryGBucket != NULL){
+      __builtin_prefetch(uhash->compressedPostings + gbucket.directoryGBucket->offset);
+    }
+    break;
+  }
+}
+
+// Returns the next point index of the bucket read by <reader> (the
+// caller must not read past the length of the bucket).
+inline Int32T nextDirectoryBucketPoint(DirectoryBucketReaderT &reader){
+  Uns32T j = reader.next++;
+  if (reader.points != NULL){
+    return reader.points[j];
+  }
+  if (j % COMPRESSED_POSTING_LANES == 0){
+    decodeCompressedPostingGroup(reader, j / COMPRESSED_POSTING_LANES);
+  }
+  return reader.group[j % COMPRESSED_POSTING_LANES];
+}
+
 void addBucketEntry(PUHashStructureT uhash, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[], Int32T pointIndex);
 
-GeneralizedPGBucket getGBucket(PUHashStructureT uhash, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[]);
+void addBucketEntryToSlot(PUHashStructureT uhash, Uns32T hIndex, Uns32T control1, Int32T pointIndex);
+
+void unpackUHashStructure(PUHashStructureT uhash, PUHashStructureT modelHT, Int32T pointIndexShift, Uns32T *deadPoints);
+
+void computeGBucketKey(PUHashStructureT uhash, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[], Uns32T &hIndex, Uns32T &control1);
+
+GeneralizedPGBucket getGBucket(PUHashStructureT uhash, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[], IntT &nBucketsInChain);
+
+GeneralizedPGBucket getGBucketInSlot(PUHashStructureT uhash, Uns32T hIndex, Uns32T control1, IntT &nBucketsInChain);
 
 void precomputeUHFsForULSH(PUHashStructureT uhash, Uns32T *uVector, IntT length, Uns32T *result);
 
@@ -38,26 +38,255 @@ int comparePPointAndRealTStructT(const void *a, const void *b){
 }
 
 
-#ifdef USE_L1_DISTANCE
-// Returns the L1 distance from point <p1> to <p2>.
-RealT distance(IntT dimension, PPointT p1, PPointT p2){
-  RealT result = 0;
+// The distance kernels (see sqrDistanceBounded). The vector kernels
+// exist only for the Euclidean distance of double or float
+// coordinates; they are compiled for their instruction sets with
+// target attributes, so the rest of the code needs no -m flags.
+typedef RealT (*DistanceKernelT)(IntT dimension, const RealT *x, const RealT *y, RealT threshold);
 
-  for (IntT i = 0; i < dimension; i++){
-    result += ABS(p1->coordinates[i] - p2->coordinates[i]);
+RealT sqrDistanceScalar(IntT dimension, const RealT *x, const RealT *y, RealT threshold){
+  RealT result = 0;
+  IntT i = 0;
+  for(; i + DISTANCE_BLOCK_SIZE <= dimension; i += DISTANCE_BLOCK_SIZE){
+    RealT block = 0;
+    for(IntT j = i; j < i + DISTANCE_BLOCK_SIZE; j++){
+#ifdef USE_L1_DISTANCE
+      block += ABS(x[j] - y[j]);
+#else
+      block += SQR(x[j] - y[j]);
+#endif
+    }
+    result += block;
+    if (result > threshold){
+      return result;
+    }
+  }
+  for(; i < dimension; i++){
+#ifdef USE_L1_DISTANCE
+    result += ABS(x[i] - y[i]);
+#else
+    result += SQR(x[i] - y[i]);
+#endif
   }
-
   return result;
 }
+
+#if defined(__x86_64__) && !defined(USE_L1_DISTANCE) && (defined(REAL_DOUBLE) || defined(REAL_FLOAT))
+#define SIMD_DISTANCE_KERNELS
+#include <immintrin.h>
+
+#ifdef REAL_DOUBLE
+#define VEC256 __m256d
+#define LOAD256 _mm256_loadu_pd
+#define SUB256 _mm256_sub_pd
+#define FMADD256 _mm256_fmadd_pd
+#define ADD256 _mm256_add_pd
+#define ZERO256 _mm256_setzero_pd
+#define STORE256 _mm256_storeu_pd
+#define VEC512 __m512d
+#define LOAD512 _mm512_loadu_pd
+#define SUB512 _mm512_sub_pd
+#define FMADD512 _mm512_fmadd_pd
+#define ADD512 _mm512_add_pd
+#define ZERO512 _mm512_setzero_pd
+#define FOLD512(v) _mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xF, (v), 0), _mm512_maskz_extractf64x4_pd(0xF, (v), 1))
 #else
-// Returns the Euclidean distance from point <p1> to <p2>.
-RealT distance(IntT dimension, PPointT p1, PPointT p2){
+#define VEC256 __m256
+#define LOAD256 _mm256_loadu_ps
+#define SUB256 _mm256_sub_ps
+#define FMADD256 _mm256_fmadd_ps
+#define ADD256 _mm256_add_ps
+#define ZERO256 _mm256_setzero_ps
+#define STORE256 _mm256_storeu_ps
+#define VEC512 __m512
+#define LOAD512 _mm512_loadu_ps
+#define SUB512 _mm512_sub_ps
+#define FMADD512 _mm512_fmadd_ps
+#define ADD512 _mm512_add_ps
+#define ZERO512 _mm512_setzero_ps
+#define FOLD512(v) _mm256_add_ps(_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(v), 0)), _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(v), 1)))
+#endif
+// The number of coordinates in a 256- and in a 512-bit vector.
+#define LANES256 (32 / (IntT)sizeof(RealT))
+#define LANES512 (64 / (IntT)sizeof(RealT))
+
+// Each block is accumulated in two vectors (two independent chains of
+// FMAs).
+__attribute__((target("avx2,fma")))
+RealT sqrDistanceAVX2(IntT dimension, const RealT *x, const RealT *y, RealT threshold){
+  RealT result = 0;
+  IntT i = 0;
+  for(; i + DISTANCE_BLOCK_SIZE <= dimension; i += DISTANCE_BLOCK_SIZE){
+    VEC256 sum0 = ZERO256();
+    VEC256 sum1 = ZERO256();
+    for(IntT j = i; j < i + DISTANCE_BLOCK_SIZE; j += 2 * LANES256){
+      VEC256 difference0 = SUB256(LOAD256(x + j), LOAD256(y + j));
+      VEC256 difference1 = SUB256(LOAD256(x + j + LANES256), LOAD256(y + j + LANES256));
+      sum0 = FMADD256(difference0, difference0, sum0);
+      sum1 = FMADD256(difference1, difference1, sum1);
+    }
+    RealT lanes[LANES256];
+    STORE256(lanes, ADD256(sum0, sum1));
+    for(IntT l = 0; l < LANES256; l++){
+      result += lanes[l];
+    }
+    if (result > threshold){
+      return result;
+    }
+  }
+  for(; i < dimension; i++){
+    result += SQR(x[i] - y[i]);
+  }
+  return result;
+}
+
+__attribute__((target("avx512f")))
+RealT sqrDistanceAVX512(IntT dimension, const RealT *x, const RealT *y, RealT threshold){
   RealT result = 0;
+  IntT i = 0;
+  for(; i + DISTANCE_BLOCK_SIZE <= dimension; i += DISTANCE_BLOCK_SIZE){
+    VEC512 sum0 = ZERO512();
+    VEC512 sum1 = ZERO512();
+    IntT j = i;
+    for(; j + 2 * LANES512 <= i + DISTANCE_BLOCK_SIZE; j += 2 * LANES512){
+      VEC512 difference0 = SUB512(LOAD512(x + j), LOAD512(y + j));
+      VEC512 difference1 = SUB512(LOAD512(x + j + LANES512), LOAD512(y + j + LANES512));
+      sum0 = FMADD512(difference0, difference0, sum0);
+      sum1 = FMADD512(difference1, difference1, sum1);
+    }
+    for(; j < i + DISTANCE_BLOCK_SIZE; j += LANES512){
+      VEC512 difference = SUB512(LOAD512(x + j), LOAD512(y + j));
+      sum0 = FMADD512(difference, difference, sum0);
+    }
+    // Add the two 256-bit halves of the sum, then its lanes as in
+    // sqrDistanceAVX2. (The unmasked reductions and extractions of
+    // gcc 12 start from an undefined vector and trip
+    // -Wmaybe-uninitialized; the zero-masked extraction does not.)
+    RealT lanes[LANES256];
+    STORE256(lanes, FOLD512(ADD512(sum0, sum1)));
+    for(IntT l = 0; l < LANES256; l++){
+      result += lanes[l];
+    }
+    if (result > threshold){
+      return result;
+    }
+  }
+  for(; i < dimension; i++){
+    result += SQR(x[i] - y[i]);
+  }
+  return result;
+}
+
+// The product kernels of dotProducts take DOT_PRODUCTS_BLOCK rows;
+// each coordinate of <y> is loaded once for all of them.
+__attribute__((target("avx2,fma")))
+void dotProductsAVX2(IntT dimension, const RealT *const *xs, const RealT *y, RealT *products, RealT &sqrLengthY){
+  VEC256 sums[DOT_PRODUCTS_BLOCK];
+  for(IntT r = 0; r < DOT_PRODUCTS_BLOCK; r++){
+    sums[r] = ZERO256();
+  }
+  VEC256 sumY = ZERO256();
+  IntT i = 0;
+  for(; i + LANES256 <= dimension; i += LANES256){
+    VEC256 coordinatesY = LOAD256(y + i);
+    for(IntT r = 0; r < DOT_PRODUCTS_BLOCK; r++){
+      sums[r] = FMADD256(LOAD256(xs[r] + i), coordinatesY, sums[r]);
+    }
+    sumY = FMADD256(coordinatesY, coordinatesY, sumY);
+  }
+  RealT lanes[LANES256];
+  for(IntT r = 0; r < DOT_PRODUCTS_BLOCK; r++){
+    STORE256(lanes, sums[r]);
+    products[r] = 0;
+    for(IntT l = 0; l < LANES256; l++){
+      products[r] += lanes[l];
+    }
+  }
+  STORE256(lanes, sumY);
+  sqrLengthY = 0;
+  for(IntT l = 0; l < LANES256; l++){
+    sqrLengthY += lanes[l];
+  }
+  for(; i < dimension; i++){
+    for(IntT r = 0; r < DOT_PRODUCTS_BLOCK; r++){
+      products[r] += xs[r][i] * y[i];
+    }
+    sqrLengthY += SQR(y[i]);
+  }
+}
+#endif
+
+// Returns the best kernel that the processor supports.
+DistanceKernelT selectDistanceKernel(){
+#ifdef SIMD_DISTANCE_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")){
+    return sqrDistanceAVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+    return sqrDistanceAVX2;
+  }
+#endif
+  return sqrDistanceScalar;
+}
+
+// (selected during the static initialization, so it is set before any
+// thread queries)
+DistanceKernelT distanceKernel = selectDistanceKernel();
+
+RealT sqrDistanceBounded(IntT dimension, const RealT *x, const RealT *y, RealT threshold){
+  return distanceKernel(dimension, x, y, threshold);
+}
+
+typedef void (*DotProductsKernelT)(IntT dimension, const RealT *const *xs, const RealT *y, RealT *products, RealT &sqrLengthY);
+
+void dotProductsScalar(IntT dimension, const RealT *const *xs, const RealT *y, RealT *products, RealT &sqrLengthY){
+  for(IntT r = 0; r < DOT_PRODUCTS_BLOCK; r++){
+    products[r] = 0;
+  }
+  sqrLengthY = 0;
+  for(IntT i = 0; i < dimension; i++){
+    for(IntT r = 0; r < DOT_PRODUCTS_BLOCK; r++){
+      products[r] += xs[r][i] * y[i];
+    }
+    sqrLengthY += SQR(y[i]);
+  }
+}
+
+DotProductsKernelT selectDotProductsKernel(){
+#ifdef SIMD_DISTANCE_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+    return dotProductsAVX2;
+  }
+#endif
+  return dotProductsScalar;
+}
 
-  for (IntT i = 0; i < dimension; i++){
-    result += SQR(p1->coordinates[i] - p2->coordinates[i]);
+DotProductsKernelT dotProductsKernel = selectDotProductsKernel();
+
+void dotProducts(IntT dimension, IntT nXs, const RealT *const *xs, const RealT *y, RealT *products, RealT &sqrLengthY){
+  CR_ASSERT(nXs > 0 && nXs <= DOT_PRODUCTS_BLOCK);
+  // (the missing rows repeat the first one)
+  const RealT *rows[DOT_PRODUCTS_BLOCK];
+  RealT rowProducts[DOT_PRODUCTS_BLOCK];
+  for(IntT r = 0; r < DOT_PRODUCTS_BLOCK; r++){
+    rows[r] = xs[r < nXs ? r : 0];
+  }
+  dotProductsKernel(dimension, rows, y, rowProducts, sqrLengthY);
+  for(IntT r = 0; r < nXs; r++){
+    products[r] = rowProducts[r];
   }
+}
 
-  return SQRT(result);
+#ifdef USE_L1_DISTANCE
+// Returns the L1 distance from point <p1> to <p2>.
+RealT distance(IntT dimension, PPointT p1, PPointT p2){
+  return sqrDistanceBounded(dimension, p1->coordinates, p2->coordinates, INFINITY);
+}
+#else
+// Returns the Euclidean distance from point <p1> to <p2>.
+RealT distance(IntT dimension, PPointT p1, PPointT p2){
+  return SQRT(sqrDistanceBounded(dimension, p1->coordinates, p2->coordinates, INFINITY));
 }
 #endif
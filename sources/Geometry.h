@@ -39,4 +39,26 @@ int comparePPointAndRealTStructT(const void *a, const void *b);
 
 RealT distance(IntT dimension, PPointT p1, PPointT p2);
 
+// The number of coordinates that the distance kernels accumulate
+// between two comparisons with the threshold.
+#define DISTANCE_BLOCK_SIZE 32
+
+// Returns the squared Euclidean distance (the L1 distance with
+// USE_L1_DISTANCE) between the vectors <x> and <y>, or, as soon as
+// the sum of the first blocks of DISTANCE_BLOCK_SIZE coordinates
+// exceeds <threshold>, that partial sum. The kernel (AVX-512, AVX2 or
+// scalar) is chosen according to the processor during the static
+// initialization of Geometry.cpp, before main() runs.
+RealT sqrDistanceBounded(IntT dimension, const RealT *x, const RealT *y, RealT threshold);
+
+// The most vectors <xs> of a call of dotProducts.
+#define DOT_PRODUCTS_BLOCK 4
+
+// Sets products[i] to the dot product of the vectors xs[i] and <y>
+// (for i < <nXs> <= DOT_PRODUCTS_BLOCK), and <sqrLengthY> to the
+// square of the length of <y>: a column of the product of the matrix
+// of the <xs> by the one of the vectors <y>, for which <y> is read
+// only once. The kernel is chosen as for sqrDistanceBounded.
+void dotProducts(IntT dimension, IntT nXs, const RealT *const *xs, const RealT *y, RealT *products, RealT &sqrLengthY);
+
 #endif
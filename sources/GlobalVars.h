@@ -46,12 +46,17 @@ DECLARE_EXTERN TimeVarT timeCopyingULSHs;
 DECLARE_EXTERN TimeVarT timeTotalBuckets;
 DECLARE_EXTERN TimeVarT timeUnmarking;
 
-DECLARE_EXTERN BooleanT timingOn EXTERN_INIT(= TRUE);
+// Whether the TIMEV_* timers of the calling thread are on (each thread
+// has its own flag; the threads of the parallel builds turn theirs
+// off, since the timers are not atomic).
+DECLARE_EXTERN thread_local BooleanT timingOn EXTERN_INIT(= TRUE);
 DECLARE_EXTERN TimeVarT currentTime EXTERN_INIT(= 0);
 DECLARE_EXTERN TimeVarT timevSpeed EXTERN_INIT(= 0);
 
 DECLARE_EXTERN IntT nOfDistComps EXTERN_INIT(= 0);
 DECLARE_EXTERN MemVarT totalAllocatedMemory EXTERN_INIT(= 0);
+DECLARE_EXTERN IntT queryPrefetchDistance EXTERN_INIT(= QUERY_PREFETCH_DISTANCE);
+DECLARE_EXTERN IntT queryInterleaving EXTERN_INIT(= QUERY_INTERLEAVING);
 DECLARE_EXTERN IntT nGBuckets EXTERN_INIT(= 0);
 DECLARE_EXTERN IntT nBucketsInChains EXTERN_INIT(= 0);
 //DECLARE_EXTERN IntT nPointsInBuckets EXTERN_INIT(= 0); // total # of points found in collinding buckets (including repetitions)
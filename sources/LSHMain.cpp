@@ -66,7 +66,7 @@ char sBuffer[600000];
   Prints the usage of the LSHMain.
  */
 void usage(char *programName){
-  printf("Usage: %s #pts_in_data_set #queries dimension successProbability radius data_set_file query_points_file max_available_memory [-c|-p params_file]\n", programName);
+  printf("Usage: %s #pts_in_data_set #queries dimension successProbability radius data_set_file query_points_file max_available_memory [-c|-p params_file ground_truth_file [k [min_collisions [top_candidates]]]]\n", programName);
 }
 
   template<typename T>
@@ -122,12 +122,11 @@ void compute_recall(
   }
 }
 
-inline PPointT readPoint(FILE *fileHandle)
+// Reads a point from <fileHandle> into <p>, whose <coordinates> are
+// already allocated.
+inline void readPoint(FILE *fileHandle, PPointT p)
 {
-  PPointT p;
   RealT sqrLength = 0;
-  FAILIF(NULL == (p = (PPointT)MALLOC(sizeof(PointT))));
-  FAILIF(NULL == (p->coordinates = (RealT*)MALLOC(pointsDimension * sizeof(RealT))));
   for(IntT d = 0; d < pointsDimension; d++){
     FSCANF_REAL(fileHandle, &(p->coordinates[d]));
     sqrLength += SQR(p->coordinates[d]);
@@ -135,13 +134,15 @@ inline PPointT readPoint(FILE *fileHandle)
   fscanf(fileHandle, "%[^\n]", sBuffer);
   p->index = -1;
   p->sqrLength = sqrLength;
-  return p;
 }
 
 // Reads in the data set points from <filename> in the array
 // <dataSetPoints>. Each point get a unique number in the field
-// <index> to be easily indentifiable.
-void readDataSetFromFile(char *filename)
+// <index> to be easily indentifiable. The points and their
+// coordinates are stored in two arenas (large regions allocated with
+// <placement>, see MALLOC_LARGE), so that scanning the candidates
+// touches few pages.
+void readDataSetFromFile(char *filename, IntT placement)
 {
   FILE *f = fopen(filename, "rt");
   FAILIF(f == NULL);
@@ -152,9 +153,15 @@ void readDataSetFromFile(char *filename)
   //fscanf(f, "\n");
 
   FAILIF(NULL == (dataSetPoints = (PPointT*)MALLOC(nPoints * sizeof(PPointT))));
+  PPointT pointsArena;
+  RealT *coordinatesArena;
+  FAILIF(NULL == (pointsArena = (PPointT)MALLOC_LARGE((MemVarT)nPoints * sizeof(PointT), placement)));
+  FAILIF(NULL == (coordinatesArena = (RealT*)MALLOC_LARGE((MemVarT)nPoints * pointsDimension * sizeof(RealT), placement)));
   
   for(IntT i = 0; i < nPoints; i++){
-    dataSetPoints[i] = readPoint(f);
+    dataSetPoints[i] = pointsArena + i;
+    dataSetPoints[i]->coordinates = coordinatesArena + (MemVarT)i * pointsDimension;
+    readPoint(f, dataSetPoints[i]);
     dataSetPoints[i]->index = i;
   }
 }
@@ -208,7 +215,8 @@ int main(int nargs, char **args)
   //initializeLSHGlobal();
 
   // Parse part of the command-line parameters.
-  nPoints = atoi(args[1]);
+  LongUns64T nPointsArgument = strtoull(args[1], NULL, 10);
+  nPoints = (IntT)MIN(nPointsArgument, MAX_N_POINTS);
   IntT nQueries = atoi(args[2]);
   pointsDimension = atoi(args[3]);
   successProbability = atof(args[4]);
@@ -249,23 +257,41 @@ int main(int nargs, char **args)
   //thresholdR = atof(args[5]);
   availableTotalMemory = atoll(args[8]);
 
-  if (nPoints > MAX_N_POINTS) {
-    printf("Error: the structure supports at most %d points (%d were specified).\n", MAX_N_POINTS, nPoints);
-    fprintf(ERROR_OUTPUT, "Error: the structure supports at most %d points (%d were specified).\n", MAX_N_POINTS, nPoints);
+  if (nPointsArgument > MAX_N_POINTS) {
+    printf("Error: the structure supports at most %u points (%llu were specified).\n", MAX_N_POINTS, nPointsArgument);
+    fprintf(ERROR_OUTPUT, "Error: the structure supports at most %u points (%llu were specified).\n", MAX_N_POINTS, nPointsArgument);
     exit(1);
   }
 
+  // The R-NN DS parameters given with -p are read before the data
+  // set, so that the points are placed in memory as the parameters
+  // ask (see RNNParametersT.memoryPlacement).
+  RNNParametersT *algParameters = NULL;
+  PRNearNeighborStructT *nnStructs = NULL;
+  IntT dataSetPlacement = LARGE_REGION_DEFAULT;
+  if (nargs > 10 && strcmp("-p", args[9]) == 0) {
+    FILE *pFile = fopen(args[10], "rt");
+    FAILIFWR(pFile == NULL, "Could not open the params file.");
+    fscanf(pFile, "%d\n", &nRadii);
+    DPRINTF1("Using the following R-NN DS parameters:\n");
+    DPRINTF("N radii = %d\n", nRadii);
+    FAILIF(NULL == (algParameters = (RNNParametersT*)MALLOC(nRadii * sizeof(RNNParametersT))));
+    for(IntT i = 0; i < nRadii; i++){
+      algParameters[i] = readRNNParameters(pFile);
+      printRNNParameters(stderr, algParameters[i]);
+    }
+    fclose(pFile);
+    dataSetPlacement = algParameters[0].memoryPlacement;
+  }
+
   //read data file from command
-  readDataSetFromFile(args[6]);
+  readDataSetFromFile(args[6], dataSetPlacement);
   DPRINTF("Allocated memory (after reading data set): %lld\n", totalAllocatedMemory);
 
   // printf("data has been read \n");
 
 
 
-
-  RNNParametersT *algParameters = NULL;
-  PRNearNeighborStructT *nnStructs = NULL;
   if (nargs > 9) {
 
     // Additional command-line parameter is specified.
@@ -311,21 +337,13 @@ int main(int nargs, char **args)
     } else if (strcmp("-p", args[9]) == 0) {
         // Read the R-NN DS parameters from the given file and run the
         // queries on the constructed data structure.
-        if (nargs < 10){
+        // (The parameters were read before the data set.)
+        if (nargs < 11){
 	        usage(args[0]);
 	        exit(1);
         }
-        FILE *pFile = fopen(args[10], "rt");
-        FAILIFWR(pFile == NULL, "Could not open the params file.");
-        fscanf(pFile, "%d\n", &nRadii);
-        DPRINTF1("Using the following R-NN DS parameters:\n");
-        DPRINTF("N radii = %d\n", nRadii);
         FAILIF(NULL == (nnStructs = (PRNearNeighborStructT*)MALLOC(nRadii * sizeof(PRNearNeighborStructT))));
-        FAILIF(NULL == (algParameters = (RNNParametersT*)MALLOC(nRadii * sizeof(RNNParametersT))));
         for(IntT i = 0; i < nRadii; i++){
-	        algParameters[i] = readRNNParameters(pFile);
-	        printRNNParameters(stderr, algParameters[i]);
-
           clock_t start, end;
           start = clock();
 	        // nnStructs[i] = initLSH_WithDataSet(algParameters[i], nPoints, dataSetPoints); // E2LSH
@@ -336,6 +354,7 @@ int main(int nargs, char **args)
           
           end = clock();
           std::cout<<"Indexing time is "<<(double)(end-start) / CLOCKS_PER_SEC <<"(s)"<<std::endl;
+          printHeavyBucketStatistics(stderr, nnStructs[i]);
         }
 
         pointsDimension = algParameters[0].dimension;
@@ -373,6 +392,21 @@ int main(int nargs, char **args)
     unsigned Qnum = nQueries;
   
     load_ivecs_data(args[11], true_load, Qnum, dim);
+
+    // The number of nearest neighbors reported for each query (and
+    // checked against the ground truth).
+    IntT nReportedNeighbors = nargs > 12 ? atoi(args[12]) : MAX_REPORTED_POINTS;
+    FAILIFWR(nReportedNeighbors <= 0 || nReportedNeighbors > (IntT)dim, "Invalid number of reported neighbors.");
+
+    // The collision-count ranking of the candidates (none by default;
+    // see CollisionRankingT).
+    CollisionRankingT collisionRanking;
+    collisionRanking.minCollisions = nargs > 13 ? atoi(args[13]) : 0;
+    collisionRanking.nTopCandidates = nargs > 14 ? atoi(args[14]) : 0;
+    FAILIFWR(collisionRanking.nTopCandidates < 0, "Invalid number of top candidates.");
+    for(IntT r = 0; r < nRadii; r++){
+      setCollisionRanking(nnStructs[r], collisionRanking);
+    }
     
 
     DPRINTF1("X\n");
@@ -393,6 +427,7 @@ int main(int nargs, char **args)
     FAILIF(queryFile == NULL);
     TimeVarT meanQueryTime = 0;
     PPointAndRealTStructT *distToNN = NULL;
+    FAILIF(NULL == (distToNN = (PPointAndRealTStructT*)MALLOC(nReportedNeighbors * sizeof(*distToNN))));
 
     std::vector<float> Qrecall;
     Qrecall.resize(nQueries);
@@ -402,7 +437,7 @@ int main(int nargs, char **args)
     for(IntT i = 0; i < 200; i++){
 
       unsigned count = 0;
-      unsigned nMax = 10;
+      unsigned nMax = nReportedNeighbors;
 
       RealT sqrLength = 0;
       for(IntT d = 0; d < pointsDimension; d++){
@@ -419,7 +454,7 @@ int main(int nargs, char **args)
 
         // nNNs = FgetRNearNeighbors(nnStructs[r], queryPoint, result, resultSize, num, subdim); // ACHash
         
-        nNNs = R2getRNearNeighbors(nnStructs[r], queryPoint, result, resultSize, num, subdim); // FastLSH
+        nNNs = R2getKNearestNeighbors(nnStructs[r], queryPoint, nReportedNeighbors, distToNN, num, subdim); // FastLSH
     
         // printf("Total time for R-NN query at radius %0.6lf (radius no. %d):\t%0.6lf\n", (double)(listOfRadii[r]), r, timeRNNQuery);
         meanQueryTime += timeRNNQuery;
@@ -427,16 +462,8 @@ int main(int nargs, char **args)
         if (nNNs > 0){
 	        // printf("Query point %d: found %d NNs at distance %0.6lf (%dth radius). First %d NNs are:\n", i, nNNs, (double)(listOfRadii[r]), r, MIN(nNNs, MAX_REPORTED_POINTS));
 	
-	        // compute the distances to the found NN, and sort according to the distance
-	        FAILIF(NULL == (distToNN = (PPointAndRealTStructT*)REALLOC(distToNN, nNNs * sizeof(*distToNN))));
-	        for(IntT p = 0; p < nNNs; p++){
-	          distToNN[p].ppoint = result[p];
-	          distToNN[p].real = distance(pointsDimension, queryPoint, result[p]);
-	        }
-	        qsort(distToNN, nNNs, sizeof(*distToNN), comparePPointAndRealTStructT);
-
-	        // Print the points
-	        for(IntT j = 0; j < MIN(nNNs, MAX_REPORTED_POINTS); j++){
+	        // Print the points (already sorted by distance)
+	        for(IntT j = 0; j < nNNs; j++){
 	          ASSERT(distToNN[j].ppoint != NULL);
 
             compute_recall(true_load[i], distToNN[j].ppoint->index, count, nMax);
@@ -451,7 +478,7 @@ int main(int nargs, char **args)
       }
       TotalPoints += num;
 
-      Qrecall[i] = (float)count / 10;
+      Qrecall[i] = (float)count / nMax;
       
 
       if (nNNs == 0){
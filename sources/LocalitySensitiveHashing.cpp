@@ -33,7 +33,10 @@
 #include <queue>
 #include <algorithm>
 #include <ctime>
+#include <cctype>
 #include <vector>
+#include <thread>
+#include <limits>
 
 bool is_power_of_two(int n){
     return (n > 0) && ((n & (n-1)) == 0);
@@ -63,6 +66,22 @@ void printRNNParameters(FILE *output, RNNParametersT parameters){
   fprintf(output, "%d\n", parameters.parameterT);
   fprintf(output, "typeHT\n");
   fprintf(output, "%d\n", parameters.typeHT);
+  fprintf(output, "Hash table size\n");
+  fprintf(output, "%d\n", parameters.hashTableSize);
+  fprintf(output, "Heavy bucket policy\n");
+  fprintf(output, "%d\n", parameters.heavyBucketPolicy);
+  fprintf(output, "Heavy bucket threshold\n");
+  fprintf(output, "%d\n", parameters.heavyBucketThreshold);
+  fprintf(output, "Universal hash functions\n");
+  fprintf(output, "%d\n", parameters.uhfType);
+  fprintf(output, "Memory placement\n");
+  fprintf(output, "%d\n", parameters.memoryPlacement);
+  fprintf(output, "Probes per table\n");
+  fprintf(output, "%d\n", parameters.nProbesPerTable);
+  fprintf(output, "Peak build memory\n");
+  fprintf(output, "%lld\n", parameters.peakBuildMemory);
+  fprintf(output, "Build shards\n");
+  fprintf(output, "%d\n", parameters.nBuildShards);
 }
 
 RNNParametersT readRNNParameters(FILE *input){
@@ -103,9 +122,64 @@ RNNParametersT readRNNParameters(FILE *input){
   fscanf(input, "\n");fscanf(input, "%[^\n]\n", s);
   fscanf(input, "%d", &parameters.typeHT);
 
+  // The parameters after <typeHT> are optional (files written before
+  // they were added end with <typeHT>, or continue with the next set
+  // of parameters).
+  parameters.hashTableSize = 0;
+  parameters.heavyBucketPolicy = HEAVY_BUCKET_KEEP;
+  parameters.heavyBucketThreshold = 0;
+  parameters.uhfType = UHF_MOD_PRIME;
+  parameters.memoryPlacement = LARGE_REGION_DEFAULT;
+  parameters.nProbesPerTable = 0;
+  parameters.peakBuildMemory = 0;
+  parameters.nBuildShards = 1;
+  while (TRUE){
+    // Look at the first character of the next label without reading
+    // it (the input need not be seekable): the optional parameters end
+    // at the end of the input or at the label "R" of the next set of
+    // parameters (no optional label starts with 'R').
+    int c;
+    do {
+      c = fgetc(input);
+    } while (c != EOF && isspace(c));
+    if (c == EOF){
+      break;
+    }
+    ungetc(c, input);
+    if (c == 'R'){
+      break;
+    }
+    fscanf(input, "%[^\n]", s);
+    if (strcmp(s, "Hash table size") == 0){
+      fscanf(input, "%d", &parameters.hashTableSize);
+    }else if (strcmp(s, "Heavy bucket policy") == 0){
+      fscanf(input, "%d", &parameters.heavyBucketPolicy);
+    }else if (strcmp(s, "Heavy bucket threshold") == 0){
+      fscanf(input, "%d", &parameters.heavyBucketThreshold);
+    }else if (strcmp(s, "Universal hash functions") == 0){
+      fscanf(input, "%d", &parameters.uhfType);
+    }else if (strcmp(s, "Memory placement") == 0){
+      fscanf(input, "%d", &parameters.memoryPlacement);
+    }else if (strcmp(s, "Probes per table") == 0){
+      fscanf(input, "%d", &parameters.nProbesPerTable);
+    }else if (strcmp(s, "Peak build memory") == 0){
+      fscanf(input, "%lld", &parameters.peakBuildMemory);
+    }else if (strcmp(s, "Build shards") == 0){
+      fscanf(input, "%d", &parameters.nBuildShards);
+    }else{
+      FAILIFWR(TRUE, "Unknown parameter in the parameters file.");
+    }
+  }
+
   return parameters;
 }
 
+// The number of slots of the hash tables built with <algParameters>
+// for <nPoints> points.
+inline Int32T hashTableSizeForParameters(RNNParametersT algParameters, Int32T nPoints){
+  return algParameters.hashTableSize > 0 ? algParameters.hashTableSize : nPoints;
+}
+
 // Creates the LSH hash functions for the R-near neighbor structure
 // <nnStruct>. The functions fills in the corresponding field of
 // <nnStruct>.
@@ -298,9 +372,13 @@ PRNearNeighborStructT initializePRNearNeighborFields(RNNParametersT algParameter
     nnStruct->hfTuplesLength = algParameters.parameterK / 2;
   }
   nnStruct->parameterT = algParameters.parameterT;
+  nnStruct->nProbesPerTable = MIN(MAX(algParameters.nProbesPerTable, 0), MULTIPROBE_MAX_PROBES);
   nnStruct->dimension = algParameters.dimension;
   nnStruct->parameterW = algParameters.parameterW;
 
+  // the tables of the structure are allocated with its placement.
+  nnStruct->memoryPlacement = algParameters.memoryPlacement;
+
   nnStruct->nPoints = 0;
   nnStruct->pointsArraySize = nPointsEstimate;
 
@@ -320,7 +398,19 @@ PRNearNeighborStructT initializePRNearNeighborFields(RNNParametersT algParameter
 
   FAILIF(NULL == (nnStruct->precomputedHashesOfULSHs = (Uns32T**)MALLOC(nnStruct->nHFTuples * sizeof(Uns32T*))));
   for(IntT i = 0; i < nnStruct->nHFTuples; i++){
-    FAILIF(NULL == (nnStruct->precomputedHashesOfULSHs[i] = (Uns32T*)MALLOC(nnStruct->hfTuplesLength * sizeof(Uns32T))));
+    FAILIF(NULL == (nnStruct->precomputedHashesOfULSHs[i] = (Uns32T*)MALLOC(MAX(nnStruct->hfTuplesLength, N_PRECOMPUTED_HASHES_NEEDED) * sizeof(Uns32T))));
+  }
+
+  // the coefficients of the multiply-shift hash functions.
+  nnStruct->uhfType = algParameters.uhfType;
+  nnStruct->multiplyShiftA = NULL;
+  if (nnStruct->uhfType == UHF_MULTIPLY_SHIFT){
+    FAILIF(NULL == (nnStruct->multiplyShiftA = (LongUns64T*)MALLOC(UHF_NUMBER_OF_HASHES * nnStruct->parameterK * sizeof(LongUns64T))));
+    for(IntT i = 0; i < UHF_NUMBER_OF_HASHES * nnStruct->parameterK; i++){
+      nnStruct->multiplyShiftA[i] = ((LongUns64T)genRandomUns32(0, TWO_TO_32_MINUS_1) << 32) | genRandomUns32(0, TWO_TO_32_MINUS_1);
+    }
+  }else{
+    FAILIFWR(nnStruct->uhfType != UHF_MOD_PRIME, "Unknown family of universal hash functions.");
   }
 
   // init the vector <reducedPoint>
@@ -335,6 +425,51 @@ PRNearNeighborStructT initializePRNearNeighborFields(RNNParametersT algParameter
   FAILIF(NULL == (nnStruct->markedPointsIndeces = (Int32T*)MALLOC(nnStruct->sizeMarkedPoints * sizeof(Int32T))));
 
   nnStruct->reportingResult = TRUE;
+  nnStruct->queryContext = NULL;
+  nnStruct->queryLimits.maxCandidates = 0;
+  nnStruct->queryLimits.maxTables = 0;
+  nnStruct->queryLimits.maxTime = 0;
+  nnStruct->collisionRanking.minCollisions = 0;
+  nnStruct->collisionRanking.nTopCandidates = 0;
+
+  nnStruct->deltaBuckets = NULL;
+  nnStruct->deltaHashes = NULL;
+  nnStruct->nDeltaPoints = 0;
+  nnStruct->deltaCapacity = 0;
+
+  FAILIF(NULL == (nnStruct->deletedPoints = (Uns32T*)MALLOC(N_WORDS_FOR_POINTS_BITMAP(nnStruct->pointsArraySize) * sizeof(Uns32T))));
+  memset(nnStruct->deletedPoints, 0, N_WORDS_FOR_POINTS_BITMAP(nnStruct->pointsArraySize) * sizeof(Uns32T));
+  nnStruct->nDeletedPoints = 0;
+  nnStruct->nDeletedPointsInTables = 0;
+  nnStruct->nextTableToCompact = -1;
+  nnStruct->nDeletedAtCompactionStart = 0;
+
+  nnStruct->heavyBucketPolicy = algParameters.heavyBucketPolicy;
+  nnStruct->heavyBucketThreshold = algParameters.heavyBucketThreshold;
+  nnStruct->heavyBucketStats = NULL;
+  nnStruct->heavySplitFunctions = NULL;
+  nnStruct->heavySplitKeys = NULL;
+  nnStruct->nHeavySplitKeys = NULL;
+  if (nnStruct->heavyBucketPolicy != HEAVY_BUCKET_KEEP){
+    FAILIFWR(nnStruct->heavyBucketPolicy < HEAVY_BUCKET_KEEP || nnStruct->heavyBucketPolicy > HEAVY_BUCKET_SPLIT, "Unknown heavy bucket policy.");
+    FAILIFWR(nnStruct->heavyBucketThreshold < 1, "The heavy bucket threshold must be positive.");
+    FAILIF(NULL == (nnStruct->heavyBucketStats = (HeavyBucketStatsT*)MALLOC(nnStruct->parameterL * sizeof(HeavyBucketStatsT))));
+    memset(nnStruct->heavyBucketStats, 0, nnStruct->parameterL * sizeof(HeavyBucketStatsT));
+  }
+  if (nnStruct->heavyBucketPolicy == HEAVY_BUCKET_SPLIT){
+    FAILIF(NULL == (nnStruct->heavySplitFunctions = (LSHFunctionT*)MALLOC(nnStruct->parameterL * sizeof(LSHFunctionT))));
+    FAILIF(NULL == (nnStruct->heavySplitKeys = (LongUns64T**)MALLOC(nnStruct->parameterL * sizeof(LongUns64T*))));
+    FAILIF(NULL == (nnStruct->nHeavySplitKeys = (Int32T*)MALLOC(nnStruct->parameterL * sizeof(Int32T))));
+    for(IntT i = 0; i < nnStruct->parameterL; i++){
+      FAILIF(NULL == (nnStruct->heavySplitFunctions[i].a = (RealT*)MALLOC(nnStruct->dimension * sizeof(RealT))));
+      for(IntT d = 0; d < nnStruct->dimension; d++){
+	nnStruct->heavySplitFunctions[i].a[d] = genGaussianRandom();
+      }
+      nnStruct->heavySplitFunctions[i].b = genUniformRandom(0, nnStruct->parameterW);
+      nnStruct->heavySplitKeys[i] = NULL;
+      nnStruct->nHeavySplitKeys[i] = 0;
+    }
+  }
 
   return nnStruct;
 }
@@ -349,27 +484,324 @@ PRNearNeighborStructT initLSH(RNNParametersT algParameters, Int32T nPointsEstima
   Uns32T *mainHashA = NULL, *controlHash1 = NULL;
   BooleanT uhashesComputedAlready = FALSE;
   for(IntT i = 0; i < nnStruct->parameterL; i++){
-    nnStruct->hashedBuckets[i] = newUHashStructure(algParameters.typeHT, nPointsEstimate, nnStruct->parameterK, uhashesComputedAlready, mainHashA, controlHash1, NULL);
+    nnStruct->hashedBuckets[i] = newUHashStructure(algParameters.typeHT, hashTableSizeForParameters(algParameters, nPointsEstimate), nnStruct->parameterK, uhashesComputedAlready, mainHashA, controlHash1, NULL, nnStruct->memoryPlacement);
     uhashesComputedAlready = TRUE;
   }
 
   return nnStruct;
 }
 
+// The key of the bucket with the control value <control1> in the slot
+// <slot> in the sorted arrays <heavySplitKeys>.
+#define HEAVY_SPLIT_KEY(slot, control1) (((LongUns64T)(slot) << 32) | (Uns32T)(control1))
+
+// Returns the value of the extra LSH function of the table <table> of
+// <nnStruct> (see HEAVY_BUCKET_SPLIT) on the point <coordinates>.
+inline Int32T heavySplitValue(const RNearNeighborStructT *nnStruct, IntT table, RealT *coordinates){
+  LSHFunctionT *splitFunction = nnStruct->heavySplitFunctions + table;
+  RealT value = 0;
+  for(IntT d = 0; d < nnStruct->dimension; d++){
+    value += coordinates[d] * splitFunction->a[d];
+  }
+  return FLOOR_INT32((value + splitFunction->b) / nnStruct->parameterW);
+}
+
+// Returns the control value of the child, for the value <splitValue>
+// of the extra LSH function, of the split bucket with the control
+// value <control1> (the child stays in the slot of the bucket).
+inline Uns32T heavySplitChildControl(Uns32T control1, Int32T splitValue){
+  return control1 ^ (((Uns32T)splitValue + 1) * 2654435761U);
+}
+
+// Applies the heavy-bucket policy of <nnStruct> to the HT_LINKED_LIST
+// model table <modelHT> of the table <table>, just before it is packed
+// (so that the policy is applied again when the table is repacked
+// after a merge or a compaction), and records the statistics of the
+// table. For HEAVY_BUCKET_SPLIT, the points that arrive in an already
+// split bucket go to its children regardless of the size of the
+// bucket. A bucket is split only if no control value of its children
+// is used in its slot by another bucket, by a split bucket, or by a
+// child of another bucket (the buckets would be merged); the children
+// of a bucket split by an earlier packing are not checked again.
+void applyHeavyBucketPolicy(PRNearNeighborStructT nnStruct, IntT table, PUHashStructureT modelHT){
+  ASSERT(nnStruct != NULL);
+  ASSERT(modelHT != NULL && modelHT->typeHT == HT_LINKED_LIST);
+  if (nnStruct->heavyBucketPolicy == HEAVY_BUCKET_KEEP){
+    return;
+  }
+
+  Int32T threshold = nnStruct->heavyBucketThreshold;
+  HeavyBucketStatsT *stats = nnStruct->heavyBucketStats + table;
+  memset(stats, 0, sizeof(HeavyBucketStatsT));
+
+  BooleanT split = nnStruct->heavyBucketPolicy == HEAVY_BUCKET_SPLIT;
+  LongUns64T *oldSplitKeys = split ? nnStruct->heavySplitKeys[table] : NULL;
+  Int32T nOldSplitKeys = split ? nnStruct->nHeavySplitKeys[table] : 0;
+  std::vector<LongUns64T> splitKeys(oldSplitKeys, oldSplitKeys + nOldSplitKeys);
+
+  std::vector<Int32T> bucketPoints;
+  std::vector<Int32T> splitValues;
+  // The (control value, point) pairs of the children of the buckets
+  // of the current slot split so far; they are added once the chain
+  // of the slot is traversed.
+  std::vector<std::pair<Uns32T, Int32T> > children;
+  // The control values of the buckets of the current slot before the
+  // policy, and the distinct control values of the children of the
+  // buckets of the slot split so far.
+  std::vector<Uns32T> slotControls;
+  std::vector<Uns32T> childControls;
+  std::vector<Uns32T> bucketChildControls;
+  for(Int32T slot = 0; slot < modelHT->hashTableSize; slot++){
+    children.clear();
+    childControls.clear();
+    slotControls.clear();
+    size_t firstSlotSplitKey = splitKeys.size();
+    if (split){
+      for(PGBucketT bucket = modelHT->hashTable.llHashTable[slot]; bucket != NULL; bucket = bucket->nextGBucketInChain){
+	slotControls.push_back(bucket->controlValue1);
+      }
+      std::sort(slotControls.begin(), slotControls.end());
+    }
+    PGBucketT *link = &(modelHT->hashTable.llHashTable[slot]);
+    while (*link != NULL){
+      PGBucketT bucket = *link;
+      Int32T length = 0;
+      for(PBucketEntryT bucketEntry = &(bucket->firstEntry); bucketEntry != NULL; bucketEntry = bucketEntry->nextEntry){
+	length++;
+      }
+      if (length > stats->largestBucket){
+	stats->largestBucket = length;
+	stats->largestBucketSlot = slot;
+      }
+      BooleanT alreadySplit = nOldSplitKeys > 0 && std::binary_search(oldSplitKeys, oldSplitKeys + nOldSplitKeys, HEAVY_SPLIT_KEY(slot, bucket->controlValue1));
+      if (length <= threshold && !alreadySplit){
+	link = &(bucket->nextGBucketInChain);
+	continue;
+      }
+      if (length > threshold){
+	stats->nHeavyBuckets++;
+      }
+
+      if (!split){
+	if (nnStruct->heavyBucketPolicy == HEAVY_BUCKET_SAMPLE){
+	  // Move a random sample of <threshold> points to the first
+	  // <threshold> entries.
+	  bucketPoints.clear();
+	  for(PBucketEntryT bucketEntry = &(bucket->firstEntry); bucketEntry != NULL; bucketEntry = bucketEntry->nextEntry){
+	    bucketPoints.push_back(bucketEntry->pointIndex);
+	  }
+	  PBucketEntryT bucketEntry = &(bucket->firstEntry);
+	  for(Int32T j = 0; j < threshold; j++){
+	    std::swap(bucketPoints[j], bucketPoints[genRandomInt(j, length - 1)]);
+	    bucketEntry->pointIndex = bucketPoints[j];
+	    bucketEntry = bucketEntry->nextEntry;
+	  }
+	}
+	// Keep the first <threshold> entries.
+	PBucketEntryT lastEntry = &(bucket->firstEntry);
+	for(Int32T j = 1; j < threshold; j++){
+	  lastEntry = lastEntry->nextEntry;
+	}
+	recycleBucketEntries(modelHT, lastEntry->nextEntry);
+	lastEntry->nextEntry = NULL;
+	modelHT->nHashedPoints -= length - threshold;
+	stats->nRemovedPoints += length - threshold;
+	link = &(bucket->nextGBucketInChain);
+	continue;
+      }
+
+      splitValues.clear();
+      BooleanT splittable = FALSE;
+      for(PBucketEntryT bucketEntry = &(bucket->firstEntry); bucketEntry != NULL; bucketEntry = bucketEntry->nextEntry){
+	splitValues.push_back(heavySplitValue(nnStruct, table, nnStruct->points[bucketEntry->pointIndex]->coordinates));
+	splittable = splittable || splitValues.back() != splitValues[0];
+      }
+      if (!alreadySplit && !splittable){
+	stats->nUnsplittableBuckets++;
+	link = &(bucket->nextGBucketInChain);
+	continue;
+      }
+      bucketChildControls.clear();
+      for(size_t j = 0; j < splitValues.size(); j++){
+	bucketChildControls.push_back(heavySplitChildControl(bucket->controlValue1, splitValues[j]));
+      }
+      std::sort(bucketChildControls.begin(), bucketChildControls.end());
+      bucketChildControls.erase(std::unique(bucketChildControls.begin(), bucketChildControls.end()), bucketChildControls.end());
+      BooleanT collides = FALSE;
+      for(size_t c = 0; !alreadySplit && !collides && c < bucketChildControls.size(); c++){
+	Uns32T childControl = bucketChildControls[c];
+	LongUns64T childKey = HEAVY_SPLIT_KEY(slot, childControl);
+	collides = (childControl != bucket->controlValue1 && std::binary_search(slotControls.begin(), slotControls.end(), childControl))
+	  || (nOldSplitKeys > 0 && std::binary_search(oldSplitKeys, oldSplitKeys + nOldSplitKeys, childKey))
+	  || std::find(splitKeys.begin() + firstSlotSplitKey, splitKeys.end(), childKey) != splitKeys.end()
+	  || std::find(childControls.begin(), childControls.end(), childControl) != childControls.end();
+      }
+      if (collides){
+	stats->nSplitCollisions++;
+	link = &(bucket->nextGBucketInChain);
+	continue;
+      }
+      childControls.insert(childControls.end(), bucketChildControls.begin(), bucketChildControls.end());
+      IntT j = 0;
+      for(PBucketEntryT bucketEntry = &(bucket->firstEntry); bucketEntry != NULL; bucketEntry = bucketEntry->nextEntry){
+	children.push_back(std::make_pair(heavySplitChildControl(bucket->controlValue1, splitValues[j]), bucketEntry->pointIndex));
+	j++;
+      }
+      if (!alreadySplit){
+	splitKeys.push_back(HEAVY_SPLIT_KEY(slot, bucket->controlValue1));
+      }
+      *link = bucket->nextGBucketInChain;
+      recycleGBucket(modelHT, bucket);
+      modelHT->nHashedBuckets--;
+      modelHT->nHashedPoints -= length;
+    }
+    for(size_t c = 0; c < children.size(); c++){
+      addBucketEntryToSlot(modelHT, slot, children[c].first, children[c].second);
+    }
+    // The new children that are still heavy (all their points have
+    // the same value of the extra function, so they cannot be split).
+    for(PGBucketT bucket = split ? modelHT->hashTable.llHashTable[slot] : NULL; bucket != NULL; bucket = bucket->nextGBucketInChain){
+      if (std::binary_search(slotControls.begin(), slotControls.end(), bucket->controlValue1)){
+	continue;
+      }
+      Int32T length = 0;
+      for(PBucketEntryT bucketEntry = &(bucket->firstEntry); bucketEntry != NULL; bucketEntry = bucketEntry->nextEntry){
+	length++;
+      }
+      if (length > threshold){
+	stats->nUnsplittableBuckets++;
+      }
+    }
+  }
+
+  if (split){
+    std::sort(splitKeys.begin(), splitKeys.end());
+    if (oldSplitKeys != NULL){
+      free(oldSplitKeys);
+    }
+    nnStruct->heavySplitKeys[table] = NULL;
+    if (splitKeys.size() > 0){
+      FAILIF(NULL == (nnStruct->heavySplitKeys[table] = (LongUns64T*)MALLOC(splitKeys.size() * sizeof(LongUns64T))));
+      memcpy(nnStruct->heavySplitKeys[table], &splitKeys[0], splitKeys.size() * sizeof(LongUns64T));
+    }
+    nnStruct->nHeavySplitKeys[table] = splitKeys.size();
+    stats->nSplitBuckets = splitKeys.size();
+  }
+}
+
+// Computes the key (<hIndex>, <control1>) of the bucket of the table
+// <table> of <nnStruct> that the query point <query> hashes to (the
+// bucket vector is given as for getGBucket). If the heavy-bucket
+// policy split that bucket, the key is the one of the child bucket of
+// <query>.
+inline void computeTableGBucketKey(const RNearNeighborStructT *nnStruct, IntT table, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[], PPointT query, Uns32T &hIndex, Uns32T &control1){
+  computeGBucketKey(nnStruct->hashedBuckets[table], nBucketVectorPieces, firstBucketVector, secondBucketVector, hIndex, control1);
+  if (nnStruct->nHeavySplitKeys == NULL || nnStruct->nHeavySplitKeys[table] == 0){
+    return;
+  }
+  LongUns64T *splitKeys = nnStruct->heavySplitKeys[table];
+  if (std::binary_search(splitKeys, splitKeys + nnStruct->nHeavySplitKeys[table], HEAVY_SPLIT_KEY(hIndex, control1))){
+    control1 = heavySplitChildControl(control1, heavySplitValue(nnStruct, table, query->coordinates));
+  }
+}
+
+// Returns the bucket of the table <table> of <nnStruct> that the
+// query point <query> hashes to (see computeTableGBucketKey;
+// <nBucketsInChain> as for getGBucketInSlot).
+inline GeneralizedPGBucket getTableGBucket(const RNearNeighborStructT *nnStruct, IntT table, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[], PPointT query, IntT &nBucketsInChain){
+  Uns32T hIndex;
+  Uns32T control1;
+  computeTableGBucketKey(nnStruct, table, nBucketVectorPieces, firstBucketVector, secondBucketVector, query, hIndex, control1);
+  return getGBucketInSlot(nnStruct->hashedBuckets[table], hIndex, control1, nBucketsInChain);
+}
+
+// Prints, for each table where the heavy-bucket policy fired, what it
+// did (see HeavyBucketStatsT).
+void printHeavyBucketStatistics(FILE *output, PRNearNeighborStructT nnStruct){
+  ASSERT(nnStruct != NULL);
+  if (nnStruct->heavyBucketStats == NULL){
+    return;
+  }
+  const char *policyNames[] = {"keep", "cap", "sample", "split"};
+  for(IntT i = 0; i < nnStruct->parameterL; i++){
+    HeavyBucketStatsT *stats = nnStruct->heavyBucketStats + i;
+    if (stats->nHeavyBuckets == 0 && stats->nSplitBuckets == 0){
+      continue;
+    }
+    fprintf(output, "Heavy buckets (%s, > %d points) in table %d: %d heavy, largest %d points in slot %u, %d points removed, %d buckets split, %d unsplittable, %d not split (child control collision)\n",
+	    policyNames[nnStruct->heavyBucketPolicy], nnStruct->heavyBucketThreshold, i,
+	    stats->nHeavyBuckets, stats->largestBucket, stats->largestBucketSlot,
+	    stats->nRemovedPoints, stats->nSplitBuckets, stats->nUnsplittableBuckets, stats->nSplitCollisions);
+  }
+}
+
+// Prints <histogram> (UHASH_STATISTICS_N_BINS bins) as a JSON array,
+// without the empty bins at the end.
+void printStatisticsHistogram(FILE *output, MemVarT *histogram){
+  IntT nBins = UHASH_STATISTICS_N_BINS;
+  while (nBins > 0 && histogram[nBins - 1] == 0){
+    nBins--;
+  }
+  fprintf(output, "[");
+  for(IntT b = 0; b < nBins; b++){
+    fprintf(output, "%s%lld", b > 0 ? "," : "", histogram[b]);
+  }
+  fprintf(output, "]");
+}
+
+// Prints the statistics of the tables of <nnStruct> (see
+// UHashStatisticsT) in JSON Lines: one object per table and a last
+// object with the totals. The bin <b> of the histograms counts the
+// values in [2^b, 2^(b+1)).
+void printIndexStatistics(FILE *output, PRNearNeighborStructT nnStruct){
+  ASSERT(nnStruct != NULL);
+  MemVarT totalBytes[4] = {0, 0, 0, 0};
+  MemVarT nDeltaBuckets = 0;
+  for(IntT i = 0; i < nnStruct->parameterL; i++){
+    UHashStatisticsT stats;
+    getUHashStatistics(nnStruct->hashedBuckets[i], stats);
+    fprintf(output, "{\"R\":%0.6lf,\"table\":%d,\"typeHT\":%d,\"buckets\":%lld,\"points\":%lld,\"slots\":%lld,\"nonEmptySlots\":%lld,"
+	    "\"largestBucket\":%lld,\"overflowBuckets\":%lld,\"longestChain\":%lld,\"bucketSizeHistogram\":",
+	    (double)nnStruct->parameterR, i, stats.typeHT, stats.nBuckets, stats.nPoints, stats.nSlots, stats.nNonEmptySlots,
+	    stats.largestBucket, stats.nOverflowBuckets, stats.longestChain);
+    printStatisticsHistogram(output, stats.bucketSizeHistogram);
+    fprintf(output, ",\"chainLengthHistogram\":");
+    printStatisticsHistogram(output, stats.chainLengthHistogram);
+    if (nnStruct->deltaBuckets != NULL){
+      UHashStatisticsT deltaStats;
+      getUHashStatistics(nnStruct->deltaBuckets[i], deltaStats);
+      fprintf(output, ",\"deltaBuckets\":%lld,\"deltaPoints\":%lld", deltaStats.nBuckets, deltaStats.nPoints);
+      nDeltaBuckets += deltaStats.nBuckets;
+      stats.otherBytes += deltaStats.directoryBytes + deltaStats.pointsBytes + deltaStats.otherBytes;
+    }
+    fprintf(output, ",\"bytes\":{\"directory\":%lld,\"points\":%lld,\"filter\":%lld,\"other\":%lld}}\n",
+	    stats.directoryBytes, stats.pointsBytes, stats.filterBytes, stats.otherBytes);
+    totalBytes[0] += stats.directoryBytes;
+    totalBytes[1] += stats.pointsBytes;
+    totalBytes[2] += stats.filterBytes;
+    totalBytes[3] += stats.otherBytes;
+  }
+  fprintf(output, "{\"R\":%0.6lf,\"tables\":%d,\"k\":%d,\"nPoints\":%d,\"deltaPoints\":%d,\"deletedPoints\":%d,\"deltaBuckets\":%lld,"
+	  "\"bytes\":{\"directory\":%lld,\"points\":%lld,\"filter\":%lld,\"other\":%lld,\"allocated\":%lld}}\n",
+	  (double)nnStruct->parameterR, nnStruct->parameterL, nnStruct->parameterK, nnStruct->nPoints, nnStruct->nDeltaPoints, nnStruct->nDeletedPoints, nDeltaBuckets,
+	  totalBytes[0], totalBytes[1], totalBytes[2], totalBytes[3], totalAllocatedMemory);
+}
+
 void preparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point);
 
 void preparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point, int subdim);
 void first_hadamard_transform(double* work, int N, double* output); 
 void second_hadamard_transform(double* work, int N, double* output); 
 void FpreparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, double* point, int subdim);
+void RpreparePointAddingForTuples(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point, int subdim, IntT firstTuple, IntT nTuples);
 
 
 // Construct PRNearNeighborStructT given the data set <dataSet> (all
 // the points <dataSet> will be contained in the resulting DS).
-// Currenly only type HT_HYBRID_CHAINS is supported for this
-// operation.
+// Currenly only the packed types (see IS_PACKED_TYPE_HT) are
+// supported for this operation.
 PRNearNeighborStructT initLSH_WithDataSet(RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet){
-  ASSERT(algParameters.typeHT == HT_HYBRID_CHAINS);
+  ASSERT(IS_PACKED_TYPE_HT(algParameters.typeHT));
   //ASSERT(algParameters.typeHT == HT_LINKED_LIST);
 
   ASSERT(dataSet != NULL);
@@ -386,7 +818,7 @@ PRNearNeighborStructT initLSH_WithDataSet(RNNParametersT algParameters, Int32T n
   // initialize second level hashing (bucket hashing)
   FAILIF(NULL == (nnStruct->hashedBuckets = (PUHashStructureT*)MALLOC(nnStruct->parameterL * sizeof(PUHashStructureT))));
   Uns32T *mainHashA = NULL, *controlHash1 = NULL;
-  PUHashStructureT modelHT = newUHashStructure(HT_LINKED_LIST, nPoints, nnStruct->parameterK, FALSE, mainHashA, controlHash1, NULL);
+  PUHashStructureT modelHT = newUHashStructure(HT_LINKED_LIST, hashTableSizeForParameters(algParameters, nPoints), nnStruct->parameterK, FALSE, mainHashA, controlHash1, NULL, nnStruct->memoryPlacement);
   
   Uns32T **(precomputedHashesOfULSHs[nnStruct->nHFTuples]);
   for(IntT l = 0; l < nnStruct->nHFTuples; l++){
@@ -444,7 +876,8 @@ PRNearNeighborStructT initLSH_WithDataSet(RNNParametersT algParameters, Int32T n
 
     // copy the model HT into the actual (packed) HT. copy the uhash function too.
 
-    nnStruct->hashedBuckets[i] = newUHashStructure(algParameters.typeHT, nPoints, nnStruct->parameterK, TRUE, mainHashA, controlHash1, modelHT);
+    applyHeavyBucketPolicy(nnStruct, i, modelHT);
+    nnStruct->hashedBuckets[i] = newUHashStructure(algParameters.typeHT, hashTableSizeForParameters(algParameters, nPoints), nnStruct->parameterK, TRUE, mainHashA, controlHash1, modelHT, nnStruct->memoryPlacement);
 
     // clear the model HT for the next iteration.
     clearUHashStructure(modelHT);
@@ -465,7 +898,7 @@ PRNearNeighborStructT initLSH_WithDataSet(RNNParametersT algParameters, Int32T n
 
 
 PRNearNeighborStructT FinitLSH_WithDataSet(RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet, int subdim){
-  ASSERT(algParameters.typeHT == HT_HYBRID_CHAINS);
+  ASSERT(IS_PACKED_TYPE_HT(algParameters.typeHT));
 
   
   ASSERT(dataSet != NULL);
@@ -482,7 +915,7 @@ PRNearNeighborStructT FinitLSH_WithDataSet(RNNParametersT algParameters, Int32T
   // initialize second level hashing (bucket hashing)
   FAILIF(NULL == (nnStruct->hashedBuckets = (PUHashStructureT*)MALLOC(nnStruct->parameterL * sizeof(PUHashStructureT))));
   Uns32T *mainHashA = NULL, *controlHash1 = NULL;
-  PUHashStructureT modelHT = newUHashStructure(HT_LINKED_LIST, nPoints, nnStruct->parameterK, FALSE, mainHashA, controlHash1, NULL);
+  PUHashStructureT modelHT = newUHashStructure(HT_LINKED_LIST, hashTableSizeForParameters(algParameters, nPoints), nnStruct->parameterK, FALSE, mainHashA, controlHash1, NULL, nnStruct->memoryPlacement);
   
   Uns32T **(precomputedHashesOfULSHs[nnStruct->nHFTuples]);
   for(IntT l = 0; l < nnStruct->nHFTuples; l++){
@@ -557,7 +990,8 @@ PRNearNeighborStructT FinitLSH_WithDataSet(RNNParametersT algParameters, Int32T
     // clock_t one, two;
     // one = clock();
     // copy the model HT into the actual (packed) HT. copy the uhash function too.
-    nnStruct->hashedBuckets[i] = newUHashStructure(algParameters.typeHT, nPoints, nnStruct->parameterK, TRUE, mainHashA, controlHash1, modelHT);
+    applyHeavyBucketPolicy(nnStruct, i, modelHT);
+    nnStruct->hashedBuckets[i] = newUHashStructure(algParameters.typeHT, hashTableSizeForParameters(algParameters, nPoints), nnStruct->parameterK, TRUE, mainHashA, controlHash1, modelHT, nnStruct->memoryPlacement);
     // two = clock();
     // std::cout<<"time is "<<(double)(two-one) / CLOCKS_PER_SEC <<"(s)"<<std::endl;
 
@@ -579,14 +1013,142 @@ PRNearNeighborStructT FinitLSH_WithDataSet(RNNParametersT algParameters, Int32T
 }
 
 
-PRNearNeighborStructT RinitLSH_WithDataSet(RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet, int subdim){
-  ASSERT(algParameters.typeHT == HT_HYBRID_CHAINS);
-  //ASSERT(algParameters.typeHT == HT_LINKED_LIST);
+// Upper bound on the number of bytes occupied by a HT_LINKED_LIST
+// model table of <hashTableSize> slots holding <nPoints> points (every
+// point is counted as a new bucket, the more expensive case).
+inline MemVarT estimateModelHTMemory(Int32T hashTableSize, Int32T nPoints){
+  return (MemVarT)hashTableSize * sizeof(PGBucketT) + (MemVarT)nPoints * sizeof(GBucketT) + sizeof(UHashStructureT);
+}
 
-  
-  // std::cout<<"begin build index"<<std::endl;
+// Upper bound on the number of bytes occupied by one table of type
+// <typeHT> (a packed type, see IS_PACKED_TYPE_HT) of <hashTableSize>
+// slots holding <nPoints> points (there are at most <nPoints>
+// buckets).
+inline MemVarT estimatePackedHTMemory(IntT typeHT, Int32T hashTableSize, Int32T nPoints){
+  // the fast-reject filter (its number of blocks is rounded up to a power of 2).
+  MemVarT filterMemory = MIN((MemVarT)BUCKET_FILTER_MAX_BYTES, (MemVarT)nPoints * BUCKET_FILTER_BITS_PER_BUCKET / 4 + sizeof(LongUns64T));
+  if (typeHT == HT_PERFECT_HASH){
+    // One entry per bucket, the seeds, and, while the directory is
+    // built, the buckets sorted by group and by entry.
+    MemVarT perBucket = sizeof(BucketDirectoryEntryT) + 3 * sizeof(Uns32T) + 2 * sizeof(PGBucketT) + sizeof(LongUns64T);
+    return (MemVarT)nPoints * (perBucket + sizeof(Int32T)) + filterMemory + sizeof(UHashStructureT);
+  }
+  if (IS_DIRECTORY_TYPE_HT(typeHT)){
+    MemVarT directorySize = BUCKET_DIRECTORY_LINE_ENTRIES;
+    while (directorySize * BUCKET_DIRECTORY_MAX_LOAD < nPoints){
+      directorySize *= 2;
+    }
+    MemVarT pointsMemory = (MemVarT)nPoints * sizeof(Int32T);
+    if (typeHT == HT_COMPRESSED_DIRECTORY){
+      // The uncompressed points are needed while building the posting
+      // lists, which take at most 5 more words per posting list of at
+      // least COMPRESSED_POSTING_MIN_LENGTH points.
+      pointsMemory += pointsMemory + ((MemVarT)nPoints / COMPRESSED_POSTING_MIN_LENGTH * 5 + 1) * sizeof(Uns32T);
+    }
+    return directorySize * sizeof(BucketDirectoryEntryT) + BUCKET_DIRECTORY_ALIGNMENT + pointsMemory + filterMemory + sizeof(UHashStructureT);
+  }
+  MemVarT entrySize = sizeof(HybridChainEntryT) + ((Uns32T)nPoints > MAX_N_POINTS_NARROW_ENTRIES ? sizeof(Uns16T) : 0);
+  return (MemVarT)hashTableSize * hashTableSlotBytes(typeHT) + 2 * (MemVarT)nPoints * entrySize + filterMemory + sizeof(UHashStructureT);
+}
+
+// Builds the tables nnStruct->hashedBuckets of the points <dataSet>
+// (the fields <nPoints> and <points> of <nnStruct> must be set) with
+// the precomputed hashes of at most <nTuplesPerGroup> <u> functions
+// in memory at once (see RinitLSH_WithDataSetMemoryBounded). Returns
+// the bytes allocated by the construction; the intermediates (the
+// model HT and the precomputed hashes) are released only at the end,
+// so this is also its peak memory.
+MemVarT RbuildTablesInGroups(PRNearNeighborStructT nnStruct, RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet, int subdim, IntT nTuplesPerGroup){
+  ASSERT(nTuplesPerGroup >= 1 && nTuplesPerGroup <= nnStruct->nHFTuples);
+  ASSERT(!nnStruct->useUfunctions || nTuplesPerGroup == nnStruct->nHFTuples);
+
+  MemVarT memoryAtStart = totalAllocatedMemory;
+  // initialize second level hashing (bucket hashing)
+  FAILIF(NULL == (nnStruct->hashedBuckets = (PUHashStructureT*)MALLOC(nnStruct->parameterL * sizeof(PUHashStructureT))));
+  Uns32T *mainHashA = NULL, *controlHash1 = NULL;
+  newUHashFunctions(nnStruct->parameterK, mainHashA, controlHash1);
+  PUHashStructureT modelHT = newUHashStructure(HT_LINKED_LIST, hashTableSizeForParameters(algParameters, nPoints), nnStruct->parameterK, TRUE, mainHashA, controlHash1, NULL, nnStruct->memoryPlacement);
+
+  // precomputedHashesOfULSHs[l - firstTuple] holds the hashes of the
+  // <u> function <l> for all points (N_PRECOMPUTED_HASHES_NEEDED words
+  // per point).
+  MemVarT hashesPerTuple = (MemVarT)nPoints * N_PRECOMPUTED_HASHES_NEEDED * sizeof(Uns32T);
+  Uns32T *precomputedHashesOfULSHs[nTuplesPerGroup];
+  for(IntT l = 0; l < nTuplesPerGroup; l++){
+    FAILIF(NULL == (precomputedHashesOfULSHs[l] = (Uns32T*)MALLOC(hashesPerTuple)));
+  }
+
+  // Initialize the counters for defining the pair of <u> functions used for <g> functions.
+  IntT firstUComp = 0;
+  IntT secondUComp = 1;
+  for(IntT firstTuple = 0; firstTuple < nnStruct->nHFTuples; firstTuple += nTuplesPerGroup){
+    IntT nTuples = MIN(nTuplesPerGroup, nnStruct->nHFTuples - firstTuple);
+
+    TimeVarT hashingTime = wallClockTime();
+    for(IntT i = 0; i < nPoints; i++){
+      RpreparePointAddingForTuples(nnStruct, modelHT, dataSet[i], subdim, firstTuple, nTuples);
+      for(IntT l = 0; l < nTuples; l++){
+	for(IntT h = 0; h < N_PRECOMPUTED_HASHES_NEEDED; h++){
+	  precomputedHashesOfULSHs[l][i * N_PRECOMPUTED_HASHES_NEEDED + h] = nnStruct->precomputedHashesOfULSHs[firstTuple + l][h];
+	}
+      }
+    }
+    hashingTime = wallClockTime() - hashingTime;
+    DPRINTF("Time of computing the hashes: %0.6lf s.\n", hashingTime);
+
+    // The tables using the <u> functions of this group.
+    IntT firstTable = nnStruct->useUfunctions ? 0 : firstTuple;
+    IntT lastTable = nnStruct->useUfunctions ? nnStruct->parameterL : firstTuple + nTuples;
+    for(IntT i = firstTable; i < lastTable; i++){
+      // build the model HT.
+      for(IntT p = 0; p < nPoints; p++){
+	// Add point <dataSet[p]> to modelHT.
+	if (!nnStruct->useUfunctions) {
+	  // Use usual <g> functions (truly independent; <g>s are precisly
+	  // <u>s).
+	  addBucketEntry(modelHT, 1, precomputedHashesOfULSHs[i - firstTuple] + p * N_PRECOMPUTED_HASHES_NEEDED, NULL, p);
+	} else {
+	  // Use <u> functions (<g>s are pairs of <u> functions).
+	  addBucketEntry(modelHT, 2, precomputedHashesOfULSHs[firstUComp] + p * N_PRECOMPUTED_HASHES_NEEDED, precomputedHashesOfULSHs[secondUComp] + p * N_PRECOMPUTED_HASHES_NEEDED, p);
+	}
+      }
+
+      // compute what is the next pair of <u> functions.
+      secondUComp++;
+      if (secondUComp == nnStruct->nHFTuples) {
+	firstUComp++;
+	secondUComp = firstUComp + 1;
+      }
+
+      // copy the model HT into the actual (packed) HT. copy the uhash function too.
+      applyHeavyBucketPolicy(nnStruct, i, modelHT);
+      nnStruct->hashedBuckets[i] = newUHashStructure(algParameters.typeHT, hashTableSizeForParameters(algParameters, nPoints), nnStruct->parameterK, TRUE, mainHashA, controlHash1, modelHT, nnStruct->memoryPlacement);
+
+      // clear the model HT for the next iteration.
+      clearUHashStructure(modelHT);
+    }
+  }
+
+  // Release the intermediates: the model HT is not needed anymore
+  // once the last table is packed.
+  freeUHashStructure(modelHT, FALSE); // do not free the uhash functions since they are used by nnStruct->hashedBuckets[i]
+  for(IntT l = 0; l < nTuplesPerGroup; l++){
+    FREE(precomputedHashesOfULSHs[l]);
+  }
+  return totalAllocatedMemory - memoryAtStart;
+}
+
+PRNearNeighborStructT RinitLSH_WithDataSet(RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet, int subdim){
+  ASSERT(IS_PACKED_TYPE_HT(algParameters.typeHT));
   ASSERT(dataSet != NULL);
   ASSERT(USE_SAME_UHASH_FUNCTIONS);
+  FAILIFWR(algParameters.peakBuildMemory > 0 && algParameters.nBuildShards > 1, "A bounded build cannot be sharded.");
+  if (algParameters.peakBuildMemory > 0){
+    return RinitLSH_WithDataSetMemoryBounded(algParameters, nPoints, dataSet, subdim, algParameters.peakBuildMemory);
+  }
+  if (algParameters.nBuildShards > 1){
+    return RinitLSH_WithDataSetSharded(algParameters, nPoints, dataSet, subdim, algParameters.nBuildShards);
+  }
 
   PRNearNeighborStructT nnStruct = initializePRNearNeighborFields(algParameters, nPoints);
 
@@ -595,91 +1157,240 @@ PRNearNeighborStructT RinitLSH_WithDataSet(RNNParametersT algParameters, Int32T
   for(Int32T i = 0; i < nPoints; i++){
     nnStruct->points[i] = dataSet[i];
   }
-  
-  // initialize second level hashing (bucket hashing)
-  FAILIF(NULL == (nnStruct->hashedBuckets = (PUHashStructureT*)MALLOC(nnStruct->parameterL * sizeof(PUHashStructureT))));
-  Uns32T *mainHashA = NULL, *controlHash1 = NULL;
-  PUHashStructureT modelHT = newUHashStructure(HT_LINKED_LIST, nPoints, nnStruct->parameterK, FALSE, mainHashA, controlHash1, NULL);
-  
-  Uns32T **(precomputedHashesOfULSHs[nnStruct->nHFTuples]);
-  for(IntT l = 0; l < nnStruct->nHFTuples; l++){
-    FAILIF(NULL == (precomputedHashesOfULSHs[l] = (Uns32T**)MALLOC(nPoints * sizeof(Uns32T*))));
-    for(IntT i = 0; i < nPoints; i++){
-      //FAILIF(NULL == (precomputedHashesOfULSHs[l][i] = (Uns32T*)MALLOC(N_PRECOMPUTED_HASHES_NEEDED * sizeof(Uns32T))));
-      FAILIF(NULL == (precomputedHashesOfULSHs[l][i] = (Uns32T*)MALLOC(nnStruct->hfTuplesLength * sizeof(Uns32T))));
-    }
+
+  RbuildTablesInGroups(nnStruct, algParameters, nPoints, dataSet, subdim, nnStruct->nHFTuples);
+
+  return nnStruct;
+}
+
+// Same as RinitLSH_WithDataSet, but the construction tries not to
+// need more than <peakMemory> bytes on top of what is already
+// allocated (<peakMemory> is capped to the memory still available
+// under <availableTotalMemory>). The bytes counted are those of the
+// structure itself, of the model HT, of the final tables (an upper
+// bound), and of the precomputed hashes of the <u> functions.
+//
+// The precomputed hashes (N_PRECOMPUTED_HASHES_NEEDED words per point
+// and <u> function) usually dominate. When they do not all fit, the
+// tables are built in groups: the hashes of the <u> functions of one
+// group are computed, the tables of the group are built, and the
+// hashes are released before the next group. This is possible only
+// with independent <g> functions; with <u> functions every table
+// needs two arbitrary <u> functions, so all hashes are kept at
+// once. When even the smallest build does not fit the cap, the
+// construction fails. RinitLSH_WithDataSet builds this way when
+// algParameters.peakBuildMemory > 0 (the key "Peak build memory" of a
+// params file).
+PRNearNeighborStructT RinitLSH_WithDataSetMemoryBounded(RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet, int subdim, MemVarT peakMemory){
+  ASSERT(IS_PACKED_TYPE_HT(algParameters.typeHT));
+  ASSERT(dataSet != NULL);
+  ASSERT(USE_SAME_UHASH_FUNCTIONS);
+  peakMemory = MIN(peakMemory, getAvailableMemory());
+
+  MemVarT memoryAtStart = totalAllocatedMemory;
+  PRNearNeighborStructT nnStruct = initializePRNearNeighborFields(algParameters, nPoints);
+
+  // Set the fields <nPoints> and <points>.
+  nnStruct->nPoints = nPoints;
+  for(Int32T i = 0; i < nPoints; i++){
+    nnStruct->points[i] = dataSet[i];
   }
 
-  clock_t start, end;
-  start = clock();
+  // Split the memory: what remains after the structure, the model HT
+  // and all the final tables is left for the precomputed hashes.
+  MemVarT hashesPerTuple = (MemVarT)nPoints * N_PRECOMPUTED_HASHES_NEEDED * sizeof(Uns32T);
+  MemVarT structureMemory = totalAllocatedMemory - memoryAtStart;
+  MemVarT memoryForHashes = peakMemory
+    - structureMemory
+    - (MemVarT)nnStruct->parameterL * sizeof(PUHashStructureT)
+    - estimateModelHTMemory(hashTableSizeForParameters(algParameters, nPoints), nPoints)
+    - (MemVarT)nnStruct->parameterL * estimatePackedHTMemory(algParameters.typeHT, hashTableSizeForParameters(algParameters, nPoints), nPoints);
+  IntT nTuplesPerGroup = (memoryForHashes > 0) ? (IntT)MIN((MemVarT)nnStruct->nHFTuples, memoryForHashes / hashesPerTuple) : 0;
+  FAILIFWR(nnStruct->useUfunctions && nTuplesPerGroup < nnStruct->nHFTuples, "The hashes of all the <u> functions, needed at once, do not fit in the peak build memory.");
+  FAILIFWR(nTuplesPerGroup < 1, "The tables do not fit in the peak build memory, even built one at a time.");
+  DPRINTF("Building the tables in groups of %d.\n", nTuplesPerGroup);
+
+  MemVarT buildMemory = RbuildTablesInGroups(nnStruct, algParameters, nPoints, dataSet, subdim, nTuplesPerGroup);
+  DPRINTF3("Peak memory of the construction: %lld (cap %lld).\n", structureMemory + buildMemory, peakMemory);
+
+  return nnStruct;
+}
 
-  for(IntT i = 0; i < nPoints; i++){
 
-    RpreparePointAdding(nnStruct, modelHT, dataSet[i], subdim);
+// Builds the <parameterL> tables of type <typeHT> (a packed type, see
+// IS_PACKED_TYPE_HT) of one shard: the
+// points <shardPoints>[0..nShardPoints-1], hashed with the LSH
+// functions of <nnStruct> and the universal hash functions
+// <mainHashA>/<controlHash1>. The tables have <hashTableSize> slots
+// (the size of the final merged tables, so that the slots of all the
+// shards match) and refer to the points by their index in the
+// shard. The temporary vectors of <nnStruct> are not used, so several
+// shards of the same <nnStruct> may be built concurrently.
+PUHashStructureT *RbuildShardTables(PRNearNeighborStructT nnStruct, IntT typeHT, Int32T hashTableSize, Uns32T *mainHashA, Uns32T *controlHash1, Int32T nShardPoints, PPointT *shardPoints, int subdim){
+  ASSERT(nnStruct != NULL);
+  ASSERT(IS_PACKED_TYPE_HT(typeHT));
+  ASSERT(shardPoints != NULL && nShardPoints > 0);
+
+  // A copy of <nnStruct> with its own temporary vectors.
+  RNearNeighborStructT shardStruct = *nnStruct;
+  FAILIF(NULL == (shardStruct.reducedPoint = (RealT*)MALLOC(nnStruct->dimension * sizeof(RealT))));
+  FAILIF(NULL == (shardStruct.pointULSHVectors = (Uns32T**)MALLOC(nnStruct->nHFTuples * sizeof(Uns32T*))));
+  FAILIF(NULL == (shardStruct.precomputedHashesOfULSHs = (Uns32T**)MALLOC(nnStruct->nHFTuples * sizeof(Uns32T*))));
+  for(IntT l = 0; l < nnStruct->nHFTuples; l++){
+    FAILIF(NULL == (shardStruct.pointULSHVectors[l] = (Uns32T*)MALLOC(nnStruct->hfTuplesLength * sizeof(Uns32T))));
+    FAILIF(NULL == (shardStruct.precomputedHashesOfULSHs[l] = (Uns32T*)MALLOC(N_PRECOMPUTED_HASHES_NEEDED * sizeof(Uns32T))));
+  }
+
+  PUHashStructureT modelHT = newUHashStructure(HT_LINKED_LIST, hashTableSize, nnStruct->parameterK, TRUE, mainHashA, controlHash1, NULL, nnStruct->memoryPlacement);
 
+  IntT hashesPerPoint = nnStruct->nHFTuples * N_PRECOMPUTED_HASHES_NEEDED;
+  Uns32T *hashes;
+  FAILIF(NULL == (hashes = (Uns32T*)MALLOC((MemVarT)nShardPoints * hashesPerPoint * sizeof(Uns32T))));
+  for(Int32T p = 0; p < nShardPoints; p++){
+    RpreparePointAdding(&shardStruct, modelHT, shardPoints[p], subdim);
     for(IntT l = 0; l < nnStruct->nHFTuples; l++){
       for(IntT h = 0; h < N_PRECOMPUTED_HASHES_NEEDED; h++){
-	      precomputedHashesOfULSHs[l][i][h] = nnStruct->precomputedHashesOfULSHs[l][h];
+	hashes[p * hashesPerPoint + l * N_PRECOMPUTED_HASHES_NEEDED + h] = shardStruct.precomputedHashesOfULSHs[l][h];
       }
     }
   }
 
-  end = clock();
-  std::cout<<"time of computing hash value is "<<(double)(end-start) / CLOCKS_PER_SEC <<"(s)"<<std::endl;
-
-  //DPRINTF("Allocated memory(modelHT and precomputedHashesOfULSHs just a.): %lld\n", totalAllocatedMemory);
-
+  PUHashStructureT *shardTables;
+  FAILIF(NULL == (shardTables = (PUHashStructureT*)MALLOC(nnStruct->parameterL * sizeof(PUHashStructureT))));
   // Initialize the counters for defining the pair of <u> functions used for <g> functions.
   IntT firstUComp = 0;
   IntT secondUComp = 1;
   for(IntT i = 0; i < nnStruct->parameterL; i++){
-    // build the model HT.
-    for(IntT p = 0; p < nPoints; p++){
-      // Add point <dataSet[p]> to modelHT.
+    for(Int32T p = 0; p < nShardPoints; p++){
+      Uns32T *pointHashes = hashes + p * hashesPerPoint;
       if (!nnStruct->useUfunctions) {
-	      // Use usual <g> functions (truly independent; <g>s are precisly
-	      // <u>s).
-	      addBucketEntry(modelHT, 1, precomputedHashesOfULSHs[i][p], NULL, p);
+	addBucketEntry(modelHT, 1, pointHashes + i * N_PRECOMPUTED_HASHES_NEEDED, NULL, p);
       } else {
-	      // Use <u> functions (<g>s are pairs of <u> functions).
-	      addBucketEntry(modelHT, 2, precomputedHashesOfULSHs[firstUComp][p], precomputedHashesOfULSHs[secondUComp][p], p);
+	addBucketEntry(modelHT, 2, pointHashes + firstUComp * N_PRECOMPUTED_HASHES_NEEDED, pointHashes + secondUComp * N_PRECOMPUTED_HASHES_NEEDED, p);
       }
     }
 
-    //ASSERT(nAllocatedGBuckets <= nPoints);
-    //ASSERT(nAllocatedBEntries <= nPoints);
-
     // compute what is the next pair of <u> functions.
     secondUComp++;
     if (secondUComp == nnStruct->nHFTuples) {
       firstUComp++;
       secondUComp = firstUComp + 1;
     }
-    // clock_t one, two;
-    // one = clock();
-    // copy the model HT into the actual (packed) HT. copy the uhash function too.
-    nnStruct->hashedBuckets[i] = newUHashStructure(algParameters.typeHT, nPoints, nnStruct->parameterK, TRUE, mainHashA, controlHash1, modelHT);
-    // two = clock();
-    // std::cout<<"time is "<<(double)(two-one) / CLOCKS_PER_SEC <<"(s)"<<std::endl;
 
-    // clear the model HT for the next iteration.
+    shardTables[i] = newUHashStructure(typeHT, hashTableSize, nnStruct->parameterK, TRUE, mainHashA, controlHash1, modelHT, nnStruct->memoryPlacement);
     clearUHashStructure(modelHT);
   }
 
-  freeUHashStructure(modelHT, FALSE); // do not free the uhash functions since they are used by nnStruct->hashedBuckets[i]
-
-  // freeing precomputedHashesOfULSHs
+  freeUHashStructure(modelHT, FALSE);
+  FREE(hashes);
   for(IntT l = 0; l < nnStruct->nHFTuples; l++){
-    for(IntT i = 0; i < nPoints; i++){
-      FREE(precomputedHashesOfULSHs[l][i]);
+    FREE(shardStruct.pointULSHVectors[l]);
+    FREE(shardStruct.precomputedHashesOfULSHs[l]);
+  }
+  FREE(shardStruct.pointULSHVectors);
+  FREE(shardStruct.precomputedHashesOfULSHs);
+  FREE(shardStruct.reducedPoint);
+
+  return shardTables;
+}
+
+// Merges the tables of <nShards> shards (built by RbuildShardTables
+// with the same universal hash functions and table size) into the
+// packed tables nnStruct->hashedBuckets (which are created
+// here). Table <i> of the result holds, in every bucket, the points of
+// the matching buckets of the tables <i> of all the shards; the point
+// indeces of shard <s> are shifted by <shardFirstPoints>[s]. The shard
+// tables are freed.
+void mergeShardTables(PRNearNeighborStructT nnStruct, IntT nShards, PUHashStructureT **shardTables, Int32T *shardFirstPoints){
+  ASSERT(nnStruct != NULL);
+  ASSERT(nShards > 0 && shardTables != NULL && shardFirstPoints != NULL);
+  FAILIFWR((LongUns64T)nnStruct->nPoints > MAX_N_POINTS, "Too many points.");
+
+  Uns32T *mainHashA = shardTables[0][0]->mainHashA;
+  Uns32T *controlHash1 = shardTables[0][0]->controlHash1;
+  Int32T hashTableSize = shardTables[0][0]->hashTableSize;
+  IntT typeHT = shardTables[0][0]->typeHT;
+  PUHashStructureT modelHT = newUHashStructure(HT_LINKED_LIST, hashTableSize, nnStruct->parameterK, TRUE, mainHashA, controlHash1, NULL, nnStruct->memoryPlacement);
+
+  FAILIF(NULL == (nnStruct->hashedBuckets = (PUHashStructureT*)MALLOC(nnStruct->parameterL * sizeof(PUHashStructureT))));
+  for(IntT i = 0; i < nnStruct->parameterL; i++){
+    for(IntT s = 0; s < nShards; s++){
+      ASSERT(shardTables[s][i]->hashTableSize == hashTableSize);
+      ASSERT(shardTables[s][i]->mainHashA == mainHashA && shardTables[s][i]->typeHT == typeHT);
+      unpackUHashStructure(shardTables[s][i], modelHT, shardFirstPoints[s], NULL);
+      // Release the shard table right away to keep the peak memory low.
+      freeUHashStructure(shardTables[s][i], FALSE);
     }
-    FREE(precomputedHashesOfULSHs[l]);
+    applyHeavyBucketPolicy(nnStruct, i, modelHT);
+    nnStruct->hashedBuckets[i] = newUHashStructure(typeHT, hashTableSize, nnStruct->parameterK, TRUE, mainHashA, controlHash1, modelHT, nnStruct->memoryPlacement);
+    clearUHashStructure(modelHT);
+  }
+  freeUHashStructure(modelHT, FALSE);
+  for(IntT s = 0; s < nShards; s++){
+    FREE(shardTables[s]);
+  }
+}
+
+// Same as RinitLSH_WithDataSet, but the points are split into
+// <nShards> contiguous ranges whose tables are built in parallel (see
+// RbuildShardTables; at most one thread per hardware thread, each
+// taking the next shard not built yet) and then merged into one
+// packed table per <g> function (see mergeShardTables).
+// RinitLSH_WithDataSet builds this way when algParameters.nBuildShards
+// > 1 (the key "Build shards" of a params file).
+PRNearNeighborStructT RinitLSH_WithDataSetSharded(RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet, int subdim, IntT nShards){
+  ASSERT(IS_PACKED_TYPE_HT(algParameters.typeHT));
+  ASSERT(dataSet != NULL);
+  ASSERT(USE_SAME_UHASH_FUNCTIONS);
+  ASSERT(nShards > 0);
+  nShards = MIN(nShards, nPoints);
+
+  PRNearNeighborStructT nnStruct = initializePRNearNeighborFields(algParameters, nPoints);
+
+  // Set the fields <nPoints> and <points>.
+  nnStruct->nPoints = nPoints;
+  for(Int32T i = 0; i < nPoints; i++){
+    nnStruct->points[i] = dataSet[i];
   }
 
+  // The universal hash functions shared by all the shards (and owned,
+  // in the end, by nnStruct->hashedBuckets[0]).
+  Uns32T *mainHashA = NULL, *controlHash1 = NULL;
+  newUHashFunctions(nnStruct->parameterK, mainHashA, controlHash1);
+
+  std::vector<PUHashStructureT*> shardTables(nShards);
+  std::vector<Int32T> shardFirstPoints(nShards);
+  for(IntT s = 0; s < nShards; s++){
+    shardFirstPoints[s] = (Int32T)((LongUns64T)nPoints * s / nShards);
+  }
+
+  IntT nThreads = MIN(nShards, MAX((IntT)std::thread::hardware_concurrency(), 1));
+  TimeVarT shardsTime = wallClockTime();
+  IntT nextShard = 0;
+  std::vector<std::thread> threads;
+  for(IntT t = 0; t < nThreads; t++){
+    threads.push_back(std::thread([=, &shardTables, &shardFirstPoints, &nextShard](){
+      // The timers are global; this thread does not time (<timingOn>
+      // is per thread).
+      timingOn = FALSE;
+      IntT s;
+      while ((s = __sync_fetch_and_add(&nextShard, 1)) < nShards){
+	Int32T nShardPoints = (s + 1 < nShards ? shardFirstPoints[s + 1] : nPoints) - shardFirstPoints[s];
+	shardTables[s] = RbuildShardTables(nnStruct, algParameters.typeHT, hashTableSizeForParameters(algParameters, nPoints), mainHashA, controlHash1, nShardPoints, dataSet + shardFirstPoints[s], subdim);
+      }
+    }));
+  }
+  for(IntT t = 0; t < nThreads; t++){
+    threads[t].join();
+  }
+  shardsTime = wallClockTime() - shardsTime;
+  DPRINTF("Time of building the shards: %0.6lf s.\n", shardsTime);
+
+  mergeShardTables(nnStruct, nShards, shardTables.data(), shardFirstPoints.data());
+
   return nnStruct;
 }
 
-
 // // Packed version (static).
 // PRNearNeighborStructT buildPackedLSH(RealT R, BooleanT useUfunctions, IntT k, IntT LorM, RealT successProbability, IntT dim, IntT T, Int32T nPoints, PPointT *points){
 //   ASSERT(points != NULL);
@@ -754,6 +1465,37 @@ void freePRNearNeighborStruct(PRNearNeighborStructT nnStruct){
   }
   free(nnStruct->hashedBuckets);
 
+  if (nnStruct->deltaBuckets != NULL){
+    for(IntT i = 0; i < nnStruct->parameterL; i++){
+      freeUHashStructure(nnStruct->deltaBuckets[i], FALSE);
+    }
+    free(nnStruct->deltaBuckets);
+    free(nnStruct->deltaHashes);
+  }
+
+  if (nnStruct->deletedPoints != NULL){
+    free(nnStruct->deletedPoints);
+  }
+
+  if (nnStruct->multiplyShiftA != NULL){
+    free(nnStruct->multiplyShiftA);
+  }
+
+  if (nnStruct->heavyBucketStats != NULL){
+    free(nnStruct->heavyBucketStats);
+  }
+  if (nnStruct->heavySplitFunctions != NULL){
+    for(IntT i = 0; i < nnStruct->parameterL; i++){
+      free(nnStruct->heavySplitFunctions[i].a);
+      if (nnStruct->heavySplitKeys[i] != NULL){
+	free(nnStruct->heavySplitKeys[i]);
+      }
+    }
+    free(nnStruct->heavySplitFunctions);
+    free(nnStruct->heavySplitKeys);
+    free(nnStruct->nHeavySplitKeys);
+  }
+
   if (nnStruct->pointULSHVectors != NULL){
     for(IntT i = 0; i < nnStruct->nHFTuples; i++){
       free(nnStruct->pointULSHVectors[i]);
@@ -772,6 +1514,8 @@ void freePRNearNeighborStruct(PRNearNeighborStructT nnStruct){
   if (nnStruct->markedPointsIndeces != NULL){
     free(nnStruct->markedPointsIndeces);
   }
+
+  freeQueryContext(nnStruct->queryContext);
 }
 
 // If <reportingResult> == FALSe, no points are reported back in a
@@ -783,6 +1527,37 @@ void setResultReporting(PRNearNeighborStructT nnStruct, BooleanT reportingResult
   nnStruct->reportingResult = reportingResult;
 }
 
+// Sets the limits (see QueryLimitsT) of the queries on <nnStruct>:
+// the ones of R2getNearNeighborsFromPRNearNeighborStruct and
+// R2getKNearestNeighborsFromPRNearNeighborStruct, and the initial
+// ones of the QueryContextTs created afterwards.
+void setQueryLimits(PRNearNeighborStructT nnStruct, QueryLimitsT limits){
+  ASSERT(nnStruct != NULL);
+  nnStruct->queryLimits = limits;
+  if (nnStruct->queryContext != NULL){
+    nnStruct->queryContext->limits = limits;
+  }
+}
+
+// Whether a limit (see setQueryLimits) stopped the last query of
+// R2getNearNeighborsFromPRNearNeighborStruct or
+// R2getKNearestNeighborsFromPRNearNeighborStruct on <nnStruct>, so
+// that its neighbors are only the ones found before.
+BooleanT isLastQueryPartial(PRNearNeighborStructT nnStruct){
+  ASSERT(nnStruct != NULL);
+  return nnStruct->queryContext != NULL && nnStruct->queryContext->isPartial;
+}
+
+// Sets the collision-count ranking (see CollisionRankingT) of the
+// queries on <nnStruct>, as setQueryLimits sets their limits.
+void setCollisionRanking(PRNearNeighborStructT nnStruct, CollisionRankingT ranking){
+  ASSERT(nnStruct != NULL);
+  nnStruct->collisionRanking = ranking;
+  if (nnStruct->queryContext != NULL){
+    nnStruct->queryContext->ranking = ranking;
+  }
+}
+
 // Compute the value of a hash function u=lshFunctions[gNumber] (a
 // vector of <hfTuplesLength> LSH functions) in the point <point>. The
 // result is stored in the vector <vectorValue>. <vectorValue> must be
@@ -820,7 +1595,7 @@ inline void FcomputeULSH(PRNearNeighborStructT nnStruct, IntT gNumber, RealT *po
   }
 }
 
-inline void computeULSH(PRNearNeighborStructT nnStruct, IntT gNumber, RealT *point, Uns32T *vectorValue, int subdim){
+inline void computeULSH(const RNearNeighborStructT *nnStruct, IntT gNumber, RealT *point, Uns32T *vectorValue, int subdim){
   CR_ASSERT(nnStruct != NULL);
   CR_ASSERT(point != NULL);
   CR_ASSERT(vectorValue != NULL);
@@ -837,13 +1612,35 @@ inline void computeULSH(PRNearNeighborStructT nnStruct, IntT gNumber, RealT *poi
   }
 } 
 
+// Same as computeULSH, but also sets <fractions> to the fractional
+// parts of the projections (in units of W) that the floor removed
+// (for multi-probe queries).
+inline void computeULSHWithFractions(const RNearNeighborStructT *nnStruct, IntT gNumber, RealT *point, Uns32T *vectorValue, RealT *fractions, int subdim){
+  CR_ASSERT(nnStruct != NULL);
+  CR_ASSERT(point != NULL);
+  CR_ASSERT(vectorValue != NULL && fractions != NULL);
 
+  for(IntT i = 0; i < nnStruct->hfTuplesLength; i++){
+    RealT value = 0;
 
-
-void first_hadamard_transform(double* work, int N, double* output) 
-{
-	int i, j, k, stage, L, J, M;
-	double *tmp;
+    for(IntT d = 0; d < subdim; d++){
+      int dim = nnStruct->ran_dim[gNumber][i].c[d];
+      value += point[dim] * nnStruct->lshFunctions[gNumber][i].a[d];
+    } 
+    RealT slot = (value + nnStruct->lshFunctions[gNumber][i].b) / nnStruct->parameterW;
+    Int32T floorSlot = FLOOR_INT32(slot);
+    vectorValue[i] = (Uns32T)floorSlot;
+    fractions[i] = slot - floorSlot;
+  }
+}
+
+
+
+
+void first_hadamard_transform(double* work, int N, double* output) 
+{
+	int i, j, k, stage, L, J, M;
+	double *tmp;
 	for (i = 0; i < N-1; i += 2)
 	{
 		work[i] = (work[i] + work[i+1]);
@@ -910,6 +1707,61 @@ void second_hadamard_transform(double* work, int N, double* output)
 	}
 }
 
+// Computes <precomputedHashesOfULSHs> for the <u> functions
+// firstTuple..firstTuple+nTuples-1 of <nnStruct> from
+// <pointULSHVectors> (the vectors of <nnStruct> or of a
+// QueryContextT): the main and the control hash of every <u>
+// function (of each half of the bucket vector, when <g> functions are
+// pairs of <u> functions). UHF_MOD_PRIME uses the hash functions of
+// <uhash>; UHF_MULTIPLY_SHIFT uses <multiplyShiftA>, computing the
+// main and the control hash of a half at once (one SSE2 vector).
+inline void precomputeUHFsForULSHs(const RNearNeighborStructT *nnStruct, PUHashStructureT uhash, Uns32T **pointULSHVectors, Uns32T **precomputedHashesOfULSHs, IntT firstTuple, IntT nTuples){
+  if (nnStruct->uhfType == UHF_MOD_PRIME){
+    for(IntT i = firstTuple; i < firstTuple + nTuples; i++){
+      precomputeUHFsForULSH(uhash, pointULSHVectors[i], nnStruct->hfTuplesLength, precomputedHashesOfULSHs[i]);
+    }
+    return;
+  }
+
+  ASSERT(nnStruct->uhfType == UHF_MULTIPLY_SHIFT);
+  IntT length = nnStruct->hfTuplesLength;
+  IntT nHalves = nnStruct->parameterK / length;
+  CR_ASSERT(nHalves * length == nnStruct->parameterK && nHalves <= 2);
+  for(IntT t = firstTuple; t < firstTuple + nTuples; t++){
+    Uns32T *uVector = pointULSHVectors[t];
+    Uns32T *result = precomputedHashesOfULSHs[t];
+    for(IntT half = 0; half < nHalves; half++){
+      LongUns64T *a = nnStruct->multiplyShiftA + UHF_NUMBER_OF_HASHES * half * length;
+#ifdef __SSE2__
+      // The 64-bit lanes hold the main and the control hash. Since
+      // _mm_mul_epu32 multiplies only 32-bit halves,
+      // (a.u) mod 2^64 >> 32 is computed as the high word of the sum of
+      // the products by the low words of the <a>s plus the low word of
+      // the sum of the products by their high words.
+      __m128i lowProducts = _mm_setzero_si128();
+      __m128i highProducts = _mm_setzero_si128();
+      for(IntT i = 0; i < length; i++){
+	__m128i coefficients = _mm_loadu_si128((const __m128i*)(a + UHF_NUMBER_OF_HASHES * i));
+	__m128i value = _mm_set1_epi32((Int32T)uVector[i]);
+	lowProducts = _mm_add_epi64(lowProducts, _mm_mul_epu32(coefficients, value));
+	highProducts = _mm_add_epi64(highProducts, _mm_mul_epu32(_mm_srli_epi64(coefficients, 32), value));
+      }
+      __m128i hashes = _mm_add_epi32(_mm_srli_epi64(lowProducts, 32), highProducts);
+      result[UHF_MAIN_INDEX + half * UHF_NUMBER_OF_HASHES] = (Uns32T)_mm_cvtsi128_si32(hashes);
+      result[UHF_CONTROL1_INDEX + half * UHF_NUMBER_OF_HASHES] = (Uns32T)_mm_cvtsi128_si32(_mm_srli_si128(hashes, 8));
+#else
+      LongUns64T mainHash = 0, controlHash = 0;
+      for(IntT i = 0; i < length; i++){
+	mainHash += a[UHF_NUMBER_OF_HASHES * i + UHF_MAIN_INDEX] * uVector[i];
+	controlHash += a[UHF_NUMBER_OF_HASHES * i + UHF_CONTROL1_INDEX] * uVector[i];
+      }
+      result[UHF_MAIN_INDEX + half * UHF_NUMBER_OF_HASHES] = (Uns32T)(mainHash >> 32);
+      result[UHF_CONTROL1_INDEX + half * UHF_NUMBER_OF_HASHES] = (Uns32T)(controlHash >> 32);
+#endif
+    }
+  }
+}
+
 inline void preparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point){
   ASSERT(nnStruct != NULL);
   ASSERT(uhash != NULL);
@@ -930,9 +1782,7 @@ inline void preparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT
 
   // Compute data for <precomputedHashesOfULSHs>.
   if (USE_SAME_UHASH_FUNCTIONS) {
-    for(IntT i = 0; i < nnStruct->nHFTuples; i++){
-      precomputeUHFsForULSH(uhash, nnStruct->pointULSHVectors[i], nnStruct->hfTuplesLength, nnStruct->precomputedHashesOfULSHs[i]);
-    }
+    precomputeUHFsForULSHs(nnStruct, uhash, nnStruct->pointULSHVectors, nnStruct->precomputedHashesOfULSHs, 0, nnStruct->nHFTuples);
   }
 
   TIMEV_END(timeComputeULSH);
@@ -956,18 +1806,20 @@ inline void preparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT
 
   // Compute data for <precomputedHashesOfULSHs>.
   if (USE_SAME_UHASH_FUNCTIONS) {
-    for(IntT i = 0; i < nnStruct->nHFTuples; i++){
-      precomputeUHFsForULSH(uhash, nnStruct->pointULSHVectors[i], nnStruct->hfTuplesLength, nnStruct->precomputedHashesOfULSHs[i]);
-    }
+    precomputeUHFsForULSHs(nnStruct, uhash, nnStruct->pointULSHVectors, nnStruct->precomputedHashesOfULSHs, 0, nnStruct->nHFTuples);
   }
 
   TIMEV_END(timeComputeULSH);
 }
 
-void RpreparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point, int subdim){
+// Same as RpreparePointAdding, but computes only the <u> functions
+// firstTuple..firstTuple+nTuples-1 (the other entries of
+// <pointULSHVectors> and <precomputedHashesOfULSHs> are not touched).
+inline void RpreparePointAddingForTuples(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point, int subdim, IntT firstTuple, IntT nTuples){
   ASSERT(nnStruct != NULL);
   ASSERT(uhash != NULL);
   ASSERT(point != NULL);
+  CR_ASSERT(firstTuple >= 0 && firstTuple + nTuples <= nnStruct->nHFTuples);
 
   TIMEV_START(timeComputeULSH);
 
@@ -975,24 +1827,25 @@ void RpreparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash,
   for(IntT d = 0; d < nnStruct->dimension; d++){
     nnStruct->reducedPoint[d] = point->coordinates[d] /*/ nnStruct->parameterR*/;
   }
-  
+
 
   // Compute all ULSH functions.
-  for(IntT i = 0; i < nnStruct->nHFTuples; i++){
+  for(IntT i = firstTuple; i < firstTuple + nTuples; i++){
     computeULSH(nnStruct, i, nnStruct->reducedPoint, nnStruct->pointULSHVectors[i], subdim);
   }
 
   // Compute data for <precomputedHashesOfULSHs>.
   if (USE_SAME_UHASH_FUNCTIONS) {
-    for(IntT i = 0; i < nnStruct->nHFTuples; i++){
-      precomputeUHFsForULSH(uhash, nnStruct->pointULSHVectors[i], nnStruct->hfTuplesLength, nnStruct->precomputedHashesOfULSHs[i]);
-      
-    }
+    precomputeUHFsForULSHs(nnStruct, uhash, nnStruct->pointULSHVectors, nnStruct->precomputedHashesOfULSHs, firstTuple, nTuples);
   }
 
   TIMEV_END(timeComputeULSH);
 }
 
+void RpreparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point, int subdim){
+  RpreparePointAddingForTuples(nnStruct, uhash, point, subdim, 0, nnStruct->nHFTuples);
+}
+
 inline void batchAddRequest(PRNearNeighborStructT nnStruct, IntT i, IntT &firstIndex, IntT &secondIndex, PPointT point){
 //   Uns32T *(gVector[4]);
 //   if (!nnStruct->useUfunctions) {
@@ -1070,28 +1923,263 @@ void addNewPointToPRNearNeighborStruct(PRNearNeighborStructT nnStruct, PPointT p
   }
 }
 
+// Merges the delta tables of <nnStruct> into its packed tables:
+// every packed table is unpacked into a model HT together with the
+// delta points and packed again. The delta is released. The
+// deleted points are left out of the packed tables.
+void mergeDeltaBuckets(PRNearNeighborStructT nnStruct){
+  ASSERT(nnStruct != NULL);
+  if (nnStruct->deltaBuckets == NULL){
+    return;
+  }
+  ASSERT(IS_PACKED_TYPE_HT(nnStruct->hashedBuckets[0]->typeHT));
+
+  Uns32T *mainHashA = nnStruct->hashedBuckets[0]->mainHashA;
+  Uns32T *controlHash1 = nnStruct->hashedBuckets[0]->controlHash1;
+  Int32T hashTableSize = nnStruct->hashedBuckets[0]->hashTableSize;
+  PUHashStructureT modelHT = newUHashStructure(HT_LINKED_LIST, hashTableSize, nnStruct->parameterK, TRUE, mainHashA, controlHash1, NULL, nnStruct->memoryPlacement);
+
+  Int32T firstDeltaPoint = nnStruct->nPoints - nnStruct->nDeltaPoints;
+  IntT hashesPerPoint = nnStruct->nHFTuples * N_PRECOMPUTED_HASHES_NEEDED;
+
+  // Initialize the counters for defining the pair of <u> functions used for <g> functions.
+  IntT firstUComp = 0;
+  IntT secondUComp = 1;
+  for(IntT i = 0; i < nnStruct->parameterL; i++){
+    unpackUHashStructure(nnStruct->hashedBuckets[i], modelHT, 0, nnStruct->deletedPoints);
+    for(Int32T p = 0; p < nnStruct->nDeltaPoints; p++){
+      if (IS_POINT_DELETED(nnStruct, firstDeltaPoint + p)){
+	continue;
+      }
+      Uns32T *hashes = nnStruct->deltaHashes + p * hashesPerPoint;
+      if (!nnStruct->useUfunctions) {
+	addBucketEntry(modelHT, 1, hashes + i * N_PRECOMPUTED_HASHES_NEEDED, NULL, firstDeltaPoint + p);
+      } else {
+	addBucketEntry(modelHT, 2, hashes + firstUComp * N_PRECOMPUTED_HASHES_NEEDED, hashes + secondUComp * N_PRECOMPUTED_HASHES_NEEDED, firstDeltaPoint + p);
+      }
+    }
+
+    // compute what is the next pair of <u> functions.
+    secondUComp++;
+    if (secondUComp == nnStruct->nHFTuples) {
+      firstUComp++;
+      secondUComp = firstUComp + 1;
+    }
+
+    applyHeavyBucketPolicy(nnStruct, i, modelHT);
+    PUHashStructureT packedHT = newUHashStructure(nnStruct->hashedBuckets[i]->typeHT, hashTableSize, nnStruct->parameterK, TRUE, mainHashA, controlHash1, modelHT, nnStruct->memoryPlacement);
+    freeUHashStructure(nnStruct->hashedBuckets[i], FALSE);
+    nnStruct->hashedBuckets[i] = packedHT;
+    clearUHashStructure(modelHT);
+
+    freeUHashStructure(nnStruct->deltaBuckets[i], FALSE);
+  }
+  freeUHashStructure(modelHT, FALSE);
+
+  FREE(nnStruct->deltaBuckets);
+  FREE(nnStruct->deltaHashes);
+  nnStruct->nDeltaPoints = 0;
+  nnStruct->deltaCapacity = 0;
+
+  // The deleted points were dropped as well, so this was also a
+  // complete compaction.
+  nnStruct->nDeletedPointsInTables = 0;
+  nnStruct->nextTableToCompact = -1;
+}
+
+// Adds the points <newPoints> to the structure <nnStruct>, whose
+// tables are packed (see IS_PACKED_TYPE_HT; built by
+// RinitLSH_WithDataSet with the same <subdim>). The points go first
+// into the delta tables (see <deltaBuckets>), which are merged into
+// the packed tables once they are full. The points get the indeces
+// nPoints, nPoints+1, ... in the order they are given.
+void RaddNewPointsToPRNearNeighborStruct(PRNearNeighborStructT nnStruct, Int32T nNewPoints, PPointT *newPoints, int subdim){
+  ASSERT(nnStruct != NULL);
+  ASSERT(newPoints != NULL);
+  ASSERT(IS_PACKED_TYPE_HT(nnStruct->hashedBuckets[0]->typeHT));
+  FAILIFWR((LongUns64T)nnStruct->nPoints + nNewPoints > MAX_N_POINTS, "Too many points.");
+
+  // Make room in <points> and in <markedPoints>.
+  if (nnStruct->nPoints + nNewPoints > nnStruct->pointsArraySize){
+    nnStruct->pointsArraySize = MAX(2 * nnStruct->pointsArraySize, nnStruct->nPoints + nNewPoints);
+    FAILIF(NULL == (nnStruct->points = (PPointT*)REALLOC(nnStruct->points, nnStruct->pointsArraySize * sizeof(PPointT))));
+    Int32T oldBitmapWords = N_WORDS_FOR_POINTS_BITMAP(nnStruct->nPoints);
+    Int32T bitmapWords = N_WORDS_FOR_POINTS_BITMAP(nnStruct->pointsArraySize);
+    FAILIF(NULL == (nnStruct->deletedPoints = (Uns32T*)REALLOC(nnStruct->deletedPoints, bitmapWords * sizeof(Uns32T))));
+    memset(nnStruct->deletedPoints + oldBitmapWords, 0, (bitmapWords - oldBitmapWords) * sizeof(Uns32T));
+  }
+  if (nnStruct->nPoints + nNewPoints > nnStruct->sizeMarkedPoints) {
+    nnStruct->sizeMarkedPoints = 2 * (nnStruct->nPoints + nNewPoints);
+    FAILIF(NULL == (nnStruct->markedPoints = (BooleanT*)REALLOC(nnStruct->markedPoints, nnStruct->sizeMarkedPoints * sizeof(BooleanT))));
+    for(IntT i = 0; i < nnStruct->sizeMarkedPoints; i++){
+      nnStruct->markedPoints[i] = FALSE;
+    }
+    FAILIF(NULL == (nnStruct->markedPointsIndeces = (Int32T*)REALLOC(nnStruct->markedPointsIndeces, nnStruct->sizeMarkedPoints * sizeof(Int32T))));
+  }
+
+  IntT hashesPerPoint = nnStruct->nHFTuples * N_PRECOMPUTED_HASHES_NEEDED;
+  Int32T nAdded = 0;
+  while (nAdded < nNewPoints){
+    if (nnStruct->deltaBuckets == NULL){
+      // Create an empty delta.
+      nnStruct->deltaCapacity = MAX(DELTA_MIN_MERGE_SIZE, (Int32T)(DELTA_MERGE_RATIO * nnStruct->nPoints));
+      FAILIF(NULL == (nnStruct->deltaBuckets = (PUHashStructureT*)MALLOC(nnStruct->parameterL * sizeof(PUHashStructureT))));
+      for(IntT i = 0; i < nnStruct->parameterL; i++){
+	nnStruct->deltaBuckets[i] = newUHashStructure(HT_LINKED_LIST, nnStruct->deltaCapacity, nnStruct->parameterK, TRUE, nnStruct->hashedBuckets[0]->mainHashA, nnStruct->hashedBuckets[0]->controlHash1, NULL, nnStruct->memoryPlacement);
+      }
+      FAILIF(NULL == (nnStruct->deltaHashes = (Uns32T*)MALLOC((MemVarT)nnStruct->deltaCapacity * hashesPerPoint * sizeof(Uns32T))));
+      nnStruct->nDeltaPoints = 0;
+    }
+
+    // The batch that still fits in the delta.
+    Int32T nBatch = MIN(nNewPoints - nAdded, nnStruct->deltaCapacity - nnStruct->nDeltaPoints);
+    Int32T firstBatchDeltaPoint = nnStruct->nDeltaPoints;
+    for(Int32T p = 0; p < nBatch; p++){
+      PPointT point = newPoints[nAdded + p];
+      nnStruct->points[nnStruct->nPoints + p] = point;
+      RpreparePointAdding(nnStruct, nnStruct->hashedBuckets[0], point, subdim);
+      Uns32T *hashes = nnStruct->deltaHashes + (firstBatchDeltaPoint + p) * hashesPerPoint;
+      for(IntT l = 0; l < nnStruct->nHFTuples; l++){
+	for(IntT h = 0; h < N_PRECOMPUTED_HASHES_NEEDED; h++){
+	  hashes[l * N_PRECOMPUTED_HASHES_NEEDED + h] = nnStruct->precomputedHashesOfULSHs[l][h];
+	}
+      }
+    }
+
+    // Add the batch to the delta tables, one table at a time.
+    TIMEV_START(timeBucketIntoUH);
+    IntT firstUComp = 0;
+    IntT secondUComp = 1;
+    for(IntT i = 0; i < nnStruct->parameterL; i++){
+      for(Int32T p = 0; p < nBatch; p++){
+	Uns32T *hashes = nnStruct->deltaHashes + (firstBatchDeltaPoint + p) * hashesPerPoint;
+	if (!nnStruct->useUfunctions) {
+	  addBucketEntry(nnStruct->deltaBuckets[i], 1, hashes + i * N_PRECOMPUTED_HASHES_NEEDED, NULL, nnStruct->nPoints + p);
+	} else {
+	  addBucketEntry(nnStruct->deltaBuckets[i], 2, hashes + firstUComp * N_PRECOMPUTED_HASHES_NEEDED, hashes + secondUComp * N_PRECOMPUTED_HASHES_NEEDED, nnStruct->nPoints + p);
+	}
+      }
+      secondUComp++;
+      if (secondUComp == nnStruct->nHFTuples) {
+	firstUComp++;
+	secondUComp = firstUComp + 1;
+      }
+    }
+    TIMEV_END(timeBucketIntoUH);
+
+    nnStruct->nPoints += nBatch;
+    nnStruct->nDeltaPoints += nBatch;
+    nAdded += nBatch;
+
+    if (nnStruct->nDeltaPoints == nnStruct->deltaCapacity){
+      mergeDeltaBuckets(nnStruct);
+    }
+  }
+}
+
+// Marks the point <pointIndex> of <nnStruct> as deleted. The point
+// is not reported by the queries anymore, but stays in the tables
+// until they are compacted. Once the deleted points in the tables
+// pass TOMBSTONE_COMPACTION_RATIO * nPoints, a compaction is started;
+// it advances by one table on each subsequent deletion (see
+// <compactPRNearNeighborStructStep>), so that no single call pays for
+// rewriting all the tables. The point itself (the PPointT) is not
+// freed.
+void deletePointFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct, Int32T pointIndex){
+  ASSERT(nnStruct != NULL);
+  ASSERT(pointIndex >= 0 && pointIndex < nnStruct->nPoints);
+
+  if (IS_POINT_DELETED(nnStruct, pointIndex)){
+    return;
+  }
+  nnStruct->deletedPoints[pointIndex >> 5] |= 1U << (pointIndex & 31);
+  nnStruct->nDeletedPoints++;
+  nnStruct->nDeletedPointsInTables++;
+
+  if (!IS_PACKED_TYPE_HT(nnStruct->hashedBuckets[0]->typeHT)){
+    // Only the packed tables are compacted.
+    return;
+  }
+  if (nnStruct->nextTableToCompact < 0 && nnStruct->nDeletedPointsInTables > TOMBSTONE_COMPACTION_RATIO * nnStruct->nPoints){
+    nnStruct->nextTableToCompact = 0;
+    nnStruct->nDeletedAtCompactionStart = nnStruct->nDeletedPointsInTables;
+  }
+  compactPRNearNeighborStructStep(nnStruct);
+}
+
+// Performs one step of an ongoing compaction of <nnStruct>: the next
+// packed table is rewritten without the deleted points. If
+// the structure has a delta, the step merges it instead (which drops
+// the deleted points from all tables at once). Returns TRUE iff a
+// compaction is still in progress after the step.
+BooleanT compactPRNearNeighborStructStep(PRNearNeighborStructT nnStruct){
+  ASSERT(nnStruct != NULL);
+  if (nnStruct->nextTableToCompact < 0){
+    return FALSE;
+  }
+  ASSERT(IS_PACKED_TYPE_HT(nnStruct->hashedBuckets[0]->typeHT));
+
+  if (nnStruct->deltaBuckets != NULL){
+    mergeDeltaBuckets(nnStruct);
+    return FALSE;
+  }
+
+  Uns32T *mainHashA = nnStruct->hashedBuckets[0]->mainHashA;
+  Uns32T *controlHash1 = nnStruct->hashedBuckets[0]->controlHash1;
+  Int32T hashTableSize = nnStruct->hashedBuckets[0]->hashTableSize;
+  IntT i = nnStruct->nextTableToCompact;
+
+  PUHashStructureT modelHT = newUHashStructure(HT_LINKED_LIST, hashTableSize, nnStruct->parameterK, TRUE, mainHashA, controlHash1, NULL, nnStruct->memoryPlacement);
+  unpackUHashStructure(nnStruct->hashedBuckets[i], modelHT, 0, nnStruct->deletedPoints);
+  applyHeavyBucketPolicy(nnStruct, i, modelHT);
+  PUHashStructureT packedHT = newUHashStructure(nnStruct->hashedBuckets[i]->typeHT, hashTableSize, nnStruct->parameterK, TRUE, mainHashA, controlHash1, modelHT, nnStruct->memoryPlacement);
+  // hashedBuckets[0] owns the shared hash functions; they are kept.
+  freeUHashStructure(nnStruct->hashedBuckets[i], FALSE);
+  nnStruct->hashedBuckets[i] = packedHT;
+  freeUHashStructure(modelHT, FALSE);
+
+  nnStruct->nextTableToCompact++;
+  if (nnStruct->nextTableToCompact == nnStruct->parameterL){
+    // All the points deleted before the start of the compaction are
+    // gone from the tables (the later ones may still be in some).
+    nnStruct->nDeletedPointsInTables -= nnStruct->nDeletedAtCompactionStart;
+    nnStruct->nextTableToCompact = -1;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// Removes all the deleted points from the packed tables of
+// <nnStruct> (finishing an ongoing compaction, if any).
+void compactPRNearNeighborStruct(PRNearNeighborStructT nnStruct){
+  ASSERT(nnStruct != NULL);
+  if (!IS_PACKED_TYPE_HT(nnStruct->hashedBuckets[0]->typeHT) || nnStruct->nDeletedPointsInTables == 0){
+    return;
+  }
+  if (nnStruct->nextTableToCompact > 0){
+    // Finish the ongoing compaction first; it does not cover the
+    // points deleted after it started.
+    while (compactPRNearNeighborStructStep(nnStruct)){
+    }
+    if (nnStruct->nDeletedPointsInTables == 0){
+      return;
+    }
+  }
+  nnStruct->nextTableToCompact = 0;
+  nnStruct->nDeletedAtCompactionStart = nnStruct->nDeletedPointsInTables;
+  while (compactPRNearNeighborStructStep(nnStruct)){
+  }
+}
+
 // Returns TRUE iff |p1-p2|_2^2 <= threshold
 inline BooleanT isDistanceSqrLeq(IntT dimension, PPointT p1, PPointT p2, RealT threshold){
-  RealT result = 0;
   nOfDistComps++;
 
   TIMEV_START(timeDistanceComputation);
-  for (IntT i = 0; i < dimension; i++){
-    RealT temp = p1->coordinates[i] - p2->coordinates[i];
-#ifdef USE_L1_DISTANCE
-    result += ABS(temp);
-#else
-    result += SQR(temp);
-#endif
-    if (result > threshold){
-      // TIMEV_END(timeDistanceComputation);
-      return 0;
-    }
-  }
+  BooleanT result = sqrDistanceBounded(dimension, p1->coordinates, p2->coordinates, threshold) <= threshold;
   TIMEV_END(timeDistanceComputation);
 
-  //return result <= threshold;
-  return 1;
+  return result;
 }
 
 // // Returns TRUE iff |p1-p2|_2^2 <= threshold
@@ -1176,10 +2264,10 @@ Int32T FgetNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
     if (!nnStruct->useUfunctions) {
       // Use usual <g> functions (truly independent; <g>s are precisly
       // <u>s).
-      gbucket = getGBucket(nnStruct->hashedBuckets[i], 1, precomputedHashesOfULSHs[i], NULL);
+      gbucket = getTableGBucket(nnStruct, i, 1, precomputedHashesOfULSHs[i], NULL, query, nBucketsInChains);
     } else {
       // Use <u> functions (<g>s are pairs of <u> functions).
-      gbucket = getGBucket(nnStruct->hashedBuckets[i], 2, precomputedHashesOfULSHs[firstUComp], precomputedHashesOfULSHs[secondUComp]);
+      gbucket = getTableGBucket(nnStruct, i, 2, precomputedHashesOfULSHs[firstUComp], precomputedHashesOfULSHs[secondUComp], query, nBucketsInChains);
       secondUComp++;
       if (secondUComp == nnStruct->nHFTuples) {
 	      firstUComp++;
@@ -1203,7 +2291,7 @@ Int32T FgetNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
 	          PPointT candidatePoint = nnStruct->points[candidatePIndex];
             // printf("dataindex is %d\n", candidatePIndex);
             
-	          if (isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
+	          if (!IS_POINT_DELETED(nnStruct, candidatePIndex) && isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
 	            if (nnStruct->markedPoints[candidatePIndex] == FALSE) {
 	              if (nNeighbors >= resultSize){
 		              resultSize = 2 * resultSize;
@@ -1241,7 +2329,7 @@ Int32T FgetNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
 	        if (index == MAX_NONOVERFLOW_POINTS_PER_BUCKET){
 	          index = index + offset;
 	        }
-	        Int32T candidatePIndex = (hybridPoint + index)->point.pointIndex;
+	        Int32T candidatePIndex = hybridEntryPointIndex(nnStruct->hashedBuckets[i], hybridPoint + index);
 
 	        CR_ASSERT(candidatePIndex >= 0 && candidatePIndex < nnStruct->nPoints);
 	        done = (hybridPoint + index)->point.isLastPoint == 1 ? TRUE : FALSE;
@@ -1258,7 +2346,7 @@ Int32T FgetNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
 
 	          PPointT candidatePoint = nnStruct->points[candidatePIndex];
             
-	          if (isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
+	          if (!IS_POINT_DELETED(nnStruct, candidatePIndex) && isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
 	            if (nNeighbors >= resultSize){
 		            resultSize = 2 * resultSize;
 		            result = (PPointT*)REALLOC(result, resultSize * sizeof(PPointT));
@@ -1272,6 +2360,33 @@ Int32T FgetNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
 	      }
       }
       break;
+    case HT_BUCKET_DIRECTORY:
+    case HT_COMPRESSED_DIRECTORY:
+    case HT_PERFECT_HASH:
+      if (gbucket.directoryGBucket != NULL){
+	DirectoryBucketReaderT reader;
+	initDirectoryBucketReader(nnStruct->hashedBuckets[i], gbucket.directoryGBucket, reader);
+	for(Uns32T j = 0; j < gbucket.directoryGBucket->length; j++){
+	  Int32T candidatePIndex = nextDirectoryBucketPoint(reader);
+	  CR_ASSERT(candidatePIndex >= 0 && candidatePIndex < nnStruct->nPoints);
+	  if (nnStruct->markedPoints[candidatePIndex] == FALSE){
+	    nnStruct->markedPointsIndeces[nMarkedPoints] = candidatePIndex;
+	    nnStruct->markedPoints[candidatePIndex] = TRUE;
+	    nMarkedPoints++;
+
+	    PPointT candidatePoint = nnStruct->points[candidatePIndex];
+	    if (!IS_POINT_DELETED(nnStruct, candidatePIndex) && isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
+	      if (nNeighbors >= resultSize){
+		resultSize = 2 * resultSize;
+		result = (PPointT*)REALLOC(result, resultSize * sizeof(PPointT));
+	      }
+	      result[nNeighbors] = candidatePoint;
+	      nNeighbors++;
+	    }
+	  }
+	}
+      }
+      break;
       default:
       ASSERT(FALSE);
     }
@@ -1295,171 +2410,1071 @@ Int32T FgetNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
   return nNeighbors;
 }
 
-Int32T R2getNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct, PPointT query, PPointT *(&result), Int32T &resultSize, int &num, int subdim){
+// Allocates the temporary vectors of the queries of one thread on
+// <nnStruct> (see QueryContextT).
+PQueryContextT newQueryContext(const RNearNeighborStructT *nnStruct){
   ASSERT(nnStruct != NULL);
-  ASSERT(query != NULL);
-  ASSERT(nnStruct->reducedPoint != NULL);
-  ASSERT(!nnStruct->useUfunctions || nnStruct->pointULSHVectors != NULL);
+  PQueryContextT context;
+  FAILIF(NULL == (context = (PQueryContextT)MALLOC(sizeof(QueryContextT))));
+  context->nHFTuples = nnStruct->nHFTuples;
+  FAILIF(NULL == (context->pointULSHVectors = (Uns32T**)MALLOC(nnStruct->nHFTuples * sizeof(Uns32T*))));
+  FAILIF(NULL == (context->precomputedHashesOfULSHs = (Uns32T**)MALLOC(nnStruct->nHFTuples * sizeof(Uns32T*))));
+  for(IntT i = 0; i < nnStruct->nHFTuples; i++){
+    FAILIF(NULL == (context->pointULSHVectors[i] = (Uns32T*)MALLOC(nnStruct->hfTuplesLength * sizeof(Uns32T))));
+    FAILIF(NULL == (context->precomputedHashesOfULSHs[i] = (Uns32T*)MALLOC(MAX(nnStruct->hfTuplesLength, N_PRECOMPUTED_HASHES_NEEDED) * sizeof(Uns32T))));
+  }
+  FAILIF(NULL == (context->pointULSHFractions = (RealT**)MALLOC(nnStruct->nHFTuples * sizeof(RealT*))));
+  for(IntT i = 0; i < nnStruct->nHFTuples; i++){
+    FAILIF(NULL == (context->pointULSHFractions[i] = (RealT*)MALLOC(nnStruct->hfTuplesLength * sizeof(RealT))));
+  }
+  FAILIF(NULL == (context->probeSteps = (MultiProbeStepT*)MALLOC(2 * nnStruct->parameterK * sizeof(MultiProbeStepT))));
+  context->sizeProbeHeap = RESULT_INIT_SIZE;
+  FAILIF(NULL == (context->probeHeap = (MultiProbeSetT*)MALLOC(context->sizeProbeHeap * sizeof(MultiProbeSetT))));
+  for(IntT p = 0; p < 2; p++){
+    FAILIF(NULL == (context->perturbedULSHVectors[p] = (Uns32T*)MALLOC(nnStruct->hfTuplesLength * sizeof(Uns32T))));
+    FAILIF(NULL == (context->perturbedHashes[p] = (Uns32T*)MALLOC(MAX(nnStruct->hfTuplesLength, N_PRECOMPUTED_HASHES_NEEDED) * sizeof(Uns32T))));
+  }
+  FAILIF(NULL == (context->reducedPoint = (RealT*)MALLOC(nnStruct->dimension * sizeof(RealT))));
+  context->sizeVisitedEpochs = MAX(nnStruct->nPoints, 1);
+  FAILIF(NULL == (context->visitedEpochs = (Uns16T*)MALLOC(context->sizeVisitedEpochs * sizeof(Uns16T))));
+  memset(context->visitedEpochs, 0, context->sizeVisitedEpochs * sizeof(Uns16T));
+  context->epoch = 0;
+  context->ranking = nnStruct->collisionRanking;
+  context->isCountingCollisions = FALSE;
+  FAILIF(NULL == (context->collisionCounts = (Uns16T*)MALLOC(context->sizeVisitedEpochs * sizeof(Uns16T))));
+  context->nCollidingPoints = 0;
+  context->sizeCollidingPoints = RESULT_INIT_SIZE;
+  FAILIF(NULL == (context->collidingPoints = (Int32T*)MALLOC(context->sizeCollidingPoints * sizeof(Int32T))));
+  context->sizeCandidates = RESULT_INIT_SIZE;
+  FAILIF(NULL == (context->candidates = (Int32T*)MALLOC(context->sizeCandidates * sizeof(Int32T))));
+  context->k = 0;
+  context->sizeNearestNeighbors = RESULT_INIT_SIZE;
+  FAILIF(NULL == (context->nearestNeighbors = (PPointAndRealTStructT*)MALLOC(context->sizeNearestNeighbors * sizeof(PPointAndRealTStructT))));
+  context->nNearestNeighbors = 0;
+  context->nExaminedPoints = 0;
+  context->nDistanceComputations = 0;
+  context->nBucketsInChains = 0;
+  context->isCollectingBuckets = FALSE;
+  context->collectingQuery = 0;
+  context->bucketVisits = NULL;
+  context->nBucketVisits = 0;
+  context->sizeBucketVisits = 0;
+  context->limits = nnStruct->queryLimits;
+  context->deadline = 0;
+  context->isPartial = FALSE;
+  return context;
+}
 
-  PPointT point = query;
+void freeQueryContext(PQueryContextT context){
+  if (context == NULL){
+    return;
+  }
+  for(IntT i = 0; i < context->nHFTuples; i++){
+    FREE(context->pointULSHVectors[i]);
+    FREE(context->precomputedHashesOfULSHs[i]);
+    FREE(context->pointULSHFractions[i]);
+  }
+  FREE(context->pointULSHVectors);
+  FREE(context->precomputedHashesOfULSHs);
+  FREE(context->pointULSHFractions);
+  FREE(context->probeSteps);
+  FREE(context->probeHeap);
+  for(IntT p = 0; p < 2; p++){
+    FREE(context->perturbedULSHVectors[p]);
+    FREE(context->perturbedHashes[p]);
+  }
+  FREE(context->reducedPoint);
+  FREE(context->visitedEpochs);
+  FREE(context->collisionCounts);
+  FREE(context->collidingPoints);
+  FREE(context->bucketVisits);
+  FREE(context->candidates);
+  FREE(context->nearestNeighbors);
+  FREE(context);
+}
 
-  if (result == NULL){
-    resultSize = RESULT_INIT_SIZE;
-    FAILIF(NULL == (result = (PPointT*)MALLOC(resultSize * sizeof(PPointT))));
+// Same as isDistanceSqrLeq, but counts the distance computation in
+// <context> (and is not timed).
+inline BooleanT isDistanceSqrLeqInContext(PQueryContextT context, IntT dimension, PPointT p1, PPointT p2, RealT threshold){
+  context->nDistanceComputations++;
+  return sqrDistanceBounded(dimension, p1->coordinates, p2->coordinates, threshold) <= threshold;
+}
+
+// Starts a new query in <context>: no point is visited afterwards.
+inline void resetVisitedPoints(PQueryContextT context){
+  context->epoch++;
+  if (context->epoch == 0){
+    // the stamps wrapped around.
+    memset(context->visitedEpochs, 0, context->sizeVisitedEpochs * sizeof(Uns16T));
+    context->epoch = 1;
   }
-  
-  RpreparePointAdding(nnStruct, nnStruct->hashedBuckets[0], point, subdim);
+}
 
-  Uns32T precomputedHashesOfULSHs[nnStruct->nHFTuples][N_PRECOMPUTED_HASHES_NEEDED];
-  for(IntT i = 0; i < nnStruct->nHFTuples; i++){
-    for(IntT j = 0; j < N_PRECOMPUTED_HASHES_NEEDED; j++){
-      precomputedHashesOfULSHs[i][j] = nnStruct->precomputedHashesOfULSHs[i][j];
-    }
+// Marks the point <pointIndex> as visited by the current query of
+// <context>. Returns FALSE if it was visited already.
+inline BooleanT visitPoint(PQueryContextT context, Int32T pointIndex){
+  if (context->visitedEpochs[pointIndex] == context->epoch){
+    return FALSE;
   }
+  context->visitedEpochs[pointIndex] = context->epoch;
+  context->nExaminedPoints++;
+  return TRUE;
+}
 
+// The time (in seconds) of the clock of the query deadlines.
+inline TimeVarT queryClock(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
 
+// Whether the current query of <context> must stop: a limit stopped
+// it already, or its deadline passed (then context->isPartial is
+// set).
+inline BooleanT isQueryStopped(PQueryContextT context){
+  if (!context->isPartial && context->limits.maxTime > 0 && queryClock() > context->deadline){
+    context->isPartial = TRUE;
+  }
+  return context->isPartial;
+}
 
+// Orders the max-heap <nearestNeighbors> of a QueryContextT.
+inline bool isNearer(const PPointAndRealTStructT &a, const PPointAndRealTStructT &b){
+  return a.real < b.real;
+}
 
-  TIMEV_START(timeTotalBuckets);
+// Offers the point <candidatePoint> to the k-NN heap of <context>:
+// its distance to <point> is computed with the distance of the k-th
+// nearest neighbor so far (or R, while there are fewer than <k>) as
+// the threshold of the early exit.
+inline void offerNearestNeighbor(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT point, PPointT candidatePoint){
+  PPointAndRealTStructT *heap = context->nearestNeighbors;
+  BooleanT full = context->nNearestNeighbors == context->k;
+  RealT threshold = full ? heap[0].real : nnStruct->parameterR2;
+  context->nDistanceComputations++;
+  RealT sqrDistance = sqrDistanceBounded(nnStruct->dimension, point->coordinates, candidatePoint->coordinates, threshold);
+  if (sqrDistance > threshold || (full && sqrDistance == threshold)){
+    return;
+  }
+  if (full){
+    std::pop_heap(heap, heap + context->nNearestNeighbors, isNearer);
+    context->nNearestNeighbors--;
+  }
+  heap[context->nNearestNeighbors].ppoint = candidatePoint;
+  heap[context->nNearestNeighbors].real = sqrDistance;
+  context->nNearestNeighbors++;
+  std::push_heap(heap, heap + context->nNearestNeighbors, isNearer);
+}
 
-  BooleanT oldTimingOn = timingOn;
-  if (noExpensiveTiming) {
-    timingOn = FALSE;
+// Counts a collision of the point <pointIndex> with the query of
+// <context> (see CollisionRankingT).
+inline void countCollisionInContext(PQueryContextT context, Int32T pointIndex){
+  if (context->visitedEpochs[pointIndex] != context->epoch){
+    context->visitedEpochs[pointIndex] = context->epoch;
+    context->collisionCounts[pointIndex] = 1;
+    if (context->nCollidingPoints >= context->sizeCollidingPoints){
+      context->sizeCollidingPoints = 2 * context->sizeCollidingPoints;
+      FAILIF(NULL == (context->collidingPoints = (Int32T*)REALLOC(context->collidingPoints, context->sizeCollidingPoints * sizeof(Int32T))));
+    }
+    context->collidingPoints[context->nCollidingPoints++] = pointIndex;
+  } else {
+    context->collisionCounts[pointIndex]++;
   }
-  
-  
-  IntT firstUComp = 0;
-  IntT secondUComp = 1;
+}
 
-  Int32T nNeighbors = 0;
-  Int32T nMarkedPoints = 0;
+// Examines the point <candidatePIndex> of <nnStruct> for the query
+// <point>, unless it was examined already: marks it and, if it is an
+// R-near neighbor, appends it to <result> (resized as needed), or
+// offers it to the k-NN heap in a k-NN query. A new point beyond
+// context->limits.maxCandidates stops the query instead. While the
+// query counts the collisions, the point is only counted.
+inline void examineCandidateInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT point, Int32T candidatePIndex, PPointT *(&result), IntT &resultSize, Int32T &nNeighbors){
+  if (context->isCountingCollisions){
+    countCollisionInContext(context, candidatePIndex);
+    return;
+  }
+  if (context->limits.maxCandidates > 0 && context->nExaminedPoints >= context->limits.maxCandidates){
+    if (context->visitedEpochs[candidatePIndex] != context->epoch){
+      context->isPartial = TRUE;
+    }
+    return;
+  }
+  if (visitPoint(context, candidatePIndex)){
 
-  for(IntT i = 0; i < nnStruct->parameterL; i++){ 
-    TIMEV_START(timeGetBucket);
-    GeneralizedPGBucket gbucket;
-    if (!nnStruct->useUfunctions) {
-      // Use usual <g> functions (truly independent; <g>s are precisly
-      // <u>s).
-      gbucket = getGBucket(nnStruct->hashedBuckets[i], 1, precomputedHashesOfULSHs[i], NULL);
-    } else {
-      // Use <u> functions (<g>s are pairs of <u> functions).
-      gbucket = getGBucket(nnStruct->hashedBuckets[i], 2, precomputedHashesOfULSHs[firstUComp], precomputedHashesOfULSHs[secondUComp]);
-      secondUComp++;
-      if (secondUComp == nnStruct->nHFTuples) {
-	      firstUComp++;
-	      secondUComp = firstUComp + 1;
+    PPointT candidatePoint = nnStruct->points[candidatePIndex];
+    if (context->k > 0){
+      if (!IS_POINT_DELETED(nnStruct, candidatePIndex) && nnStruct->reportingResult){
+	offerNearestNeighbor(nnStruct, context, point, candidatePoint);
       }
+      return;
     }
-    TIMEV_END(timeGetBucket);
+    if (!IS_POINT_DELETED(nnStruct, candidatePIndex) && isDistanceSqrLeqInContext(context, nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
+      if (nNeighbors >= resultSize){
+	resultSize = 2 * resultSize;
+	result = (PPointT*)REALLOC(result, resultSize * sizeof(PPointT));
+      }
+      result[nNeighbors] = candidatePoint;
+      nNeighbors++;
+    }
+  }
+}
 
-    PGBucketT bucket;
+// Examines (as examineCandidateInContext) the <nCandidates> points
+// context->candidates[0..nCandidates-1]. The point of the candidate
+// <queryPrefetchDistance> positions ahead and its visited stamp are
+// prefetched, and so are the first coordinates of the candidate half
+// as far ahead (whose point was prefetched earlier), so that the
+// loads of a candidate overlap the distance computations of the
+// previous ones. The candidates left when the query stops (see
+// isQueryStopped) are skipped.
+inline void examineCandidatesInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT point, IntT nCandidates, PPointT *(&result), IntT &resultSize, Int32T &nNeighbors){
+  Int32T *candidates = context->candidates;
+  if (context->isCountingCollisions){
+    for(IntT j = 0; j < nCandidates; j++){
+      if (context->isPartial || ((j & (QUERY_DEADLINE_CHECK_INTERVAL - 1)) == QUERY_DEADLINE_CHECK_INTERVAL - 1 && isQueryStopped(context))){
+	break;
+      }
+      countCollisionInContext(context, candidates[j]);
+    }
+    return;
+  }
+  IntT pointDistance = queryPrefetchDistance;
+  IntT coordinatesDistance = queryPrefetchDistance / 2;
+  IntT coordinatesBytes = MIN(nnStruct->dimension, DISTANCE_BLOCK_SIZE) * sizeof(RealT);
+  for(IntT j = 0; j < MIN(pointDistance, nCandidates); j++){
+    __builtin_prefetch(nnStruct->points[candidates[j]]);
+    __builtin_prefetch(context->visitedEpochs + candidates[j], 1);
+  }
+  for(IntT j = 0; j < nCandidates; j++){
+    if (context->isPartial || ((j & (QUERY_DEADLINE_CHECK_INTERVAL - 1)) == QUERY_DEADLINE_CHECK_INTERVAL - 1 && isQueryStopped(context))){
+      break;
+    }
+    if (pointDistance > 0 && j + pointDistance < nCandidates){
+      __builtin_prefetch(nnStruct->points[candidates[j + pointDistance]]);
+      __builtin_prefetch(context->visitedEpochs + candidates[j + pointDistance], 1);
+    }
+    if (pointDistance > 0 && j + coordinatesDistance < nCandidates){
+      char *coordinates = (char*)nnStruct->points[candidates[j + coordinatesDistance]]->coordinates;
+      for(IntT b = 0; b < coordinatesBytes; b += 64){
+	__builtin_prefetch(coordinates + b);
+      }
+    }
+    examineCandidateInContext(nnStruct, context, point, candidates[j], result, resultSize, nNeighbors);
+  }
+}
 
-    
+// Appends the point index <pointIndex> to the candidates of
+// <context> (of which there are <nCandidates>), resizing them as
+// needed.
+inline void addCandidate(PQueryContextT context, IntT &nCandidates, Int32T pointIndex){
+  if (nCandidates >= context->sizeCandidates){
+    context->sizeCandidates = 2 * context->sizeCandidates;
+    FAILIF(NULL == (context->candidates = (Int32T*)REALLOC(context->candidates, context->sizeCandidates * sizeof(Int32T))));
+  }
+  context->candidates[nCandidates++] = pointIndex;
+}
 
-    TIMEV_START(timeCycleBucket);
-    switch (nnStruct->hashedBuckets[i]->typeHT){
-      case HT_LINKED_LIST:
-        bucket = gbucket.llGBucket;
-        if (bucket != NULL){
-	        PBucketEntryT bucketEntry = &(bucket->firstEntry);
-	        while (bucketEntry != NULL){
-	          Int32T candidatePIndex = bucketEntry->pointIndex;
-	          PPointT candidatePoint = nnStruct->points[candidatePIndex];
-            // printf("dataindex is %d\n", candidatePIndex);
-            
-	          if (isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
-	            if (nnStruct->markedPoints[candidatePIndex] == FALSE) {
-	              if (nNeighbors >= resultSize){
-		              resultSize = 2 * resultSize;
-		              result = (PPointT*)REALLOC(result, resultSize * sizeof(PPointT));
-	              } 
-	              result[nNeighbors] = candidatePoint;
-	              nNeighbors++;
-	              nnStruct->markedPointsIndeces[nMarkedPoints] = candidatePIndex;
-	              nnStruct->markedPoints[candidatePIndex] = TRUE; 
-	              nMarkedPoints++;
-	            }
-	          }else{
+// Decodes the point indices of the bucket <gbucket> of <uhash> into
+// context->candidates; returns their number.
+inline IntT decodeGBucketInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PUHashStructureT uhash, GeneralizedPGBucket gbucket){
+  IntT nCandidates = 0;
+  switch (uhash->typeHT){
+  case HT_LINKED_LIST:
+    if (gbucket.llGBucket != NULL){
+      PBucketEntryT bucketEntry = &(gbucket.llGBucket->firstEntry);
+      while (bucketEntry != NULL){
+	addCandidate(context, nCandidates, bucketEntry->pointIndex);
+	bucketEntry = bucketEntry->nextEntry;
+      }
+    }
+    break;
+  case HT_STATISTICS:
+    ASSERT(FALSE); 
+    break;
+  case HT_HYBRID_CHAINS:
+    if (gbucket.hybridGBucket != NULL){
+      PHybridChainEntryT hybridPoint = gbucket.hybridGBucket;
+      Uns32T offset = 0;
+      if (hybridPoint->point.bucketLength == 0){
+	offset = 0;
+	for(IntT j = 0; j < N_FIELDS_PER_INDEX_OF_OVERFLOW; j++){
+	  offset += ((Uns32T)((hybridPoint + 1 + j)->point.bucketLength) << (j * N_BITS_FOR_BUCKET_LENGTH));
+	}
+      }
+      Uns32T index = 0;
+      BooleanT done = FALSE;
+      while(!done){
+	if (index == MAX_NONOVERFLOW_POINTS_PER_BUCKET){
+	  index = index + offset;
+	}
+	Int32T candidatePIndex = hybridEntryPointIndex(uhash, hybridPoint + index);
 
-	          }
-	          bucketEntry = bucketEntry->nextEntry;
-	        }
-        }
-        break;
-    case HT_STATISTICS:
-      ASSERT(FALSE); 
-      break;
-    case HT_HYBRID_CHAINS:
-      if (gbucket.hybridGBucket != NULL){
-	      PHybridChainEntryT hybridPoint = gbucket.hybridGBucket;
-	      Uns32T offset = 0;
-	      if (hybridPoint->point.bucketLength == 0){
-	        offset = 0;
-	        for(IntT j = 0; j < N_FIELDS_PER_INDEX_OF_OVERFLOW; j++){
-	          offset += ((Uns32T)((hybridPoint + 1 + j)->point.bucketLength) << (j * N_BITS_FOR_BUCKET_LENGTH));
-	        }
-	      }
-	      Uns32T index = 0;
-	      BooleanT done = FALSE;
-	      while(!done){
-	        if (index == MAX_NONOVERFLOW_POINTS_PER_BUCKET){
-	          index = index + offset;
-	        }
-	        Int32T candidatePIndex = (hybridPoint + index)->point.pointIndex;
+	CR_ASSERT(candidatePIndex >= 0 && candidatePIndex < nnStruct->nPoints);
+	done = (hybridPoint + index)->point.isLastPoint == 1 ? TRUE : FALSE;
+	index++;
+	addCandidate(context, nCandidates, candidatePIndex);
+      }
+    }
+    break;
+  case HT_BUCKET_DIRECTORY:
+  case HT_COMPRESSED_DIRECTORY:
+  case HT_PERFECT_HASH:
+    if (gbucket.directoryGBucket != NULL){
+      DirectoryBucketReaderT reader;
+      initDirectoryBucketReader(uhash, gbucket.directoryGBucket, reader);
+      for(Uns32T j = 0; j < gbucket.directoryGBucket->length; j++){
+	Int32T candidatePIndex = nextDirectoryBucketPoint(reader);
+	CR_ASSERT(candidatePIndex >= 0 && candidatePIndex < nnStruct->nPoints);
+	addCandidate(context, nCandidates, candidatePIndex);
+      }
+    }
+    break;
+  default:
+    ASSERT(FALSE);
+  }
+  return nCandidates;
+}
 
-	        CR_ASSERT(candidatePIndex >= 0 && candidatePIndex < nnStruct->nPoints);
-	        done = (hybridPoint + index)->point.isLastPoint == 1 ? TRUE : FALSE;
-	        index++;
+// Appends the bucket <gbucket> (of the table <table>, or, if <table>
+// >= nnStruct->parameterL, of the delta buckets of the table <table>
+// - parameterL) to the buckets of the query context->collectingQuery,
+// unless it is empty.
+inline void collectBucketInContext(PQueryContextT context, IntT table, PUHashStructureT uhash, GeneralizedPGBucket gbucket){
+  const void *address;
+  switch (uhash->typeHT){
+  case HT_LINKED_LIST:
+    address = gbucket.llGBucket;
+    break;
+  case HT_HYBRID_CHAINS:
+    address = gbucket.hybridGBucket;
+    break;
+  case HT_BUCKET_DIRECTORY:
+  case HT_COMPRESSED_DIRECTORY:
+  case HT_PERFECT_HASH:
+    address = gbucket.directoryGBucket;
+    break;
+  default:
+    ASSERT(FALSE);
+  }
+  if (address == NULL){
+    return;
+  }
+  if (context->nBucketVisits >= context->sizeBucketVisits){
+    context->sizeBucketVisits = 2 * context->sizeBucketVisits;
+    FAILIF(NULL == (context->bucketVisits = (BucketVisitT*)REALLOC(context->bucketVisits, context->sizeBucketVisits * sizeof(BucketVisitT))));
+  }
+  BucketVisitT &visit = context->bucketVisits[context->nBucketVisits++];
+  visit.table = table;
+  visit.address = address;
+  visit.gbucket = gbucket;
+  visit.query = context->collectingQuery;
+}
 
-          // printf("candidata index is %d\n", candidatePIndex);
-          
-	        if (nnStruct->markedPoints[candidatePIndex] == FALSE){
-	          nnStruct->markedPointsIndeces[nMarkedPoints] = candidatePIndex;
-	          nnStruct->markedPoints[candidatePIndex] = TRUE; 
-	          nMarkedPoints++;
+// Examines, in <context>, the points of the bucket <gbucket> of the
+// table <table> (see collectBucketInContext for <table>) of <uhash>
+// (or, while context->isCollectingBuckets, only collects the bucket).
+inline void examineGBucketInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, IntT table, PUHashStructureT uhash, GeneralizedPGBucket gbucket, PPointT *(&result), IntT &resultSize, Int32T &nNeighbors){
+  if (context->isCollectingBuckets){
+    collectBucketInContext(context, table, uhash, gbucket);
+  } else {
+    IntT nCandidates = decodeGBucketInContext(nnStruct, context, uhash, gbucket);
+    examineCandidatesInContext(nnStruct, context, query, nCandidates, result, resultSize, nNeighbors);
+  }
+}
 
-            // printf("candidata index is %d\n", candidatePIndex);
+// Examines, in <context>, the points added after packing to the
+// bucket of the table <table> with the bucket vector
+// <firstBucketVector> (<secondBucketVector>).
+inline void examineDeltaBucketInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, IntT table, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[], PPointT *(&result), IntT &resultSize, Int32T &nNeighbors){
+  if (nnStruct->deltaBuckets != NULL){
+    GeneralizedPGBucket gbucket = getGBucket(nnStruct->deltaBuckets[table], nBucketVectorPieces, firstBucketVector, secondBucketVector, context->nBucketsInChains);
+    examineGBucketInContext(nnStruct, context, query, nnStruct->parameterL + table, nnStruct->deltaBuckets[table], gbucket, result, resultSize, nNeighbors);
+  }
+}
 
-	          PPointT candidatePoint = nnStruct->points[candidatePIndex];
-            
-	          if (isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
-	            if (nNeighbors >= resultSize){
-		            resultSize = 2 * resultSize;
-		            result = (PPointT*)REALLOC(result, resultSize * sizeof(PPointT));
-	            }
-	            result[nNeighbors] = candidatePoint;
-	            nNeighbors++;
-	          }
-	        }else{
+// Examines, in <context>, the points of the bucket of the table
+// <table> with the bucket vector <firstBucketVector>
+// (<secondBucketVector>) (as for getTableGBucket), and the points of
+// the same bucket that were added after packing.
+inline void examineTableBucketsInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, IntT table, IntT nBucketVectorPieces, Uns32T firstBucketVector[], Uns32T secondBucketVector[], PPointT *(&result), IntT &resultSize, Int32T &nNeighbors){
+  GeneralizedPGBucket gbucket = getTableGBucket(nnStruct, table, nBucketVectorPieces, firstBucketVector, secondBucketVector, query, context->nBucketsInChains);
+  examineGBucketInContext(nnStruct, context, query, table, nnStruct->hashedBuckets[table], gbucket, result, resultSize, nNeighbors);
+  examineDeltaBucketInContext(nnStruct, context, query, table, nBucketVectorPieces, firstBucketVector, secondBucketVector, result, resultSize, nNeighbors);
+}
 
-	        }
-	      }
+inline bool isProbeStepCheaper(const MultiProbeStepT &a, const MultiProbeStepT &b){
+  return a.score < b.score;
+}
+
+// Inverted for std::push_heap/pop_heap (which keep the greatest
+// element on top): the top of context->probeHeap is the cheapest set.
+inline bool isProbeSetCostlier(const MultiProbeSetT &a, const MultiProbeSetT &b){
+  return a.score > b.score;
+}
+
+inline void pushProbeSet(PQueryContextT context, IntT &heapSize, LongUns64T steps, RealT score){
+  if (heapSize == context->sizeProbeHeap){
+    context->sizeProbeHeap = 2 * context->sizeProbeHeap;
+    FAILIF(NULL == (context->probeHeap = (MultiProbeSetT*)REALLOC(context->probeHeap, context->sizeProbeHeap * sizeof(MultiProbeSetT))));
+  }
+  context->probeHeap[heapSize].steps = steps;
+  context->probeHeap[heapSize].score = score;
+  heapSize++;
+  std::push_heap(context->probeHeap, context->probeHeap + heapSize, isProbeSetCostlier);
+}
+
+// Probes the nnStruct->nProbesPerTable perturbed buckets of the table
+// <table> nearest to <query> (multi-probe LSH, Lv et al., "Multi-Probe
+// LSH: Efficient Indexing for High-Dimensional Similarity Search"):
+// the <g> vector of the table is made of the <u> vectors
+// pieces[0..nPieces-1] of the query, and a perturbation moves some of
+// its coordinates to the adjacent slot below or above. The
+// perturbations are generated in the increasing order of their score
+// (the sum of the squared distances, in units of W, from the
+// projections of the query to the crossed slot boundaries), from the
+// MULTIPROBE_MAX_STEPS cheapest steps, with the shift/expand heap of
+// the paper.
+inline void probeTableInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, IntT table, IntT nPieces, IntT pieces[], PPointT *(&result), IntT &resultSize, Int32T &nNeighbors){
+  IntT length = nnStruct->hfTuplesLength;
+  IntT nCoordinates = nPieces * length;
+
+  // The steps of all the coordinates, the cheapest first.
+  MultiProbeStepT *steps = context->probeSteps;
+  for(IntT c = 0; c < nCoordinates; c++){
+    RealT fraction = context->pointULSHFractions[pieces[c / length]][c % length];
+    steps[2 * c].coordinate = c;
+    steps[2 * c].delta = -1;
+    steps[2 * c].score = SQR(fraction);
+    steps[2 * c + 1].coordinate = c;
+    steps[2 * c + 1].delta = 1;
+    steps[2 * c + 1].score = SQR(1 - fraction);
+  }
+  IntT nSteps = MIN(2 * nCoordinates, MULTIPROBE_MAX_STEPS);
+  std::partial_sort(steps, steps + nSteps, steps + 2 * nCoordinates, isProbeStepCheaper);
+
+  IntT heapSize = 0;
+  pushProbeSet(context, heapSize, 1, steps[0].score);
+  IntT nProbes = 0;
+  while (nProbes < nnStruct->nProbesPerTable && heapSize > 0 && !isQueryStopped(context)){
+    std::pop_heap(context->probeHeap, context->probeHeap + heapSize, isProbeSetCostlier);
+    heapSize--;
+    LongUns64T set = context->probeHeap[heapSize].steps;
+    RealT score = context->probeHeap[heapSize].score;
+
+    // The successors of <set>: shift replaces its last step <s> by
+    // s+1, expand adds s+1.
+    IntT last = 63 - __builtin_clzll(set);
+    if (last + 1 < nSteps){
+      LongUns64T next = (LongUns64T)1 << (last + 1);
+      pushProbeSet(context, heapSize, (set & ~((LongUns64T)1 << last)) | next, score - steps[last].score + steps[last + 1].score);
+      pushProbeSet(context, heapSize, set | next, score + steps[last + 1].score);
+    }
+
+    // Apply the steps of <set> to copies of the <u> vectors; a set
+    // that moves a coordinate both ways is not a bucket.
+    for(IntT p = 0; p < nPieces; p++){
+      memcpy(context->perturbedULSHVectors[p], context->pointULSHVectors[pieces[p]], length * sizeof(Uns32T));
+    }
+    BooleanT valid = TRUE;
+    for(LongUns64T remaining = set; remaining != 0 && valid; remaining &= remaining - 1){
+      MultiProbeStepT &step = steps[__builtin_ctzll(remaining)];
+      Uns32T &value = context->perturbedULSHVectors[step.coordinate / length][step.coordinate % length];
+      if (value != context->pointULSHVectors[pieces[step.coordinate / length]][step.coordinate % length]){
+	valid = FALSE;
       }
-      break;
-      default:
-      ASSERT(FALSE);
+      value += (Uns32T)step.delta;
     }
-    TIMEV_END(timeCycleBucket);
-    
-    
+    if (!valid){
+      continue;
+    }
+    nProbes++;
+    precomputeUHFsForULSHs(nnStruct, nnStruct->hashedBuckets[0], context->perturbedULSHVectors, context->perturbedHashes, 0, nPieces);
+    examineTableBucketsInContext(nnStruct, context, query, table, nPieces, context->perturbedHashes[0], nPieces == 2 ? context->perturbedHashes[1] : NULL, result, resultSize, nNeighbors);
   }
-  printf("%d ", nMarkedPoints);
-  num = nMarkedPoints; //printf("%d\n", nMarkedPoints);
-  //printf("%d\n",Pratio[num]);
+}
 
-  timingOn = oldTimingOn;
+// Ends the collision counting of the query of <context>: examines
+// the colliding points that context->ranking selects, the ones that
+// collide the most first (so that a candidate limit keeps them). A
+// query stopped by its deadline examines none; one stopped by its
+// table limit examines the points of the tables it looked up.
+inline void examineRankedCandidatesInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, PPointT *(&result), IntT &resultSize, Int32T &nNeighbors){
+  context->isCountingCollisions = FALSE;
+  Int32T *points = context->collidingPoints;
+  Uns16T *counts = context->collisionCounts;
+  IntT nSelected = 0;
+  for(IntT j = 0; j < context->nCollidingPoints; j++){
+    if (counts[points[j]] >= context->ranking.minCollisions){
+      points[nSelected++] = points[j];
+    }
+  }
+  auto collidesMore = [counts](Int32T a, Int32T b){ return counts[a] > counts[b]; };
+  if (context->ranking.nTopCandidates > 0 && nSelected > context->ranking.nTopCandidates){
+    std::nth_element(points, points + context->ranking.nTopCandidates, points + nSelected, collidesMore);
+    nSelected = context->ranking.nTopCandidates;
+  }
+  std::sort(points, points + nSelected, collidesMore);
+
+  // The selected points become the candidates (and the candidates
+  // vector becomes the one of the colliding points).
+  std::swap(context->candidates, context->collidingPoints);
+  std::swap(context->sizeCandidates, context->sizeCollidingPoints);
+  context->nCollidingPoints = 0;
+
+  BooleanT wasPartial = context->isPartial;
+  context->isPartial = FALSE;
+  resetVisitedPoints(context);
+  if (!isQueryStopped(context)){
+    examineCandidatesInContext(nnStruct, context, query, nSelected, result, resultSize, nNeighbors);
+  }
+  context->isPartial = context->isPartial || wasPartial;
+}
+
+// Starts the query <query> in <context>: resets the counters and the
+// visited points, and computes the <u> vectors of the query and their
+// hashes. The tables are then looked up in the order of
+// nextTableInContext.
+inline void beginQueryInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, int subdim){
+  // Check whether the vector <visitedEpochs> is still big enough
+  // (points may have been added since the context was created).
+  if (nnStruct->nPoints > context->sizeVisitedEpochs) {
+    context->sizeVisitedEpochs = 2 * nnStruct->nPoints;
+    FAILIF(NULL == (context->visitedEpochs = (Uns16T*)REALLOC(context->visitedEpochs, context->sizeVisitedEpochs * sizeof(Uns16T))));
+    memset(context->visitedEpochs, 0, context->sizeVisitedEpochs * sizeof(Uns16T));
+    context->epoch = 0;
+    FAILIF(NULL == (context->collisionCounts = (Uns16T*)REALLOC(context->collisionCounts, context->sizeVisitedEpochs * sizeof(Uns16T))));
+  }
+  resetVisitedPoints(context);
+  context->nExaminedPoints = 0;
+  context->nDistanceComputations = 0;
+  context->nBucketsInChains = 0;
+  context->isPartial = FALSE;
+  if (context->limits.maxTime > 0){
+    context->deadline = queryClock() + context->limits.maxTime;
+  }
+  context->isCountingCollisions = context->ranking.minCollisions > 1 || context->ranking.nTopCandidates > 0;
+  context->nCollidingPoints = 0;
+
+  for(IntT d = 0; d < nnStruct->dimension; d++){
+    context->reducedPoint[d] = query->coordinates[d];
+  }
+  for(IntT i = 0; i < nnStruct->nHFTuples; i++){
+    if (nnStruct->nProbesPerTable > 0) {
+      computeULSHWithFractions(nnStruct, i, context->reducedPoint, context->pointULSHVectors[i], context->pointULSHFractions[i], subdim);
+    } else {
+      computeULSH(nnStruct, i, context->reducedPoint, context->pointULSHVectors[i], subdim);
+    }
+  }
+  if (USE_SAME_UHASH_FUNCTIONS) {
+    precomputeUHFsForULSHs(nnStruct, nnStruct->hashedBuckets[0], context->pointULSHVectors, context->precomputedHashesOfULSHs, 0, nnStruct->nHFTuples);
+  }
+
+  context->nextTable = 0;
+  context->firstUComp = 0;
+  context->secondUComp = 1;
+}
+
+// Sets <table> to the next table that the query of <context> looks
+// up, and pieces[0..nPieces-1] to the <u> vectors that make its <g>
+// vector. Returns FALSE when the query is done: all the tables were
+// looked up, or the query stopped (see isQueryStopped; the table
+// limit stops it here).
+inline BooleanT nextTableInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, IntT &table, IntT &nPieces, IntT pieces[]){
+  table = context->nextTable;
+  if (table >= nnStruct->parameterL){
+    return FALSE;
+  }
+  if (context->limits.maxTables > 0 && table >= context->limits.maxTables){
+    context->isPartial = TRUE;
+  }
+  if (isQueryStopped(context)){
+    return FALSE;
+  }
+  context->nextTable++;
+  if (!nnStruct->useUfunctions) {
+    // Use usual <g> functions (truly independent; <g>s are precisly
+    // <u>s).
+    nPieces = 1;
+    pieces[0] = table;
+    pieces[1] = table;
+  } else {
+    // Use <u> functions (<g>s are pairs of <u> functions).
+    nPieces = 2;
+    pieces[0] = context->firstUComp;
+    pieces[1] = context->secondUComp;
+    context->secondUComp++;
+    if (context->secondUComp == nnStruct->nHFTuples) {
+      context->firstUComp++;
+      context->secondUComp = context->firstUComp + 1;
+    }
+  }
+  return TRUE;
+}
+
+// Ends the query of <context> (after its last table): with a
+// collision-count ranking, examines the selected candidates.
+inline void finishQueryInContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, PPointT *(&result), IntT &resultSize, Int32T &nNeighbors){
+  if (context->isCountingCollisions){
+    examineRankedCandidatesInContext(nnStruct, context, query, result, resultSize, nNeighbors);
+  }
+}
+
+// Looks up the buckets of <query> in the tables of <nnStruct> (and,
+// if nnStruct->nProbesPerTable > 0, the perturbed buckets of
+// probeTableInContext) and examines their points with
+// examineCandidateInContext (the R-near neighbors are appended to
+// <result>, or, if context->k > 0, kept in the k-NN heap of
+// <context>), or, with a collision-count ranking, counts their
+// collisions first (see examineRankedCandidatesInContext). Returns
+// the number of points appended to <result>.
+inline Int32T searchTablesWithContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, PPointT *(&result), IntT &resultSize, int subdim){
+  beginQueryInContext(nnStruct, context, query, subdim);
+  Uns32T **precomputedHashesOfULSHs = context->precomputedHashesOfULSHs;
+
+  Int32T nNeighbors = 0;
+  IntT table;
+  IntT nPieces;
+  IntT pieces[2];
+  while (nextTableInContext(nnStruct, context, table, nPieces, pieces)){
+    examineTableBucketsInContext(nnStruct, context, query, table, nPieces, precomputedHashesOfULSHs[pieces[0]], nPieces == 2 ? precomputedHashesOfULSHs[pieces[1]] : NULL, result, resultSize, nNeighbors);
+    if (nnStruct->nProbesPerTable > 0) {
+      probeTableInContext(nnStruct, context, query, table, nPieces, pieces, result, resultSize, nNeighbors);
+    }
+  }
+  finishQueryInContext(nnStruct, context, query, result, resultSize, nNeighbors);
+
+  return nNeighbors;
+}
+
+// Same as R2getNearNeighborsFromPRNearNeighborStruct, but all the
+// temporary vectors and counters of the query are the ones of
+// <context> (<nnStruct> is only read). The number of examined points
+// is left in context->nExaminedPoints. The query stops at the limits
+// context->limits, setting context->isPartial.
+Int32T R2getNearNeighborsWithContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, PPointT *(&result), IntT &resultSize, int subdim){
+  ASSERT(nnStruct != NULL);
+  ASSERT(context != NULL && context->nHFTuples == nnStruct->nHFTuples);
+  ASSERT(query != NULL);
+
+  if (result == NULL){
+    resultSize = RESULT_INIT_SIZE;
+    FAILIF(NULL == (result = (PPointT*)MALLOC(resultSize * sizeof(PPointT))));
+  }
+  context->k = 0;
+  return searchTablesWithContext(nnStruct, context, query, result, resultSize, subdim);
+}
+
+// Returns the (at most) <k> nearest neighbors of <query> among the
+// R-near neighbors that the tables of <nnStruct> report: they are
+// stored in <neighbors> (which has room for <k>) by increasing
+// distance, with their distance (not squared) in the field <real>.
+// The temporary vectors are the ones of <context> (see
+// R2getNearNeighborsWithContext).
+IntT R2getKNearestNeighborsWithContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, IntT k, PPointAndRealTStructT *neighbors, int subdim){
+  ASSERT(nnStruct != NULL);
+  ASSERT(context != NULL && context->nHFTuples == nnStruct->nHFTuples);
+  ASSERT(query != NULL && neighbors != NULL);
+  ASSERT(k > 0);
+
+  if (k > context->sizeNearestNeighbors){
+    context->sizeNearestNeighbors = k;
+    FAILIF(NULL == (context->nearestNeighbors = (PPointAndRealTStructT*)REALLOC(context->nearestNeighbors, context->sizeNearestNeighbors * sizeof(PPointAndRealTStructT))));
+  }
+  context->k = k;
+  context->nNearestNeighbors = 0;
+  // (no point is appended to <result> in a k-NN query)
+  PPointT *result = NULL;
+  IntT resultSize = 0;
+  searchTablesWithContext(nnStruct, context, query, result, resultSize, subdim);
+  context->k = 0;
+
+  IntT nNeighbors = context->nNearestNeighbors;
+  std::sort_heap(context->nearestNeighbors, context->nearestNeighbors + nNeighbors, isNearer);
+  for(IntT j = 0; j < nNeighbors; j++){
+    neighbors[j].ppoint = context->nearestNeighbors[j].ppoint;
+    neighbors[j].real = SQRT(context->nearestNeighbors[j].real);
+  }
+  return nNeighbors;
+}
+
+// Returns the list of near neighbors of the point <query> in the
+// structure <nnStruct> (FastLSH; see
+// FgetNearNeighborsFromPRNearNeighborStruct for the meaning of
+// <result> and <resultSize>). The query uses the QueryContextT of
+// <nnStruct>, so it is not thread-safe; see
+// R2getNearNeighborsBatch. <num> is set to the number of examined
+// points. The query stops at the limits of setQueryLimits (see
+// isLastQueryPartial).
+Int32T R2getNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct, PPointT query, PPointT *(&result), Int32T &resultSize, int &num, int subdim){
+  ASSERT(nnStruct != NULL);
+  ASSERT(query != NULL);
+  ASSERT(nnStruct->reducedPoint != NULL);
+  ASSERT(!nnStruct->useUfunctions || nnStruct->pointULSHVectors != NULL);
+
+  if (nnStruct->queryContext == NULL){
+    nnStruct->queryContext = newQueryContext(nnStruct);
+  }
+  PQueryContextT context = nnStruct->queryContext;
+
+  TIMEV_START(timeTotalBuckets);
+  Int32T nNeighbors = R2getNearNeighborsWithContext(nnStruct, context, query, result, resultSize, subdim);
   TIMEV_END(timeTotalBuckets);
 
-  // we need to clear the array nnStruct->nearPoints for the next query.
-  for(Int32T i = 0; i < nMarkedPoints; i++){
-    ASSERT(nnStruct->markedPoints[nnStruct->markedPointsIndeces[i]] == TRUE);
-    nnStruct->markedPoints[nnStruct->markedPointsIndeces[i]] = FALSE;
+  nOfDistComps += context->nDistanceComputations;
+  nBucketsInChains += context->nBucketsInChains;
+  printf("%d ", context->nExaminedPoints);
+  num = context->nExaminedPoints;
+  DPRINTF("nMarkedPoints: %d\n", context->nExaminedPoints);
+
+  return nNeighbors;
+}
+
+// Same as R2getKNearestNeighborsWithContext, with the QueryContextT
+// of <nnStruct> (as R2getNearNeighborsFromPRNearNeighborStruct). <num>
+// is set to the number of examined points.
+IntT R2getKNearestNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct, PPointT query, IntT k, PPointAndRealTStructT *neighbors, int &num, int subdim){
+  ASSERT(nnStruct != NULL);
+  if (nnStruct->queryContext == NULL){
+    nnStruct->queryContext = newQueryContext(nnStruct);
   }
-  DPRINTF("nMarkedPoints: %d\n", nMarkedPoints);
+  PQueryContextT context = nnStruct->queryContext;
+
+  TIMEV_START(timeTotalBuckets);
+  IntT nNeighbors = R2getKNearestNeighborsWithContext(nnStruct, context, query, k, neighbors, subdim);
+  TIMEV_END(timeTotalBuckets);
 
+  nOfDistComps += context->nDistanceComputations;
+  nBucketsInChains += context->nBucketsInChains;
+  num = context->nExaminedPoints;
   return nNeighbors;
 }
 
+// Starts the query <q> of an interleaved batch in the idle slot
+// <inFlight> (see InFlightQueryT).
+inline void startInFlightQuery(const RNearNeighborStructT *nnStruct, PInFlightQueryT inFlight, Int32T q, PPointT *queries, PPointT **results, IntT *resultSizes, int subdim){
+  if (results[q] == NULL){
+    resultSizes[q] = RESULT_INIT_SIZE;
+    FAILIF(NULL == (results[q] = (PPointT*)MALLOC(resultSizes[q] * sizeof(PPointT))));
+  }
+  inFlight->context->k = 0;
+  beginQueryInContext(nnStruct, inFlight->context, queries[q], subdim);
+  inFlight->query = q;
+  inFlight->nNeighbors = 0;
+  inFlight->state = IN_FLIGHT_NEXT_TABLE;
+}
+
+// Advances the query of the slot <inFlight> of an interleaved batch
+// by one stage: the stages of a table compute the key of the bucket
+// of the query, find its slot, find the bucket, and examine it (and
+// the delta bucket and the perturbed buckets of the table, without
+// interleaving), each reading what the previous one prefetched. When
+// the query is done, its results are stored as in
+// R2getNearNeighborsBatch and the slot becomes idle.
+inline void advanceInFlightQuery(const RNearNeighborStructT *nnStruct, PInFlightQueryT inFlight, PPointT *queries, PPointT **results, IntT *resultSizes, Int32T *nNeighbors, Int32T *nExaminedPoints, BooleanT *isPartial){
+  PQueryContextT context = inFlight->context;
+  Int32T q = inFlight->query;
+  Uns32T **precomputedHashesOfULSHs = context->precomputedHashesOfULSHs;
+  switch (inFlight->state){
+  case IN_FLIGHT_NEXT_TABLE:
+    if (!nextTableInContext(nnStruct, context, inFlight->table, inFlight->nPieces, inFlight->pieces)){
+      finishQueryInContext(nnStruct, context, queries[q], results[q], resultSizes[q], inFlight->nNeighbors);
+      nNeighbors[q] = inFlight->nNeighbors;
+      if (nExaminedPoints != NULL){
+	nExaminedPoints[q] = context->nExaminedPoints;
+      }
+      if (isPartial != NULL){
+	isPartial[q] = context->isPartial;
+      }
+      inFlight->state = IN_FLIGHT_IDLE;
+      break;
+    }
+    computeTableGBucketKey(nnStruct, inFlight->table, inFlight->nPieces, precomputedHashesOfULSHs[inFlight->pieces[0]], inFlight->nPieces == 2 ? precomputedHashesOfULSHs[inFlight->pieces[1]] : NULL, queries[q], inFlight->hIndex, inFlight->control1);
+    prefetchGBucketSlot(nnStruct->hashedBuckets[inFlight->table], inFlight->hIndex, inFlight->control1);
+    inFlight->state = IN_FLIGHT_CHAIN;
+    break;
+  case IN_FLIGHT_CHAIN:
+    prefetchGBucketChain(nnStruct->hashedBuckets[inFlight->table], inFlight->hIndex, inFlight->control1);
+    inFlight->state = IN_FLIGHT_BUCKET;
+    break;
+  case IN_FLIGHT_BUCKET:
+    inFlight->gbucket = getGBucketInSlot(nnStruct->hashedBuckets[inFlight->table], inFlight->hIndex, inFlight->control1, inFlight->context->nBucketsInChains);
+    prefetchGBucketPoints(nnStruct->hashedBuckets[inFlight->table], inFlight->gbucket);
+    inFlight->state = IN_FLIGHT_SCAN;
+    break;
+  case IN_FLIGHT_SCAN:
+    examineGBucketInContext(nnStruct, context, queries[q], inFlight->table, nnStruct->hashedBuckets[inFlight->table], inFlight->gbucket, results[q], resultSizes[q], inFlight->nNeighbors);
+    examineDeltaBucketInContext(nnStruct, context, queries[q], inFlight->table, inFlight->nPieces, precomputedHashesOfULSHs[inFlight->pieces[0]], inFlight->nPieces == 2 ? precomputedHashesOfULSHs[inFlight->pieces[1]] : NULL, results[q], resultSizes[q], inFlight->nNeighbors);
+    if (nnStruct->nProbesPerTable > 0) {
+      probeTableInContext(nnStruct, context, queries[q], inFlight->table, inFlight->nPieces, inFlight->pieces, results[q], resultSizes[q], inFlight->nNeighbors);
+    }
+    inFlight->state = IN_FLIGHT_NEXT_TABLE;
+    break;
+  default:
+    ASSERT(FALSE);
+  }
+}
+
+// Answers, on the calling thread, queries of the batch of
+// R2getNearNeighborsBatch (taken QUERY_BATCH_CHUNK at a time from
+// *<nextQuery>, shared by the threads) with <nInFlight> queries in
+// flight (see InFlightQueryT). The results of a query are the same
+// as the ones of R2getNearNeighborsWithContext.
+void answerQueriesInterleaved(const RNearNeighborStructT *nnStruct, IntT nInFlight, Int32T nQueries, Int32T *nextQuery, PPointT *queries, PPointT **results, IntT *resultSizes, Int32T *nNeighbors, Int32T *nExaminedPoints, BooleanT *isPartial, int subdim){
+  PInFlightQueryT inFlight;
+  FAILIF(NULL == (inFlight = (PInFlightQueryT)MALLOC(nInFlight * sizeof(InFlightQueryT))));
+  for(IntT s = 0; s < nInFlight; s++){
+    inFlight[s].context = newQueryContext(nnStruct);
+    inFlight[s].state = IN_FLIGHT_IDLE;
+  }
+
+  // The queries taken from the batch and not started yet.
+  Int32T first = 0;
+  Int32T end = 0;
+  BooleanT isBatchTaken = FALSE;
+  BooleanT isAnyInFlight = TRUE;
+  while (isAnyInFlight){
+    isAnyInFlight = FALSE;
+    for(IntT s = 0; s < nInFlight; s++){
+      if (inFlight[s].state == IN_FLIGHT_IDLE && !isBatchTaken){
+	if (first == end){
+	  first = __sync_fetch_and_add(nextQuery, QUERY_BATCH_CHUNK);
+	  end = MIN(first + QUERY_BATCH_CHUNK, nQueries);
+	  if (first >= nQueries){
+	    first = end;
+	    isBatchTaken = TRUE;
+	    continue;
+	  }
+	}
+	startInFlightQuery(nnStruct, inFlight + s, first, queries, results, resultSizes, subdim);
+	first++;
+      }
+      if (inFlight[s].state != IN_FLIGHT_IDLE){
+	advanceInFlightQuery(nnStruct, inFlight + s, queries, results, resultSizes, nNeighbors, nExaminedPoints, isPartial);
+	isAnyInFlight = TRUE;
+      }
+    }
+  }
+
+  for(IntT s = 0; s < nInFlight; s++){
+    freeQueryContext(inFlight[s].context);
+  }
+  FREE(inFlight);
+}
+
+// Answers the <nQueries> queries <queries> on <nnStruct> with
+// <nThreads> threads (the number of hardware threads if <nThreads> <=
+// 0), each with its own QueryContextT; the threads take the queries
+// QUERY_BATCH_CHUNK at a time. The near neighbors of the query <q> are
+// stored in <results>[q] (allocated or resized as <result> of
+// R2getNearNeighborsFromPRNearNeighborStruct, with size
+// <resultSizes>[q]), and their number in <nNeighbors>[q]. If
+// <nExaminedPoints> is not NULL, nExaminedPoints[q] is set to the
+// number of points examined by the query <q>, and if <isPartial> is
+// not NULL, isPartial[q] is set to whether a limit of
+// nnStruct->queryLimits stopped it. If <queryInterleaving> > 1, each
+// thread keeps that many queries in flight and interleaves their
+// bucket lookups (see answerQueriesInterleaved), at the cost of one
+// QueryContextT per query in flight. <nnStruct> must not be modified
+// during the call.
+void R2getNearNeighborsBatch(const RNearNeighborStructT *nnStruct, Int32T nQueries, PPointT *queries, PPointT **results, IntT *resultSizes, Int32T *nNeighbors, Int32T *nExaminedPoints, BooleanT *isPartial, IntT nThreads, int subdim){
+  ASSERT(nnStruct != NULL);
+  ASSERT(queries != NULL && results != NULL && resultSizes != NULL && nNeighbors != NULL);
+  if (nThreads <= 0){
+    nThreads = MAX((IntT)std::thread::hardware_concurrency(), 1);
+  }
+  nThreads = MIN(nThreads, MAX((nQueries + QUERY_BATCH_CHUNK - 1) / QUERY_BATCH_CHUNK, 1));
+
+  Int32T nextQuery = 0;
+  std::vector<std::thread> threads;
+  for(IntT t = 0; t < nThreads; t++){
+    threads.push_back(std::thread([=, &nextQuery](){
+      if (queryInterleaving > 1){
+	answerQueriesInterleaved(nnStruct, queryInterleaving, nQueries, &nextQuery, queries, results, resultSizes, nNeighbors, nExaminedPoints, isPartial, subdim);
+	return;
+      }
+      PQueryContextT context = newQueryContext(nnStruct);
+      Int32T first;
+      while ((first = __sync_fetch_and_add(&nextQuery, QUERY_BATCH_CHUNK)) < nQueries){
+	for(Int32T q = first; q < MIN(first + QUERY_BATCH_CHUNK, nQueries); q++){
+	  nNeighbors[q] = R2getNearNeighborsWithContext(nnStruct, context, queries[q], results[q], resultSizes[q], subdim);
+	  if (nExaminedPoints != NULL){
+	    nExaminedPoints[q] = context->nExaminedPoints;
+	  }
+	  if (isPartial != NULL){
+	    isPartial[q] = context->isPartial;
+	  }
+	}
+      }
+      freeQueryContext(context);
+    }));
+  }
+  for(IntT t = 0; t < nThreads; t++){
+    threads[t].join();
+  }
+}
+
+// Orders the BucketVisitTs of a bucket-major batch by bucket (and by
+// query within a bucket).
+inline bool isBucketVisitBefore(const BucketVisitT &a, const BucketVisitT &b){
+  if (a.table != b.table){
+    return a.table < b.table;
+  }
+  if (a.address != b.address){
+    return std::less<const void*>()(a.address, b.address);
+  }
+  return a.query < b.query;
+}
+
+// Examines the point <candidatePoint> for the <nQueries> queries
+// batchQueries[0..nQueries-1] (<nQueries> <= DOT_PRODUCTS_BLOCK, with
+// coordinates <queryCoordinates> and squared lengths
+// <querySqrLengths>) of a bucket-major batch: the squared distances are computed from the
+// dot products (one column of the product of the matrix of the
+// queries by the one of the candidates; see dotProducts), and the
+// ones within the rounding error of R^2 are checked exactly (so a
+// query reports the same points as R2getNearNeighborsWithContext).
+inline void examineCandidateForQueries(const RNearNeighborStructT *nnStruct, IntT nQueries, Int32T *batchQueries, const RealT *const *queryCoordinates, RealT *querySqrLengths, PPointT candidatePoint, PPointT **results, IntT *resultSizes, Int32T *nNeighbors){
+  IntT dimension = nnStruct->dimension;
+#ifdef USE_L1_DISTANCE
+  for(IntT j = 0; j < nQueries; j++){
+    if (sqrDistanceBounded(dimension, queryCoordinates[j], candidatePoint->coordinates, nnStruct->parameterR2) <= nnStruct->parameterR2){
+#else
+  RealT products[DOT_PRODUCTS_BLOCK];
+  RealT candidateSqrLength;
+  dotProducts(dimension, nQueries, queryCoordinates, candidatePoint->coordinates, products, candidateSqrLength);
+  for(IntT j = 0; j < nQueries; j++){
+    RealT sqrLengths = querySqrLengths[j] + candidateSqrLength;
+    RealT roundingError = dimension * std::numeric_limits<RealT>::epsilon() * sqrLengths;
+    if (sqrLengths - 2 * products[j] <= nnStruct->parameterR2 + roundingError &&
+	sqrDistanceBounded(dimension, queryCoordinates[j], candidatePoint->coordinates, nnStruct->parameterR2) <= nnStruct->parameterR2){
+#endif
+      Int32T q = batchQueries[j];
+      if (nNeighbors[q] >= resultSizes[q]){
+	resultSizes[q] = 2 * resultSizes[q];
+	FAILIF(NULL == (results[q] = (PPointT*)REALLOC(results[q], resultSizes[q] * sizeof(PPointT))));
+      }
+      results[q][nNeighbors[q]++] = candidatePoint;
+    }
+  }
+}
+
+// Answers the <nQueries> queries <queries> on <nnStruct> (as
+// R2getNearNeighborsBatch, on one thread) bucket by bucket rather than
+// query by query: first the buckets that the queries look up (with
+// their multi-probe buckets) are collected and grouped, and then the
+// points of each bucket are read once for all the queries that looked
+// it up, DOT_PRODUCTS_BLOCK queries at a time. This pays off when many
+// queries fall in the same buckets. The queries are taken in groups
+// whose bit vectors of the examined points (one per query) fit in
+// BUCKET_MAJOR_VISITED_BYTES. A query reports the same points as
+// R2getNearNeighborsWithContext (in another order). The limits and the
+// collision-count ranking of <nnStruct> do not apply.
+void R2getNearNeighborsBatchBucketMajor(const RNearNeighborStructT *nnStruct, Int32T nQueries, PPointT *queries, PPointT **results, IntT *resultSizes, Int32T *nNeighbors, Int32T *nExaminedPoints, int subdim){
+  ASSERT(nnStruct != NULL);
+  ASSERT(queries != NULL && results != NULL && resultSizes != NULL && nNeighbors != NULL);
+
+  PQueryContextT context = newQueryContext(nnStruct);
+  context->limits.maxCandidates = 0;
+  context->limits.maxTables = 0;
+  context->limits.maxTime = 0;
+  context->ranking.minCollisions = 0;
+  context->ranking.nTopCandidates = 0;
+  context->isCollectingBuckets = TRUE;
+
+  IntT nVisitedWords = (nnStruct->nPoints + 63) / 64;
+  Int32T nGroupQueries = MAX(MIN((MemVarT)nQueries, (MemVarT)(BUCKET_MAJOR_VISITED_BYTES / (MAX(nVisitedWords, 1) * sizeof(LongUns64T)))), 1);
+  LongUns64T *visitedBits;
+  FAILIF(NULL == (visitedBits = (LongUns64T*)MALLOC((MemVarT)nGroupQueries * nVisitedWords * sizeof(LongUns64T))));
+  RealT *querySqrLengths;
+  FAILIF(NULL == (querySqrLengths = (RealT*)MALLOC(nGroupQueries * sizeof(RealT))));
+  context->sizeBucketVisits = nGroupQueries * nnStruct->parameterL;
+  FAILIF(NULL == (context->bucketVisits = (BucketVisitT*)MALLOC(context->sizeBucketVisits * sizeof(BucketVisitT))));
+
+  IntT pointDistance = queryPrefetchDistance;
+  IntT coordinatesBytes = MIN(nnStruct->dimension, DISTANCE_BLOCK_SIZE) * sizeof(RealT);
+  for(Int32T firstQuery = 0; firstQuery < nQueries; firstQuery += nGroupQueries){
+    Int32T lastQuery = MIN(firstQuery + nGroupQueries, nQueries);
+
+    // Collect the buckets of the queries of the group.
+    context->nBucketVisits = 0;
+    for(Int32T q = firstQuery; q < lastQuery; q++){
+      if (results[q] == NULL){
+	resultSizes[q] = RESULT_INIT_SIZE;
+	FAILIF(NULL == (results[q] = (PPointT*)MALLOC(resultSizes[q] * sizeof(PPointT))));
+      }
+      nNeighbors[q] = 0;
+      if (nExaminedPoints != NULL){
+	nExaminedPoints[q] = 0;
+      }
+      RealT sqrLength = 0;
+      for(IntT d = 0; d < nnStruct->dimension; d++){
+	sqrLength += SQR(queries[q]->coordinates[d]);
+      }
+      querySqrLengths[q - firstQuery] = sqrLength;
+      context->collectingQuery = q;
+      searchTablesWithContext(nnStruct, context, queries[q], results[q], resultSizes[q], subdim);
+    }
+    BucketVisitT *visits = context->bucketVisits;
+    IntT nVisits = context->nBucketVisits;
+    std::sort(visits, visits + nVisits, isBucketVisitBefore);
+    memset(visitedBits, 0, (MemVarT)(lastQuery - firstQuery) * nVisitedWords * sizeof(LongUns64T));
+
+    // Scan each bucket once for all its queries.
+    for(IntT first = 0; first < nVisits; ){
+      IntT last = first + 1;
+      while (last < nVisits && visits[last].table == visits[first].table && visits[last].address == visits[first].address){
+	last++;
+      }
+      IntT table = visits[first].table;
+      PUHashStructureT uhash = table < nnStruct->parameterL ? nnStruct->hashedBuckets[table] : nnStruct->deltaBuckets[table - nnStruct->parameterL];
+      IntT nCandidates = decodeGBucketInContext(nnStruct, context, uhash, visits[first].gbucket);
+      Int32T *candidates = context->candidates;
+
+      for(IntT block = first; block < last; block += DOT_PRODUCTS_BLOCK){
+	IntT nBlockQueries = MIN(last - block, DOT_PRODUCTS_BLOCK);
+	for(IntT c = 0; c < nCandidates; c++){
+	  if (pointDistance > 0 && c + pointDistance < nCandidates){
+	    char *coordinates = (char*)nnStruct->points[candidates[c + pointDistance]]->coordinates;
+	    for(IntT b = 0; b < coordinatesBytes; b += 64){
+	      __builtin_prefetch(coordinates + b);
+	    }
+	  }
+	  Int32T candidatePIndex = candidates[c];
+	  // The queries of the block that did not examine the candidate
+	  // yet (in the bucket of another table).
+	  IntT nNewQueries = 0;
+	  Int32T newQueries[DOT_PRODUCTS_BLOCK];
+	  const RealT *queryCoordinates[DOT_PRODUCTS_BLOCK];
+	  RealT newSqrLengths[DOT_PRODUCTS_BLOCK];
+	  for(IntT j = 0; j < nBlockQueries; j++){
+	    Int32T q = visits[block + j].query;
+	    LongUns64T *word = visitedBits + (MemVarT)(q - firstQuery) * nVisitedWords + candidatePIndex / 64;
+	    LongUns64T bit = (LongUns64T)1 << (candidatePIndex % 64);
+	    if ((*word & bit) == 0){
+	      *word |= bit;
+	      newQueries[nNewQueries] = q;
+	      queryCoordinates[nNewQueries] = queries[q]->coordinates;
+	      newSqrLengths[nNewQueries] = querySqrLengths[q - firstQuery];
+	      nNewQueries++;
+	      if (nExaminedPoints != NULL){
+		nExaminedPoints[q]++;
+	      }
+	    }
+	  }
+	  if (nNewQueries > 0 && !IS_POINT_DELETED(nnStruct, candidatePIndex) && nnStruct->reportingResult){
+	    examineCandidateForQueries(nnStruct, nNewQueries, newQueries, queryCoordinates, newSqrLengths, nnStruct->points[candidatePIndex], results, resultSizes, nNeighbors);
+	  }
+	}
+      }
+      first = last;
+    }
+  }
+
+  FREE(visitedBits);
+  FREE(querySqrLengths);
+  freeQueryContext(context);
+}
+
 Int32T getNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct, PPointT query, PPointT *(&result), Int32T &resultSize, int &num){
   ASSERT(nnStruct != NULL);
   ASSERT(query != NULL);
@@ -1504,10 +3519,10 @@ Int32T getNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
     if (!nnStruct->useUfunctions) {
       // Use usual <g> functions (truly independent; <g>s are precisly
       // <u>s).
-      gbucket = getGBucket(nnStruct->hashedBuckets[i], 1, precomputedHashesOfULSHs[i], NULL);
+      gbucket = getTableGBucket(nnStruct, i, 1, precomputedHashesOfULSHs[i], NULL, query, nBucketsInChains);
     } else {
         // Use <u> functions (<g>s are pairs of <u> functions).
-        gbucket = getGBucket(nnStruct->hashedBuckets[i], 2, precomputedHashesOfULSHs[firstUComp], precomputedHashesOfULSHs[secondUComp]);
+        gbucket = getTableGBucket(nnStruct, i, 2, precomputedHashesOfULSHs[firstUComp], precomputedHashesOfULSHs[secondUComp], query, nBucketsInChains);
 
         // compute what is the next pair of <u> functions.
         secondUComp++;
@@ -1537,7 +3552,7 @@ Int32T getNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
 	        //TIMEV_START(timeDistanceComputation);
 	        Int32T candidatePIndex = bucketEntry->pointIndex;
 	        PPointT candidatePoint = nnStruct->points[candidatePIndex];
-	        if (isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
+	        if (!IS_POINT_DELETED(nnStruct, candidatePIndex) && isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
 	          //TIMEV_END(timeDistanceComputation);
 	          if (nnStruct->markedPoints[candidatePIndex] == FALSE) {
 	            //TIMEV_START(timeResultStoring);
@@ -1610,7 +3625,7 @@ Int32T getNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
 	          //CR_ASSERT(hybridPoint->point.bucketLength == 0);
 	          index = index + offset;
 	        }
-	        Int32T candidatePIndex = (hybridPoint + index)->point.pointIndex;
+	        Int32T candidatePIndex = hybridEntryPointIndex(nnStruct->hashedBuckets[i], hybridPoint + index);
 	        CR_ASSERT(candidatePIndex >= 0 && candidatePIndex < nnStruct->nPoints);
 	        done = (hybridPoint + index)->point.isLastPoint == 1 ? TRUE : FALSE;
 	        index++;
@@ -1624,7 +3639,7 @@ Int32T getNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
 	          nMarkedPoints++;
 
 	          PPointT candidatePoint = nnStruct->points[candidatePIndex];
-	          if (isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
+	          if (!IS_POINT_DELETED(nnStruct, candidatePIndex) && isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
 	            //if (nnStruct->markedPoints[candidatePIndex] == FALSE) {
 	            // a new R-NN point was found (not yet in <result>).
 	            //TIMEV_START(timeResultStoring);
@@ -1648,6 +3663,33 @@ Int32T getNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
 	    }
     }
       break;
+    case HT_BUCKET_DIRECTORY:
+    case HT_COMPRESSED_DIRECTORY:
+    case HT_PERFECT_HASH:
+      if (gbucket.directoryGBucket != NULL){
+	DirectoryBucketReaderT reader;
+	initDirectoryBucketReader(nnStruct->hashedBuckets[i], gbucket.directoryGBucket, reader);
+	for(Uns32T j = 0; j < gbucket.directoryGBucket->length; j++){
+	  Int32T candidatePIndex = nextDirectoryBucketPoint(reader);
+	  CR_ASSERT(candidatePIndex >= 0 && candidatePIndex < nnStruct->nPoints);
+	  if (nnStruct->markedPoints[candidatePIndex] == FALSE){
+	    nnStruct->markedPointsIndeces[nMarkedPoints] = candidatePIndex;
+	    nnStruct->markedPoints[candidatePIndex] = TRUE;
+	    nMarkedPoints++;
+
+	    PPointT candidatePoint = nnStruct->points[candidatePIndex];
+	    if (!IS_POINT_DELETED(nnStruct, candidatePIndex) && isDistanceSqrLeq(nnStruct->dimension, point, candidatePoint, nnStruct->parameterR2) && nnStruct->reportingResult){
+	      if (nNeighbors >= resultSize){
+		resultSize = 2 * resultSize;
+		result = (PPointT*)REALLOC(result, resultSize * sizeof(PPointT));
+	      }
+	      result[nNeighbors] = candidatePoint;
+	      nNeighbors++;
+	    }
+	  }
+	}
+      }
+      break;
     default:
       ASSERT(FALSE);
     }
@@ -38,6 +38,46 @@
 // The size of the initial result array.
 #define RESULT_INIT_SIZE 8
 
+// Points inserted into a structure with packed tables (see
+// IS_PACKED_TYPE_HT) are kept in per-table delta tables until the
+// delta holds DELTA_MERGE_RATIO * nPoints points (but at least
+// DELTA_MIN_MERGE_SIZE); then the delta is merged into the packed
+// tables.
+#define DELTA_MERGE_RATIO 0.125
+#define DELTA_MIN_MERGE_SIZE 1024
+
+// The packed tables are compacted (rewritten without the deleted
+// points) once the deleted points that are still in the tables exceed
+// TOMBSTONE_COMPACTION_RATIO * nPoints.
+#define TOMBSTONE_COMPACTION_RATIO 0.1
+
+// The policies for the heavy buckets (the buckets with more than
+// <heavyBucketThreshold> points) of the packed tables, applied every
+// time a table is packed: keep them as they are; keep only their
+// first <heavyBucketThreshold> points; keep a random sample of
+// <heavyBucketThreshold> of their points; or split them with one more
+// LSH function (an adaptive k: the points of a split bucket go to
+// child buckets in the same slot, keyed by the value of the extra
+// function, and queries that hit a split bucket look up their child).
+#define HEAVY_BUCKET_KEEP 0
+#define HEAVY_BUCKET_CAP 1
+#define HEAVY_BUCKET_SAMPLE 2
+#define HEAVY_BUCKET_SPLIT 3
+
+// The families of universal hash functions of the precomputed hashes
+// of the <u> functions: ((a.u) mod UH_PRIME_DEFAULT), or the
+// multiply-shift ((a.u) mod 2^64) >> 32 with 64-bit <a>s, which needs
+// no reduction and is computed with SIMD (see
+// precomputeUHFsForULSHs).
+#define UHF_MOD_PRIME 0
+#define UHF_MULTIPLY_SHIFT 1
+
+// The number of Uns32T words of a bitmap with one bit per point.
+#define N_WORDS_FOR_POINTS_BITMAP(nPoints) (((nPoints) + 31) / 32)
+
+// Whether the point with index <p> of <nnStruct> was deleted.
+#define IS_POINT_DELETED(nnStruct, p) (((nnStruct)->deletedPoints[(p) >> 5] >> ((p) & 31)) & 1U)
+
 // A function drawn from the locality-sensitive family of hash functions.
 typedef struct _LSHFunctionT {
   RealT *a;
@@ -75,14 +115,259 @@ typedef struct _RNNParametersT {
   // The type of the hash table used for storing the buckets (of the
   // same <g> function).
   IntT typeHT;
+
+  // The number of slots of each hash table (0 means the number of
+  // points). Powers of 2 make the slot computation a mask.
+  Int32T hashTableSize;
+
+  // The policy for the heavy buckets (HEAVY_BUCKET_*) and the number
+  // of points above which a bucket is heavy.
+  IntT heavyBucketPolicy;
+  Int32T heavyBucketThreshold;
+
+  // The family of universal hash functions (UHF_MOD_PRIME or
+  // UHF_MULTIPLY_SHIFT).
+  IntT uhfType;
+
+  // The placement of the large regions of the tables (a combination
+  // of the LARGE_REGION_* flags).
+  IntT memoryPlacement;
+
+  // The number of perturbed buckets that a query probes in each table
+  // besides its own bucket (multi-probe LSH; 0 disables it; see
+  // MULTIPROBE_MAX_PROBES).
+  IntT nProbesPerTable;
+
+  // If > 0, the bytes that the construction may allocate at most (see
+  // RinitLSH_WithDataSetMemoryBounded); 0 for no bound.
+  MemVarT peakBuildMemory;
+
+  // If > 1, the number of shards of the points whose tables are built
+  // in parallel (see RinitLSH_WithDataSetSharded).
+  IntT nBuildShards;
 } RNNParametersT, *PRNNParametersT;
 
+// What the heavy-bucket policy did to one table, when the table was
+// last packed.
+typedef struct _HeavyBucketStatsT {
+  // The number of heavy buckets, and the number of points and the
+  // slot of the largest bucket, before the policy was applied.
+  Int32T nHeavyBuckets;
+  Int32T largestBucket;
+  Uns32T largestBucketSlot;
+  // The points dropped by HEAVY_BUCKET_CAP or HEAVY_BUCKET_SAMPLE.
+  Int32T nRemovedPoints;
+  // The buckets split by HEAVY_BUCKET_SPLIT (so far), and the heavy
+  // buckets that could not be split because the extra function has
+  // the same value on all their points (this includes the children of
+  // split buckets that are still heavy: a bucket is split one level
+  // only).
+  Int32T nSplitBuckets;
+  Int32T nUnsplittableBuckets;
+  // The heavy buckets not split because the control value of one of
+  // their children is already used in their slot (see
+  // applyHeavyBucketPolicy).
+  Int32T nSplitCollisions;
+} HeavyBucketStatsT;
+
+// The most perturbed buckets probed per table (a larger
+// RNNParametersT.nProbesPerTable is clamped to it).
+#define MULTIPROBE_MAX_PROBES 1024
+// The most perturbation steps (a coordinate of the <g> function moved
+// to the adjacent slot below or above) considered by the probe
+// generation: the ones nearest to the query.
+#define MULTIPROBE_MAX_STEPS 64
+
+// A perturbation step of a multi-probe query: the coordinate
+// <coordinate> of the <g> vector moved by <delta> (-1 or +1), and the
+// square of the distance (in units of W) from the query's projection
+// to the crossed slot boundary.
+typedef struct _MultiProbeStepT {
+  IntT coordinate;
+  Int32T delta;
+  RealT score;
+} MultiProbeStepT;
+
+// A set of perturbation steps (bit <s> is step <s> in the sorted
+// steps) and its score (the sum of the scores of the steps).
+typedef struct _MultiProbeSetT {
+  LongUns64T steps;
+  RealT score;
+} MultiProbeSetT;
+
+// The limits of a query (0 means no limit): the most points it
+// examines <maxCandidates>, the most tables it looks up <maxTables>
+// (each with its multi-probe buckets), and the most time it takes
+// <maxTime> (in seconds). A query that hits a limit stops and returns
+// the neighbors found so far, with QueryContextT.isPartial set.
+typedef struct _QueryLimitsT {
+  Int32T maxCandidates;
+  IntT maxTables;
+  TimeVarT maxTime;
+} QueryLimitsT;
+
+// The collision-count ranking of the candidates of a query (as in
+// C2LSH): the query first counts, for each candidate, the buckets it
+// looked up (of different tables) that contain the candidate, and then
+// computes the distance only to the candidates that collide at least
+// <minCollisions> times, and, if <nTopCandidates> > 0, only to the
+// <nTopCandidates> of them that collide the most. With <minCollisions>
+// <= 1 and <nTopCandidates> == 0 (the default), there is no ranking:
+// the candidates are verified as the buckets are scanned. With a
+// ranking, the examined points (QueryContextT.nExaminedPoints and
+// QueryLimitsT.maxCandidates) are the verified candidates only.
+typedef struct _CollisionRankingT {
+  IntT minCollisions;
+  Int32T nTopCandidates;
+} CollisionRankingT;
+
+// A bucket looked up by a query of a bucket-major batch (see
+// R2getNearNeighborsBatchBucketMajor): the bucket <gbucket> (at
+// <address>) of the table <table> (or, if <table> >= L, of the delta
+// buckets of the table <table> - L), for the query <query>.
+typedef struct _BucketVisitT {
+  IntT table;
+  const void *address;
+  GeneralizedPGBucket gbucket;
+  Int32T query;
+} BucketVisitT;
+
+// The temporary vectors and the counters of the queries of one
+// thread. The R2 query functions that take a QueryContextT write only
+// to it (never to the RNearNeighborStructT nor to the global timers
+// and counters), so several threads, each with its own context, may
+// query the same RNearNeighborStructT at the same time (as long as no
+// thread modifies it). The vectors <pointULSHVectors>,
+// <precomputedHashesOfULSHs> and <reducedPoint> are as the ones of the
+// same names in RNearNeighborStructT.
+typedef struct _QueryContextT {
+  IntT nHFTuples;
+  Uns32T **pointULSHVectors;
+  Uns32T **precomputedHashesOfULSHs;
+  RealT *reducedPoint;
+
+  // For the multi-probe queries: the fractional parts of the
+  // projections of the query (pointULSHVectors[i][j] is the floor of
+  // the projection, pointULSHFractions[i][j] what the floor removed),
+  // the perturbation steps of the current table, the heap of the
+  // probe generation, and the perturbed <u> vectors (2 at most, with
+  // their precomputed hashes) of the current probe.
+  RealT **pointULSHFractions;
+  MultiProbeStepT *probeSteps;
+  MultiProbeSetT *probeHeap;
+  IntT sizeProbeHeap;
+  Uns32T *perturbedULSHVectors[2];
+  Uns32T *perturbedHashes[2];
+
+  // The table search of the current query (see nextTableInContext):
+  // the next table, and the <u> vectors of its <g> vector.
+  IntT nextTable;
+  IntT firstUComp;
+  IntT secondUComp;
+
+  // The points examined by the current query: visitedEpochs[i] ==
+  // <epoch> iff the point <i> was examined already. A query starts by
+  // incrementing <epoch>; the stamps are cleared only when it wraps
+  // around.
+  Uns16T *visitedEpochs;
+  Uns16T epoch;
+  // the size of <visitedEpochs> and of <collisionCounts> (they grow
+  // with the number of points of the structure queried).
+  IntT sizeVisitedEpochs;
+
+  // For the collision-count ranking (see CollisionRankingT): the
+  // ranking of the queries, and, while a query counts the collisions,
+  // the number of collisions of each point (valid for the points
+  // stamped by <visitedEpochs>) and the distinct points found so far.
+  CollisionRankingT ranking;
+  BooleanT isCountingCollisions;
+  Uns16T *collisionCounts;
+  Int32T *collidingPoints;
+  IntT nCollidingPoints;
+  IntT sizeCollidingPoints;
+
+  // The point indices of the packed bucket being examined (decoded
+  // before the distances are computed, so that the points can be
+  // prefetched ahead; see queryPrefetchDistance).
+  Int32T *candidates;
+  IntT sizeCandidates;
+
+  // For the k-NN queries (R2getKNearestNeighborsWithContext; <k> is 0
+  // otherwise): the (at most) <k> nearest R-near neighbors found so
+  // far, as a max-heap on the squared distance (in the field <real>).
+  IntT k;
+  PPointAndRealTStructT *nearestNeighbors;
+  IntT nNearestNeighbors;
+  // the size of <nearestNeighbors>.
+  IntT sizeNearestNeighbors;
+
+  // For the bucket-major batches: while <isCollectingBuckets>, the
+  // buckets that a query looks up are appended (for the query
+  // <collectingQuery>) to <bucketVisits> instead of being scanned.
+  BooleanT isCollectingBuckets;
+  Int32T collectingQuery;
+  BucketVisitT *bucketVisits;
+  IntT nBucketVisits;
+  IntT sizeBucketVisits;
+
+  // The limits of the queries (initially the ones of the
+  // RNearNeighborStructT, see setQueryLimits; they may be changed
+  // between two queries), the deadline of the current query (in the
+  // time of queryClock), and whether a limit stopped the last query.
+  QueryLimitsT limits;
+  TimeVarT deadline;
+  BooleanT isPartial;
+
+  // The counters of the last query: the number of examined points,
+  // of distance computations, and of buckets passed over in the
+  // chains of the HT_LINKED_LIST tables (as nBucketsInChains).
+  Int32T nExaminedPoints;
+  IntT nDistanceComputations;
+  IntT nBucketsInChains;
+} QueryContextT, *PQueryContextT;
+
+// The stages of a query of an interleaved batch (see
+// InFlightQueryT): each one ends with a prefetch of what the next one
+// reads.
+#define IN_FLIGHT_IDLE 0
+#define IN_FLIGHT_NEXT_TABLE 1
+#define IN_FLIGHT_CHAIN 2
+#define IN_FLIGHT_BUCKET 3
+#define IN_FLIGHT_SCAN 4
+
+// A query in flight in an interleaved batch (see
+// R2getNearNeighborsBatch): a thread keeps <queryInterleaving> of
+// them, each with its own QueryContextT, and advances them stage by
+// stage in turn, so that the loads of the lookup of a query overlap
+// with the work of the others.
+typedef struct _InFlightQueryT {
+  PQueryContextT context;
+  // The index of the query in the batch, and its stage (one of
+  // IN_FLIGHT_*).
+  Int32T query;
+  IntT state;
+  // The table being looked up, the <u> vectors of its <g> vector, the
+  // key of the bucket of the query and (from IN_FLIGHT_SCAN) the
+  // bucket.
+  IntT table;
+  IntT nPieces;
+  IntT pieces[2];
+  Uns32T hIndex;
+  Uns32T control1;
+  GeneralizedPGBucket gbucket;
+  // The number of near neighbors found so far.
+  Int32T nNeighbors;
+} InFlightQueryT, *PInFlightQueryT;
+
 typedef struct _RNearNeighborStructT {
   IntT dimension; // dimension of points.
   IntT parameterK; // parameter K of the algorithm.
   IntT parameterL; // parameter L of the algorithm.
   RealT parameterW; // parameter W of the algorithm.
   IntT parameterT; // parameter T of the algorithm.
+  // The number of perturbed buckets probed per table (0 without
+  // multi-probe).
+  IntT nProbesPerTable;
   RealT parameterR; // parameter R of the algorithm.
   RealT parameterR2; // = parameterR^2
 
@@ -139,10 +424,65 @@ typedef struct _RNearNeighborStructT {
   // (to be used by the bucket hashing module).
   Uns32T **precomputedHashesOfULSHs;
 
+  // The family of the universal hash functions of
+  // <precomputedHashesOfULSHs> (UHF_MOD_PRIME or UHF_MULTIPLY_SHIFT).
+  // For UHF_MULTIPLY_SHIFT, <multiplyShiftA> holds the 64-bit
+  // coefficients of the main and of the control hash function,
+  // interleaved (the coefficients of the position <i> of the bucket
+  // vector are multiplyShiftA[2*i] and multiplyShiftA[2*i+1]).
+  IntT uhfType;
+  LongUns64T *multiplyShiftA;
+
+  // The placement of the large regions of the tables (see
+  // RNNParametersT); the model tables of the builders carry it to the
+  // packed tables.
+  IntT memoryPlacement;
+
   // The set of non-empty buckets (which are hashed using
   // PUHashStructureT).
   PUHashStructureT *hashedBuckets;
 
+  // The points added after the packed tables were
+  // packed. deltaBuckets[i] is a HT_LINKED_LIST table with the same
+  // hash functions as hashedBuckets[i]; queries scan both. The points
+  // in the delta are always the last <nDeltaPoints> points of
+  // <points>. <deltaHashes> keeps their precomputed hashes
+  // (nHFTuples * N_PRECOMPUTED_HASHES_NEEDED words per point) for the
+  // merge. <deltaBuckets> is NULL when there is no delta.
+  PUHashStructureT *deltaBuckets;
+  Uns32T *deltaHashes;
+  Int32T nDeltaPoints;
+  // The number of points the delta can hold before being merged.
+  Int32T deltaCapacity;
+
+  // Bitmap of the deleted points (tombstones): bit p%32 of word p/32
+  // is set iff the point <p> was deleted. It has room for
+  // <pointsArraySize> points. Deleted points are skipped by the
+  // queries and are removed from the tables by the compaction.
+  Uns32T *deletedPoints;
+  Int32T nDeletedPoints;
+  // The number of deleted points that may still be in the tables
+  // (i.e., deleted before the last completed compaction started).
+  Int32T nDeletedPointsInTables;
+  // The next table to compact when a compaction is in progress, or -1
+  // otherwise. <nDeletedAtCompactionStart> is the value of
+  // <nDeletedPointsInTables> when the compaction started.
+  IntT nextTableToCompact;
+  Int32T nDeletedAtCompactionStart;
+
+  // The heavy-bucket policy (see HEAVY_BUCKET_KEEP) and its
+  // statistics for each of the <parameterL> tables (NULL for
+  // HEAVY_BUCKET_KEEP).
+  IntT heavyBucketPolicy;
+  Int32T heavyBucketThreshold;
+  HeavyBucketStatsT *heavyBucketStats;
+  // For HEAVY_BUCKET_SPLIT: the extra LSH function of each table, and
+  // the sorted keys (slot << 32 | control value) of the split buckets
+  // of each table.
+  LSHFunctionT *heavySplitFunctions;
+  LongUns64T **heavySplitKeys;
+  Int32T *nHeavySplitKeys;
+
 
   // ***
   // The following vectors are used only for temporary operations
@@ -167,8 +507,45 @@ typedef struct _RNearNeighborStructT {
   Int32T *markedPointsIndeces;
   // the size of <markedPoints> and of <markedPointsIndeces>
   IntT sizeMarkedPoints;
+
+  // The context of the queries of
+  // R2getNearNeighborsFromPRNearNeighborStruct (created by the first
+  // such query).
+  PQueryContextT queryContext;
+  // The limits of the queries (see setQueryLimits).
+  QueryLimitsT queryLimits;
+  // The collision-count ranking of the queries (see
+  // setCollisionRanking).
+  CollisionRankingT collisionRanking;
 } RNearNeighborStructT, *PRNearNeighborStructT;
 
+
+// The number of queries a thread of R2getNearNeighborsBatch takes at
+// once from the batch.
+#define QUERY_BATCH_CHUNK 8
+
+// How many candidates of a bucket a query with a time limit examines
+// between two checks of its deadline (a power of 2).
+#define QUERY_DEADLINE_CHECK_INTERVAL 256
+
+// The most memory of the bit vectors of the points examined by the
+// queries of a bucket-major batch (see
+// R2getNearNeighborsBatchBucketMajor).
+#define BUCKET_MAJOR_VISITED_BYTES (16 << 20)
+
+// The default of <queryPrefetchDistance>: how many candidates ahead
+// of the one being examined a query prefetches the point (and, half
+// as many ahead, its first DISTANCE_BLOCK_SIZE coordinates). 0
+// disables the prefetching.
+#define QUERY_PREFETCH_DISTANCE 8
+
+// The default of <queryInterleaving>: how many queries a thread of
+// R2getNearNeighborsBatch keeps in flight (see InFlightQueryT). 1
+// answers the queries one after the other. Every query in flight has
+// its own QueryContextT, whose visited stamps and collision counts
+// take 4 bytes per point, so interleaving is opt-in.
+#define QUERY_INTERLEAVING 1
+
 void printRNNParameters(FILE *output, RNNParametersT parameters);
 
 RNNParametersT readRNNParameters(FILE *input);
@@ -181,6 +558,16 @@ PRNearNeighborStructT FinitLSH_WithDataSet(RNNParametersT algParameters, Int32T
 
 PRNearNeighborStructT RinitLSH_WithDataSet(RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet, int subdim);
 
+MemVarT RbuildTablesInGroups(PRNearNeighborStructT nnStruct, RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet, int subdim, IntT nTuplesPerGroup);
+
+PRNearNeighborStructT RinitLSH_WithDataSetMemoryBounded(RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet, int subdim, MemVarT peakMemory);
+
+PUHashStructureT *RbuildShardTables(PRNearNeighborStructT nnStruct, IntT typeHT, Int32T hashTableSize, Uns32T *mainHashA, Uns32T *controlHash1, Int32T nShardPoints, PPointT *shardPoints, int subdim);
+
+void mergeShardTables(PRNearNeighborStructT nnStruct, IntT nShards, PUHashStructureT **shardTables, Int32T *shardFirstPoints);
+
+PRNearNeighborStructT RinitLSH_WithDataSetSharded(RNNParametersT algParameters, Int32T nPoints, PPointT *dataSet, int subdim, IntT nShards);
+
 
 //void optimizeLSH(PRNearNeighborStructT nnStruct);
 void RpreparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point, int subdim);
@@ -189,11 +576,47 @@ void freePRNearNeighborStruct(PRNearNeighborStructT nnStruct);
 
 void setResultReporting(PRNearNeighborStructT nnStruct, BooleanT reportingStopped);
 
+void setQueryLimits(PRNearNeighborStructT nnStruct, QueryLimitsT limits);
+
+BooleanT isLastQueryPartial(PRNearNeighborStructT nnStruct);
+
+void setCollisionRanking(PRNearNeighborStructT nnStruct, CollisionRankingT ranking);
+
 void addNewPointToPRNearNeighborStruct(PRNearNeighborStructT nnStruct, PPointT point);
 
+void RaddNewPointsToPRNearNeighborStruct(PRNearNeighborStructT nnStruct, Int32T nNewPoints, PPointT *newPoints, int subdim);
+
+void mergeDeltaBuckets(PRNearNeighborStructT nnStruct);
+
+void applyHeavyBucketPolicy(PRNearNeighborStructT nnStruct, IntT table, PUHashStructureT modelHT);
+
+void printHeavyBucketStatistics(FILE *output, PRNearNeighborStructT nnStruct);
+
+void printIndexStatistics(FILE *output, PRNearNeighborStructT nnStruct);
+
+void deletePointFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct, Int32T pointIndex);
+
+BooleanT compactPRNearNeighborStructStep(PRNearNeighborStructT nnStruct);
+
+void compactPRNearNeighborStruct(PRNearNeighborStructT nnStruct);
+
 Int32T getNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct, PPointT query, PPointT *(&result), IntT &resultSize, int &num);
 
 Int32T FgetNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct, PPointT query, PPointT *(&result), IntT &resultSize, int &num, int subdim);
 
 Int32T R2getNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct, PPointT query, PPointT *(&result), IntT &resultSize, int &num, int subdim);
+
+PQueryContextT newQueryContext(const RNearNeighborStructT *nnStruct);
+
+void freeQueryContext(PQueryContextT context);
+
+Int32T R2getNearNeighborsWithContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, PPointT *(&result), IntT &resultSize, int subdim);
+
+void R2getNearNeighborsBatch(const RNearNeighborStructT *nnStruct, Int32T nQueries, PPointT *queries, PPointT **results, IntT *resultSizes, Int32T *nNeighbors, Int32T *nExaminedPoints, BooleanT *isPartial, IntT nThreads, int subdim);
+
+void R2getNearNeighborsBatchBucketMajor(const RNearNeighborStructT *nnStruct, Int32T nQueries, PPointT *queries, PPointT **results, IntT *resultSizes, Int32T *nNeighbors, Int32T *nExaminedPoints, int subdim);
+
+IntT R2getKNearestNeighborsWithContext(const RNearNeighborStructT *nnStruct, PQueryContextT context, PPointT query, IntT k, PPointAndRealTStructT *neighbors, int subdim);
+
+IntT R2getKNearestNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct, PPointT query, IntT k, PPointAndRealTStructT *neighbors, int &num, int subdim);
 #endif
@@ -114,7 +114,7 @@ PRNearNeighborStructT initSelfTunedRNearNeighborWithDataSet(RealT thresholdR,
   TIMEV_START(timeInit);
 
   // Init the R-NN data structure.
-  if (optParameters.typeHT != HT_HYBRID_CHAINS){
+  if (!IS_PACKED_TYPE_HT(optParameters.typeHT)){
     nnStruct = initLSH(optParameters, nPoints);
   }else{
     printRNNParameters(DEBUG_OUTPUT, optParameters);
@@ -126,7 +126,7 @@ PRNearNeighborStructT initSelfTunedRNearNeighborWithDataSet(RealT thresholdR,
   DPRINTF("Allocated memory: %lld\n", totalAllocatedMemory);
 
   TimeVarT timeAdding = 0;
-  if (optParameters.typeHT != HT_HYBRID_CHAINS){
+  if (!IS_PACKED_TYPE_HT(optParameters.typeHT)){
     // Add the points to the LSH buckets.
     TIMEV_START(timeAdding);
     for(IntT i = 0; i < nPoints; i++){
@@ -294,3 +294,23 @@ Int32T R2getRNearNeighbors(PRNearNeighborStructT nnStruct, PPointT queryPoint, P
 
   return nNearNeighbors;
 }
+
+// Returns the (at most) <k> nearest R-near neighbors of <queryPoint>
+// found by <nnStruct>, by increasing distance (see
+// R2getKNearestNeighborsWithContext). The time of the query is left in
+// <timeRNNQuery>.
+IntT R2getKNearestNeighbors(PRNearNeighborStructT nnStruct, PPointT queryPoint, IntT k, PPointAndRealTStructT *neighbors, int &num, int subdim)
+{
+  timeRNNQuery = 0;
+  timeTotalBuckets = 0;
+  nOfDistComps = 0;
+
+  TIMEV_START(timeRNNQuery);
+  noExpensiveTiming = !DEBUG_PROFILE_TIMING;
+
+  IntT nNeighbors = R2getKNearestNeighborsFromPRNearNeighborStruct(nnStruct, queryPoint, k, neighbors, num, subdim);
+
+  TIMEV_END(timeRNNQuery);
+
+  return nNeighbors;
+}
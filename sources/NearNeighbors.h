@@ -38,4 +38,6 @@ Int32T getRNearNeighbors(PRNearNeighborStructT nnStruct, PPointT queryPoint, PPo
 Int32T FgetRNearNeighbors(PRNearNeighborStructT nnStruct, PPointT queryPoint, PPointT *(&result), Int32T &resultSize, int &num, int subdim);
 
 Int32T R2getRNearNeighbors(PRNearNeighborStructT nnStruct, PPointT queryPoint, PPointT *(&result), Int32T &resultSize, int &num, int subdim);
+
+IntT R2getKNearestNeighbors(PRNearNeighborStructT nnStruct, PPointT queryPoint, IntT k, PPointAndRealTStructT *neighbors, int &num, int subdim);
 #endif
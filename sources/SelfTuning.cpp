@@ -152,6 +152,14 @@ void determineRTCoefficients(RealT thresholdR,
   algParameters.parameterW = PARAMETER_W_DEFAULT;
   algParameters.parameterT = n;
   algParameters.typeHT = typeHT;
+  algParameters.hashTableSize = hashTableSize;
+  algParameters.heavyBucketPolicy = HEAVY_BUCKET_KEEP;
+  algParameters.heavyBucketThreshold = 0;
+  algParameters.uhfType = UHF_MOD_PRIME;
+  algParameters.memoryPlacement = LARGE_REGION_DEFAULT;
+  algParameters.nProbesPerTable = 0;
+  algParameters.peakBuildMemory = 0;
+  algParameters.nBuildShards = 1;
 
   if (algParameters.useUfunctions){
     algParameters.parameterM = computeMForULSH(algParameters.parameterK, algParameters.successProbability);
@@ -201,6 +209,9 @@ void determineRTCoefficients(RealT thresholdR,
       }
       break;
       case HT_HYBRID_CHAINS:
+      case HT_BUCKET_DIRECTORY:
+      case HT_COMPRESSED_DIRECTORY:
+      case HT_PERFECT_HASH:
       nnStruct = initLSH_WithDataSet(algParameters, n, dataSet);
       break;
       default:
@@ -405,6 +416,13 @@ RNNParametersT computeOptimalParameters(RealT R,
   optParameters.parameterW = PARAMETER_W_DEFAULT;
   optParameters.parameterT = nPoints;
   optParameters.typeHT = HT_HYBRID_CHAINS;
+  optParameters.heavyBucketPolicy = HEAVY_BUCKET_KEEP;
+  optParameters.heavyBucketThreshold = 0;
+  optParameters.uhfType = UHF_MOD_PRIME;
+  optParameters.memoryPlacement = LARGE_REGION_DEFAULT;
+  optParameters.nProbesPerTable = 0;
+  optParameters.peakBuildMemory = 0;
+  optParameters.nBuildShards = 1;
   
   // Compute the run-time parameters (timings of different parts of the algorithm).
   IntT nReps = 10; // # number of repetions
@@ -505,5 +523,20 @@ RNNParametersT computeOptimalParameters(RealT R,
   optParameters.parameterM = m;
   optParameters.parameterL = L;
 
+  // Round the size of the hash tables up to a power of 2 (so that the
+  // slots are computed with a mask) if the additional slots fit in the
+  // memory not used by the tables (the estimate above counts 12 bytes
+  // per point and table).
+  MemVarT hashTableSize = 1;
+  while (hashTableSize < nPoints && hashTableSize <= (MemVarT)MAX_N_POINTS / 2){
+    hashTableSize *= 2;
+  }
+  if ((MemVarT)L * (hashTableSize - nPoints) * hashTableSlotBytes(optParameters.typeHT) <= memoryUpperBound - (MemVarT)L * nPoints * 12){
+    optParameters.hashTableSize = (Int32T)hashTableSize;
+  }else{
+    optParameters.hashTableSize = nPoints;
+  }
+  DPRINTF("STO.Hash table size = %d\n", optParameters.hashTableSize);
+
   return optParameters;
 }
@@ -19,6 +19,12 @@
 
 #include "headers.h"
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 // Verifies whether vector v1 and v2 are equal (component-wise). The
 // size of the vectors is given by the parameter size.
 BooleanT vectorsEqual(IntT size, IntT *v1, IntT *v2){
@@ -88,3 +94,144 @@ MemVarT getAvailableMemory(){
   FAILIFWR(availableTotalMemory < totalAllocatedMemory, "Not enough memory.\n");
   return availableTotalMemory - totalAllocatedMemory; 
 }
+
+// Returns the time (in seconds) of a monotonic wall clock (unlike
+// clock(), which sums the CPU time of all the threads).
+TimeVarT wallClockTime(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// The large regions start with a header (of LARGE_REGION_HEADER_SIZE
+// bytes, so that the region itself stays 64-byte aligned) recording
+// how the region was obtained.
+#define LARGE_REGION_HEADER_SIZE 64
+
+// Regions smaller than this are always taken from the heap.
+#define LARGE_REGION_MIN_MAPPED_SIZE (1 << 20)
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+#define MAX_NUMA_NODES 1024
+
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+typedef struct _LargeRegionHeaderT {
+  // The size of the mapping containing the region (0 if the region is
+  // on the heap).
+  MemVarT mappedSize;
+} LargeRegionHeaderT;
+
+#ifdef __linux__
+// Fills <nodeMask> with the online NUMA nodes (from
+// /sys/devices/system/node/online, e.g. "0-1,4") and returns the
+// number of nodes.
+static IntT getOnlineNumaNodes(unsigned long *nodeMask){
+  memset(nodeMask, 0, MAX_NUMA_NODES / 8);
+  FILE *f = fopen("/sys/devices/system/node/online", "rt");
+  if (f == NULL){
+    return 1;
+  }
+  IntT nNodes = 0;
+  int first, last;
+  while (fscanf(f, "%d", &first) == 1){
+    last = first;
+    if (fscanf(f, "-%d", &last) != 1){
+      last = first;
+    }
+    for(IntT node = first; node <= last && node < MAX_NUMA_NODES; node++){
+      nodeMask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+      nNodes++;
+    }
+    if (fscanf(f, ",") == EOF){
+      break;
+    }
+  }
+  fclose(f);
+  return MAX(nNodes, 1);
+}
+
+// Maps <mappedSize> bytes with the placement <placement>. Returns NULL
+// if the mapping failed.
+static void *mapLargeRegion(MemVarT &mappedSize, IntT placement){
+  void *mapping = MAP_FAILED;
+  if (placement & LARGE_REGION_HUGE_PAGES){
+    MemVarT hugeSize = (mappedSize + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    mapping = mmap(NULL, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mapping != MAP_FAILED){
+      mappedSize = hugeSize;
+    }else{
+      // No huge pages are reserved; use the transparent ones instead.
+      placement |= LARGE_REGION_THP;
+    }
+  }
+  if (mapping == MAP_FAILED){
+    mapping = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED){
+      return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (placement & LARGE_REGION_THP){
+      madvise(mapping, mappedSize, MADV_HUGEPAGE);
+    }
+#endif
+  }
+
+  if (placement & LARGE_REGION_NUMA_INTERLEAVE){
+    // The policy applies to the pages faulted in from now on, so it
+    // has to be set before the region is touched.
+    unsigned long nodeMask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    if (getOnlineNumaNodes(nodeMask) > 1){
+      syscall(SYS_mbind, mapping, mappedSize, MPOL_INTERLEAVE, nodeMask, MAX_NUMA_NODES, 0);
+    }
+  }
+  return mapping;
+}
+#endif
+
+// Allocates a region of <amount> bytes with the placement
+// <placement> (a combination of the LARGE_REGION_* flags). The region is accounted in <totalAllocatedMemory> like any
+// MALLOC, and is released with freeLargeRegion. Without the mmap
+// facilities (or for small regions), the region comes from the heap.
+void *allocateLargeRegion(MemVarT amount, IntT placement){
+  if (amount <= 0){
+    return NULL;
+  }
+  __sync_fetch_and_add(&totalAllocatedMemory, amount);
+
+  MemVarT mappedSize = amount + LARGE_REGION_HEADER_SIZE;
+  char *region = NULL;
+#ifdef __linux__
+  if (placement != LARGE_REGION_HEAP && mappedSize >= LARGE_REGION_MIN_MAPPED_SIZE){
+    region = (char*)mapLargeRegion(mappedSize, placement);
+  }
+#endif
+  if (region == NULL){
+    mappedSize = (mappedSize + LARGE_REGION_HEADER_SIZE - 1) / LARGE_REGION_HEADER_SIZE * LARGE_REGION_HEADER_SIZE;
+    if (NULL == (region = (char*)aligned_alloc(LARGE_REGION_HEADER_SIZE, mappedSize))){
+      return NULL;
+    }
+    mappedSize = 0;
+  }
+  ((LargeRegionHeaderT*)region)->mappedSize = mappedSize;
+  return region + LARGE_REGION_HEADER_SIZE;
+}
+
+// Releases a region allocated with allocateLargeRegion.
+void freeLargeRegion(void *region){
+  ASSERT(region != NULL);
+  char *start = (char*)region - LARGE_REGION_HEADER_SIZE;
+  MemVarT mappedSize = ((LargeRegionHeaderT*)start)->mappedSize;
+  if (mappedSize == 0){
+    free(start);
+    return;
+  }
+#ifdef __linux__
+  munmap(start, mappedSize);
+#else
+  ASSERT(FALSE);
+#endif
+}
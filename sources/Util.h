@@ -34,4 +34,10 @@ void printIntVector(char *s, IntT size, IntT *v);
 
 MemVarT getAvailableMemory();
 
+TimeVarT wallClockTime();
+
+void *allocateLargeRegion(MemVarT amount, IntT placement);
+
+void freeLargeRegion(void *region);
+
 #endif
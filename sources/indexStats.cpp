@@ -0,0 +1,113 @@
+/*
+ *   Copyright (c) 2004-2005 Massachusetts Institute of Technology.
+ *   All Rights Reserved.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *   Authors: Alexandr Andoni (andoni@mit.edu), Piotr Indyk (indyk@mit.edu)
+*/
+
+/*
+  This program builds the R-NN data structures of a data set (as
+  LSHMain -p does) and prints the statistics of their tables: the
+  number of buckets, the histograms of the bucket sizes and of the
+  chain lengths, the number of buckets above
+  MAX_NONOVERFLOW_POINTS_PER_BUCKET, and the bytes of each
+  component. The output is in JSON Lines (see printIndexStatistics);
+  everything else goes to stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "headers.h"
+
+// The dimension of the projected points (as in LSHMain).
+#define DEFAULT_SUBDIM 30
+
+char sBuffer[600000];
+
+void usage(char *programName){
+  fprintf(stderr, "Usage: %s #pts_in_data_set dimension data_set_file params_file [max_available_memory [subdim]]\n", programName);
+}
+
+// Reads <nPoints> points of dimension <dimension> from <filename>;
+// the points are stored in arenas allocated with <placement> (see
+// MALLOC_LARGE).
+PPointT *readDataSet(char *filename, IntT nPoints, IntT dimension, IntT placement){
+  FILE *f = fopen(filename, "rt");
+  FAILIFWR(f == NULL, "Could not open the data set file.");
+  PPointT *points;
+  PPointT pointsArena;
+  RealT *coordinatesArena;
+  FAILIF(NULL == (points = (PPointT*)MALLOC(nPoints * sizeof(PPointT))));
+  FAILIF(NULL == (pointsArena = (PPointT)MALLOC_LARGE((MemVarT)nPoints * sizeof(PointT), placement)));
+  FAILIF(NULL == (coordinatesArena = (RealT*)MALLOC_LARGE((MemVarT)nPoints * dimension * sizeof(RealT), placement)));
+  for(IntT i = 0; i < nPoints; i++){
+    points[i] = pointsArena + i;
+    points[i]->coordinates = coordinatesArena + (MemVarT)i * dimension;
+    RealT sqrLength = 0;
+    for(IntT d = 0; d < dimension; d++){
+      FSCANF_REAL(f, &(points[i]->coordinates[d]));
+      sqrLength += SQR(points[i]->coordinates[d]);
+    }
+    fscanf(f, "%[^\n]", sBuffer);
+    points[i]->index = i;
+    points[i]->sqrLength = sqrLength;
+  }
+  fclose(f);
+  return points;
+}
+
+int main(int nargs, char **args){
+  if (nargs < 5){
+    usage(args[0]);
+    exit(1);
+  }
+
+  IntT nPoints = atoi(args[1]);
+  IntT dimension = atoi(args[2]);
+  if (nargs > 5){
+    availableTotalMemory = atoll(args[5]);
+  }
+  int subdim = nargs > 6 ? atoi(args[6]) : DEFAULT_SUBDIM;
+
+  FAILIFWR(nPoints <= 0 || (Uns32T)nPoints > MAX_N_POINTS, "Invalid number of points.");
+
+  // The parameters are read first: the data set is placed in memory
+  // as the first of them asks.
+  FILE *pFile = fopen(args[4], "rt");
+  FAILIFWR(pFile == NULL, "Could not open the params file.");
+  IntT nRadii;
+  fscanf(pFile, "%d\n", &nRadii);
+  FAILIFWR(nRadii <= 0, "Invalid number of radii in the params file.");
+  RNNParametersT *algParameters;
+  FAILIF(NULL == (algParameters = (RNNParametersT*)MALLOC(nRadii * sizeof(RNNParametersT))));
+  for(IntT r = 0; r < nRadii; r++){
+    algParameters[r] = readRNNParameters(pFile);
+    printRNNParameters(stderr, algParameters[r]);
+    FAILIFWR(algParameters[r].dimension != dimension, "The dimension of the params file differs from the dimension of the data set.");
+  }
+  fclose(pFile);
+
+  PPointT *dataSet = readDataSet(args[3], nPoints, dimension, algParameters[0].memoryPlacement);
+
+  for(IntT r = 0; r < nRadii; r++){
+    PRNearNeighborStructT nnStruct = RinitLSH_WithDataSet(algParameters[r], nPoints, dataSet, subdim);
+    printIndexStatistics(stdout, nnStruct);
+    printHeavyBucketStatistics(stderr, nnStruct);
+    freePRNearNeighborStruct(nnStruct);
+  }
+  FREE(algParameters);
+
+  return 0;
+}